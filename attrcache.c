@@ -0,0 +1,243 @@
+/*
+  Attribute cache
+
+  Keeps the result of remote stats for a short time so that repeated
+  getattr calls on the same path (make, git status, shells) are answered
+  locally. Local mutations either patch or drop the entry.
+
+  Lookups that failed with ENOENT are remembered as well, so probes for
+  nonexistent include and library paths do not go to the remote each time.
+*/
+
+#include "attrcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+
+static struct attr_entry **attr_cache_slot(struct attr_cache *ac, const char *path) {
+  struct attr_entry **slot = &ac->buckets[bb_hash(path) % ATTR_CACHE_BUCKETS];
+  while (*slot != NULL && strcmp((*slot)->path, path) != 0) {
+    slot = &(*slot)->next;
+  }
+  return slot;
+}
+
+static void attr_cache_unlink(struct attr_cache *ac, struct attr_entry **slot) {
+  struct attr_entry *e = *slot;
+  *slot = e->next;
+  free(e->path);
+  free(e);
+  ac->count--;
+}
+
+static void attr_cache_clear(struct attr_cache *ac) {
+  for (int i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+    while (ac->buckets[i] != NULL) {
+      attr_cache_unlink(ac, &ac->buckets[i]);
+    }
+  }
+  for (int i = 0; i < NEG_CACHE_SIZE; i++) {
+    free(ac->neg[i].path);
+    ac->neg[i].path = NULL;
+  }
+}
+
+static void attr_cache_neg_forget(struct attr_cache *ac, const char *path) {
+  struct neg_entry *e = &ac->neg[bb_hash(path) % NEG_CACHE_SIZE];
+  if (e->path != NULL && strcmp(e->path, path) == 0) {
+    free(e->path);
+    e->path = NULL;
+  }
+}
+
+/**
+ * Drop expired entries, or everything if nothing has expired yet
+ */
+static void attr_cache_prune(struct attr_cache *ac) {
+  double now = bb_now();
+  for (int i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+    struct attr_entry **slot = &ac->buckets[i];
+    while (*slot != NULL) {
+      if ((*slot)->expires <= now) {
+        attr_cache_unlink(ac, slot);
+      } else {
+        slot = &(*slot)->next;
+      }
+    }
+  }
+  if (ac->count >= ATTR_CACHE_MAX) {
+    attr_cache_clear(ac);
+  }
+}
+
+void attr_cache_init(struct attr_cache *ac) {
+  pthread_mutex_init(&ac->lock, NULL);
+  memset(ac->buckets, 0, sizeof(ac->buckets));
+  ac->count = 0;
+  ac->ttl = ATTR_CACHE_TTL;
+  ac->hits = 0;
+  ac->misses = 0;
+  memset(ac->neg, 0, sizeof(ac->neg));
+  ac->neg_ttl = NEG_CACHE_TTL;
+  ac->neg_hits = 0;
+}
+
+void attr_cache_destroy(struct attr_cache *ac) {
+  pthread_mutex_lock(&ac->lock);
+  attr_cache_clear(ac);
+  pthread_mutex_unlock(&ac->lock);
+}
+
+/**
+ * Look up path. Returns 1 and fills statbuf on a hit, 0 on a miss.
+ */
+int attr_cache_get(struct attr_cache *ac, const char *path, struct stat *statbuf) {
+  pthread_mutex_lock(&ac->lock);
+  struct attr_entry **slot = attr_cache_slot(ac, path);
+  if (*slot != NULL && (*slot)->expires <= bb_now()) {
+    attr_cache_unlink(ac, slot);
+  }
+  int hit = *slot != NULL;
+  if (hit) {
+    ac->hits++;
+    *statbuf = (*slot)->st;
+  } else {
+    ac->misses++;
+  }
+  pthread_mutex_unlock(&ac->lock);
+  return hit;
+}
+
+void attr_cache_put(struct attr_cache *ac, const char *path, const struct stat *statbuf) {
+  pthread_mutex_lock(&ac->lock);
+  attr_cache_neg_forget(ac, path);
+  struct attr_entry **slot = attr_cache_slot(ac, path);
+  if (*slot == NULL && ac->ttl > 0) {
+    if (ac->count >= ATTR_CACHE_MAX) {
+      attr_cache_prune(ac);
+      slot = attr_cache_slot(ac, path);
+    }
+    struct attr_entry *e = malloc(sizeof(struct attr_entry));
+    char *copy = strdup(path);
+    if (e != NULL && copy != NULL) {
+      e->path = copy;
+      e->next = NULL;
+      *slot = e;
+      ac->count++;
+    } else {
+      free(e);
+      free(copy);
+    }
+  }
+  if (*slot != NULL) {
+    (*slot)->st = *statbuf;
+    (*slot)->expires = bb_now() + ac->ttl;
+  }
+  pthread_mutex_unlock(&ac->lock);
+}
+
+/**
+ * A local write reached offset end: grow the cached size and bump mtime
+ */
+void attr_cache_extend(struct attr_cache *ac, const char *path, off_t end) {
+  pthread_mutex_lock(&ac->lock);
+  struct attr_entry *e = *attr_cache_slot(ac, path);
+  if (e != NULL) {
+    if (end > e->st.st_size) {
+      e->st.st_size = end;
+      e->st.st_blocks = (end + 511) / 512;
+    }
+    e->st.st_mtime = e->st.st_ctime = time(NULL);
+  }
+  pthread_mutex_unlock(&ac->lock);
+}
+
+void attr_cache_invalidate(struct attr_cache *ac, const char *path) {
+  pthread_mutex_lock(&ac->lock);
+  struct attr_entry **slot = attr_cache_slot(ac, path);
+  if (*slot != NULL) {
+    attr_cache_unlink(ac, slot);
+  }
+  pthread_mutex_unlock(&ac->lock);
+}
+
+static int attr_cache_under(const char *p, const char *path, size_t len) {
+  return strncmp(p, path, len) == 0 && (p[len] == '\0' || p[len] == '/');
+}
+
+/**
+ * Drop path and everything below it, found or missing, as for a directory
+ * that was renamed
+ */
+void attr_cache_invalidate_tree(struct attr_cache *ac, const char *path) {
+  size_t len = strlen(path);
+  pthread_mutex_lock(&ac->lock);
+  for (int i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+    struct attr_entry **slot = &ac->buckets[i];
+    while (*slot != NULL) {
+      if (attr_cache_under((*slot)->path, path, len)) {
+        attr_cache_unlink(ac, slot);
+      } else {
+        slot = &(*slot)->next;
+      }
+    }
+  }
+  for (int i = 0; i < NEG_CACHE_SIZE; i++) {
+    if (ac->neg[i].path != NULL && attr_cache_under(ac->neg[i].path, path, len)) {
+      free(ac->neg[i].path);
+      ac->neg[i].path = NULL;
+    }
+  }
+  pthread_mutex_unlock(&ac->lock);
+}
+
+/**
+ * Returns 1 if path was recently found not to exist on the remote
+ */
+int attr_cache_is_missing(struct attr_cache *ac, const char *path) {
+  pthread_mutex_lock(&ac->lock);
+  struct neg_entry *e = &ac->neg[bb_hash(path) % NEG_CACHE_SIZE];
+  int missing = 0;
+  if (e->path != NULL && strcmp(e->path, path) == 0) {
+    if (e->expires <= bb_now()) {
+      free(e->path);
+      e->path = NULL;
+    } else {
+      ac->neg_hits++;
+      missing = 1;
+    }
+  }
+  pthread_mutex_unlock(&ac->lock);
+  return missing;
+}
+
+/**
+ * Remember that path does not exist. A colliding older entry is replaced.
+ */
+void attr_cache_put_missing(struct attr_cache *ac, const char *path) {
+  if (ac->neg_ttl <= 0) {
+    return;
+  }
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&ac->lock);
+  struct neg_entry *e = &ac->neg[bb_hash(path) % NEG_CACHE_SIZE];
+  free(e->path);
+  e->path = copy;
+  e->expires = bb_now() + ac->neg_ttl;
+  pthread_mutex_unlock(&ac->lock);
+}
+
+/**
+ * path was just created, so any negative entry for it is wrong now
+ */
+void attr_cache_forget_missing(struct attr_cache *ac, const char *path) {
+  pthread_mutex_lock(&ac->lock);
+  attr_cache_neg_forget(ac, path);
+  pthread_mutex_unlock(&ac->lock);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define ATTR_CACHE_BUCKETS 4096
+#define ATTR_CACHE_MAX 65536
+#define ATTR_CACHE_TTL 2.0
+#define NEG_CACHE_SIZE 1024
+#define NEG_CACHE_TTL 1.0
+
+struct attr_entry {
+  char *path;
+  struct stat st;
+  double expires;
+  struct attr_entry *next;
+};
+
+struct neg_entry {
+  char *path;
+  double expires;
+};
+
+// Remote attributes keyed by full remote path, valid for ttl seconds.
+// Paths known not to exist live in a fixed direct-mapped table, so the
+// negative side never grows past NEG_CACHE_SIZE entries. Every function
+// takes the cache lock, so it can be shared between threads.
+struct attr_cache {
+  pthread_mutex_t lock;
+  struct attr_entry *buckets[ATTR_CACHE_BUCKETS];
+  int count;
+  double ttl; // seconds, 0 disables the cache
+  unsigned long hits;
+  unsigned long misses;
+  struct neg_entry neg[NEG_CACHE_SIZE];
+  double neg_ttl; // seconds, 0 disables negative entries
+  unsigned long neg_hits;
+};
+
+void attr_cache_init(struct attr_cache *ac);
+void attr_cache_destroy(struct attr_cache *ac);
+int attr_cache_get(struct attr_cache *ac, const char *path, struct stat *statbuf);
+void attr_cache_put(struct attr_cache *ac, const char *path, const struct stat *statbuf);
+void attr_cache_extend(struct attr_cache *ac, const char *path, off_t end);
+void attr_cache_invalidate(struct attr_cache *ac, const char *path);
+void attr_cache_invalidate_tree(struct attr_cache *ac, const char *path);
+int attr_cache_is_missing(struct attr_cache *ac, const char *path);
+void attr_cache_put_missing(struct attr_cache *ac, const char *path);
+void attr_cache_forget_missing(struct attr_cache *ac, const char *path);
@@ -0,0 +1,329 @@
+/*
+  bbfs-helper
+
+  The remote end of the helper protocol in helper.h. bbfs starts it once
+  per mount over an ssh channel and sends it requests on stdin; replies go
+  to stdout. Paths are absolute paths on this host. It exits at the end
+  of its input.
+
+  Install it on the remote host somewhere in the PATH of the login, or
+  give its path with -o helper=PATH.
+*/
+
+#include "helper.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int read_full(int fd, void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data = (char *) data + n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data = (const char *) data + n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void set32(unsigned char *q, uint32_t v) {
+  q[0] = v >> 24;
+  q[1] = v >> 16;
+  q[2] = v >> 8;
+  q[3] = v;
+}
+
+static int serve_stat(struct helper_buf *in, struct helper_buf *out) {
+  char path[PATH_MAX];
+  struct stat statbuf;
+  if (helper_get_string(in, path, sizeof(path)) < 0) {
+    return -EINVAL;
+  }
+  if (lstat(path, &statbuf) < 0) {
+    return -errno;
+  }
+  helper_put_stat(out, &statbuf);
+  return 0;
+}
+
+static int serve_readdir(struct helper_buf *in, struct helper_buf *out) {
+  char path[PATH_MAX];
+  if (helper_get_string(in, path, sizeof(path)) < 0) {
+    return -EINVAL;
+  }
+  DIR *dp = opendir(path);
+  if (dp == NULL) {
+    return -errno;
+  }
+  // the count goes in front once it is known
+  size_t at = out->len;
+  uint32_t count = 0;
+  helper_put32(out, 0);
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    struct stat statbuf;
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0
+        || fstatat(dirfd(dp), de->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+      continue;
+    }
+    if (out->len + strlen(de->d_name) + 4 + HELPER_STAT_SIZE > HELPER_FRAME_MAX - 64) {
+      closedir(dp);
+      return -E2BIG;
+    }
+    helper_put_string(out, de->d_name);
+    helper_put_stat(out, &statbuf);
+    count++;
+  }
+  closedir(dp);
+  if (!out->bad) {
+    set32(out->data + at, count);
+  }
+  return 0;
+}
+
+static int serve_read(struct helper_buf *in, struct helper_buf *out) {
+  char path[PATH_MAX];
+  if (helper_get_string(in, path, sizeof(path)) < 0) {
+    return -EINVAL;
+  }
+  off_t offset = helper_get64(in);
+  uint32_t size = helper_get32(in);
+  if (in->bad || size > HELPER_IO_MAX) {
+    return -EINVAL;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -errno;
+  }
+  char *buf = malloc(size > 0 ? size : 1);
+  if (buf == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+  size_t got = 0;
+  int retstat = 0;
+  while (got < size) {
+    ssize_t n = pread(fd, buf + got, size - got, offset + got);
+    if (n < 0 && errno != EINTR) {
+      retstat = -errno;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    if (n > 0) {
+      got += n;
+    }
+  }
+  close(fd);
+  if (retstat == 0) {
+    helper_put_bytes(out, buf, got);
+  }
+  free(buf);
+  return retstat;
+}
+
+static int serve_write(struct helper_buf *in, struct helper_buf *out) {
+  char path[PATH_MAX];
+  uint32_t len;
+  if (helper_get_string(in, path, sizeof(path)) < 0) {
+    return -EINVAL;
+  }
+  off_t offset = helper_get64(in);
+  const unsigned char *data = helper_get_bytes(in, &len);
+  if (data == NULL) {
+    return -EINVAL;
+  }
+  int fd = open(path, O_WRONLY);
+  if (fd < 0) {
+    return -errno;
+  }
+  uint32_t done = 0;
+  int retstat = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, data + done, len - done, offset + done);
+    if (n < 0 && errno != EINTR) {
+      retstat = -errno;
+      break;
+    }
+    if (n > 0) {
+      done += n;
+    }
+  }
+  close(fd);
+  helper_put32(out, done);
+  return done > 0 ? 0 : retstat;
+}
+
+static int serve_hash(struct helper_buf *in, struct helper_buf *out) {
+  char path[PATH_MAX];
+  if (helper_get_string(in, path, sizeof(path)) < 0) {
+    return -EINVAL;
+  }
+  uint64_t first = helper_get64(in);
+  uint32_t count = helper_get32(in);
+  uint32_t block = helper_get32(in);
+  if (in->bad || count == 0 || count > HELPER_HASH_BATCH || block == 0 || block > HELPER_IO_MAX) {
+    return -EINVAL;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -errno;
+  }
+  unsigned char *buf = malloc(block);
+  unsigned char *digests = malloc((size_t) count * HELPER_DIGEST_SIZE);
+  if (buf == NULL || digests == NULL) {
+    free(buf);
+    free(digests);
+    close(fd);
+    return -ENOMEM;
+  }
+  int retstat = 0;
+  for (uint32_t i = 0; i < count && retstat == 0; i++) {
+    off_t offset = (first + i) * block;
+    size_t got = 0;
+    while (got < block) {
+      ssize_t n = pread(fd, buf + got, block - got, offset + got);
+      if (n < 0 && errno != EINTR) {
+        retstat = -errno;
+        break;
+      }
+      if (n == 0) {
+        break;
+      }
+      if (n > 0) {
+        got += n;
+      }
+    }
+    helper_digest(buf, got, digests + (size_t) i * HELPER_DIGEST_SIZE);
+  }
+  if (retstat == 0) {
+    helper_put_bytes(out, digests, (size_t) count * HELPER_DIGEST_SIZE);
+  }
+  free(buf);
+  free(digests);
+  close(fd);
+  return retstat;
+}
+
+static int serve_truncate(struct helper_buf *in) {
+  char path[PATH_MAX];
+  if (helper_get_string(in, path, sizeof(path)) < 0) {
+    return -EINVAL;
+  }
+  off_t size = helper_get64(in);
+  if (in->bad) {
+    return -EINVAL;
+  }
+  return truncate(path, size) < 0 ? -errno : 0;
+}
+
+static int serve_rename(struct helper_buf *in) {
+  char path[PATH_MAX], newpath[PATH_MAX];
+  if (helper_get_string(in, path, sizeof(path)) < 0 || helper_get_string(in, newpath, sizeof(newpath)) < 0) {
+    return -EINVAL;
+  }
+  return rename(path, newpath) < 0 ? -errno : 0;
+}
+
+static int serve(unsigned char op, struct helper_buf *in, struct helper_buf *out) {
+  switch (op) {
+    case HELPER_HELLO:
+      helper_get32(in);
+      helper_put32(out, HELPER_VERSION);
+      return 0;
+    case HELPER_STAT:
+      return serve_stat(in, out);
+    case HELPER_READDIR:
+      return serve_readdir(in, out);
+    case HELPER_READ:
+      return serve_read(in, out);
+    case HELPER_WRITE:
+      return serve_write(in, out);
+    case HELPER_HASH:
+      return serve_hash(in, out);
+    case HELPER_TRUNCATE:
+      return serve_truncate(in);
+    case HELPER_RENAME:
+      return serve_rename(in);
+    default:
+      return -ENOSYS;
+  }
+}
+
+int main(void) {
+  struct helper_buf in = {0};
+  for (;;) {
+    unsigned char head[4];
+    if (read_full(0, head, sizeof(head)) < 0) {
+      free(in.data);
+      return 0;
+    }
+    in.len = in.pos = 0;
+    in.bad = 0;
+    uint32_t len = (uint32_t) head[0] << 24 | (uint32_t) head[1] << 16 | (uint32_t) head[2] << 8 | head[3];
+    if (len < 5 || len > HELPER_FRAME_MAX) {
+      fprintf(stderr, "bbfs-helper: bad request length %u\n", len);
+      return 1;
+    }
+    if (in.cap < len) {
+      free(in.data);
+      in.data = malloc(len);
+      in.cap = len;
+      if (in.data == NULL) {
+        return 1;
+      }
+    }
+    if (read_full(0, in.data, len) < 0) {
+      return 1;
+    }
+    in.len = len;
+    unsigned char op = in.data[0];
+    in.pos = 1;
+    uint32_t id = helper_get32(&in);
+
+    // length, id and status, then the results
+    struct helper_buf out = {0};
+    helper_put32(&out, 0);
+    helper_put32(&out, id);
+    helper_put32(&out, 0);
+    int32_t status = serve(op, &in, &out);
+    if (out.bad) {
+      return 1;
+    }
+    if (status < 0) {
+      out.len = 12;
+    }
+    set32(out.data, out.len - 4);
+    set32(out.data + 8, (uint32_t) status);
+    if (write_full(1, out.data, out.len) < 0) {
+      return 1;
+    }
+    free(out.data);
+  }
+}
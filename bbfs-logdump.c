@@ -0,0 +1,222 @@
+/*
+  bbfs-logdump
+
+  Prints a bbfs log written as binary records (see logbuf.h) as the text
+  bbfs writes with -o log_text. A log that is already text is copied as
+  it is. Must run on a host with the byte order of the one that wrote it.
+
+  usage: bbfs-logdump LOGFILE
+*/
+
+#include "logbuf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Format strings by the address they had in bbfs
+struct format {
+  uint64_t key;
+  char *text;
+};
+
+static struct format *formats;
+static size_t nformats, formats_cap;
+
+static struct format *find_format(uint64_t key, int add) {
+  if (formats_cap > 0) {
+    for (size_t slot = (key >> 3) % formats_cap; formats[slot].text != NULL; slot = (slot + 1) % formats_cap) {
+      if (formats[slot].key == key) {
+        return &formats[slot];
+      }
+    }
+  }
+  if (!add) {
+    return NULL;
+  }
+  if (2 * (nformats + 1) > formats_cap) {
+    struct format *old = formats;
+    size_t old_cap = formats_cap;
+    formats_cap = formats_cap ? 2 * formats_cap : 1024;
+    formats = calloc(formats_cap, sizeof(struct format));
+    if (formats == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    nformats = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].text != NULL) {
+        *find_format(old[i].key, 1) = old[i];
+      }
+    }
+    free(old);
+  }
+  size_t slot = (key >> 3) % formats_cap;
+  while (formats[slot].text != NULL) {
+    slot = (slot + 1) % formats_cap;
+  }
+  formats[slot].key = key;
+  nformats++;
+  return &formats[slot];
+}
+
+/**
+ * Print one conversion of an event with the value read from q, moving q
+ * past it. Returns 0, or -1 if the event has no value left for it.
+ */
+static int print_spec(const struct logbuf_spec *spec, const char **q, const char *end) {
+  // the conversion with * replaced by the stored width and precision
+  char conv[64];
+  size_t n = 0;
+  for (size_t i = 0; i < spec->len && n < sizeof(conv) - 16; i++) {
+    if (spec->start[i] == '*') {
+      int64_t v;
+      if (end - *q < 8) {
+        return -1;
+      }
+      memcpy(&v, *q, 8);
+      *q += 8;
+      n += snprintf(conv + n, sizeof(conv) - n, "%d", (int) v);
+    } else {
+      conv[n++] = spec->start[i];
+    }
+  }
+  conv[n] = '\0';
+  if (spec->arg == LOGBUF_ARG_STR) {
+    uint32_t len;
+    if (end - *q < 4) {
+      return -1;
+    }
+    memcpy(&len, *q, 4);
+    if ((size_t) (end - *q - 4) < len) {
+      return -1;
+    }
+    char *s = strndup(*q + 4, len);
+    printf(conv, s);
+    free(s);
+    *q += 4 + len;
+    return 0;
+  }
+  uint64_t v;
+  double d;
+  if (end - *q < 8) {
+    return -1;
+  }
+  memcpy(&v, *q, 8);
+  memcpy(&d, *q, 8);
+  *q += 8;
+  int is_unsigned = strchr("ouxXc", spec->conv) != NULL;
+  switch (spec->arg) {
+    case LOGBUF_ARG_INT:
+      if (is_unsigned) printf(conv, (unsigned int) v); else printf(conv, (int) v);
+      break;
+    case LOGBUF_ARG_LONG:
+      if (is_unsigned) printf(conv, (unsigned long) v); else printf(conv, (long) v);
+      break;
+    case LOGBUF_ARG_LLONG:
+    case LOGBUF_ARG_INTMAX:
+    case LOGBUF_ARG_SIZE:
+    case LOGBUF_ARG_PTRDIFF:
+      if (is_unsigned) printf(conv, (unsigned long long) v); else printf(conv, (long long) v);
+      break;
+    case LOGBUF_ARG_DOUBLE:
+      printf(conv, d);
+      break;
+    case LOGBUF_ARG_LDOUBLE:
+      printf(conv, (long double) d);
+      break;
+    case LOGBUF_ARG_PTR:
+      if (spec->conv == 'p') printf(conv, (void *) (uintptr_t) v);
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+static void print_event(const struct logbuf_record *rec, const char *args) {
+  struct format *f = find_format(rec->key, 0);
+  if (f == NULL) {
+    printf("[event of unknown format %llx]\n", (unsigned long long) rec->key);
+    return;
+  }
+  if (rec->command) {
+    printf("%llu ", (unsigned long long) rec->time);
+  }
+  const char *q = args, *end = (const char *) rec + rec->len;
+  struct logbuf_spec spec;
+  const char *p = f->text, *next;
+  while ((next = logbuf_next_spec(p, &spec)) != NULL) {
+    fwrite(p, 1, spec.start - p, stdout);
+    if (spec.arg == LOGBUF_ARG_NONE) {
+      if (spec.conv == '%') {
+        putchar('%');
+      } else {
+        fwrite(spec.start, 1, spec.len, stdout);
+      }
+    } else if (print_spec(&spec, &q, end) < 0) {
+      // arguments past LOGBUF_ARGS_MAX were not kept
+      fwrite(spec.start, 1, spec.len, stdout);
+    }
+    p = next;
+  }
+  fputs(p, stdout);
+  if (rec->command) {
+    putchar('\n');
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s LOGFILE\n", argv[0]);
+    return 1;
+  }
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  char magic[sizeof(LOGBUF_MAGIC) - 1];
+  size_t got = fread(magic, 1, sizeof(magic), in);
+  if (got < sizeof(magic) || memcmp(magic, LOGBUF_MAGIC, sizeof(magic)) != 0) {
+    // a text log
+    char buf[65536];
+    fwrite(magic, 1, got, stdout);
+    while ((got = fread(buf, 1, sizeof(buf), in)) > 0) {
+      fwrite(buf, 1, got, stdout);
+    }
+    return 0;
+  }
+
+  char *rec = malloc(LOGBUF_RECORD_MAX);
+  size_t cap = LOGBUF_RECORD_MAX;
+  struct logbuf_record hdr;
+  while (fread(&hdr, sizeof(hdr), 1, in) == 1) {
+    if (hdr.len < sizeof(hdr)) {
+      fprintf(stderr, "%s: bad record length %u\n", argv[1], hdr.len);
+      return 1;
+    }
+    if (hdr.len + 1 > cap) {
+      cap = hdr.len + 1;
+      rec = realloc(rec, cap);
+    }
+    if (rec == NULL) {
+      perror("malloc");
+      return 1;
+    }
+    memcpy(rec, &hdr, sizeof(hdr));
+    if (fread(rec + sizeof(hdr), 1, hdr.len - sizeof(hdr), in) != hdr.len - sizeof(hdr)) {
+      fprintf(stderr, "%s: log ends in the middle of a record\n", argv[1]);
+      return 1;
+    }
+    if (hdr.type == LOGBUF_FORMAT) {
+      struct format *f = find_format(hdr.key, 1);
+      free(f->text);
+      f->text = strndup(rec + sizeof(hdr), hdr.len - sizeof(hdr));
+    } else if (hdr.type == LOGBUF_EVENT) {
+      print_event((struct logbuf_record *) rec, rec + sizeof(hdr));
+    }
+  }
+  free(rec);
+  return 0;
+}
@@ -0,0 +1,357 @@
+/*
+  bbfs-replay
+
+  Issues the operations of a trace written with -o trace=FILE again under
+  a mount point, each at the time it started in the trace divided by the
+  speed (0 runs them back to back), and prints per operation the mean
+  latency in the trace and in the replay. Operations on one open file
+  keep their order, since they run on the same thread; the rest are
+  spread over the threads by path, so with -j above 1 operations on
+  different paths can run in another order than traced (a create before
+  its mkdir). Opens are matched to later reads, writes and releases by
+  the trace's handle numbers.
+
+  The replay goes through the kernel like the original did, but the
+  kernel's own lookups are not in the trace, so the replayed mount sees
+  them once more. Directory listings are replayed at opendir; readdir,
+  releasedir, fsyncdir, flush (done by close) and chown are skipped.
+  Written data is a fixed pattern.
+
+  usage: bbfs-replay [-s SPEED] [-j THREADS] TRACE MOUNTPOINT
+*/
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define REPLAY_THREADS_MAX 64
+
+struct replay_op {
+  unsigned long calls;
+  unsigned long mismatches; // failed in one run and not the other, or moved other byte counts
+  uint64_t traced_ns, replayed_ns;
+};
+
+struct worker {
+  pthread_t thread;
+  struct trace_event **events; // in start order
+  size_t count, cap;
+  struct replay_op ops[STATS_OPS];
+  unsigned long skipped;
+  uint64_t max_lag_ns; // how far behind its start time an operation was issued
+};
+
+static const char *mount;
+static double speed = 1;
+static uint64_t replay_start;
+static int *fds; // by handle, -1 when not open
+static size_t max_size; // largest read, write or xattr buffer in the trace
+
+static void full_path(char *out, const char *path) {
+  snprintf(out, PATH_MAX, "%s%s", mount, path);
+}
+
+static int fd_of(const struct trace_event *ev) {
+  return fds[ev->handle];
+}
+
+static int result(int rc) {
+  return rc < 0 ? -errno : rc;
+}
+
+/**
+ * Issue ev under the mount. Returns what the operation would have
+ * returned through FUSE, or 1 with *skip set for operations not replayed.
+ */
+static int replay(const struct trace_event *ev, char *buf, int *skip) {
+  char path[PATH_MAX], path2[PATH_MAX];
+  struct stat st;
+  full_path(path, ev->path);
+  if (ev->path2 != NULL) {
+    full_path(path2, ev->path2);
+  }
+  *skip = 0;
+  switch (ev->op) {
+  case STATS_GETATTR:
+    return result(lstat(path, &st));
+  case STATS_READLINK:
+    return readlink(path, buf, ev->size) < 0 ? -errno : 0;
+  case STATS_MKNOD:
+    return result(mknod(path, ev->arg, 0));
+  case STATS_MKDIR:
+    return result(mkdir(path, ev->arg));
+  case STATS_UNLINK:
+    return result(unlink(path));
+  case STATS_RMDIR:
+    return result(rmdir(path));
+  case STATS_SYMLINK:
+    // the first path is the link's contents, not a path under the mount
+    return result(symlink(ev->path, path2));
+  case STATS_RENAME:
+    return result(rename(path, path2));
+  case STATS_LINK:
+    return result(link(path, path2));
+  case STATS_CHMOD:
+    return result(chmod(path, ev->arg));
+  case STATS_TRUNCATE:
+    return result(truncate(path, ev->offset));
+  case STATS_UTIME:
+    return result(utime(path, NULL));
+  case STATS_OPEN: {
+    int fd = open(path, ev->arg);
+    if (fd < 0) {
+      return -errno;
+    }
+    fds[ev->handle] = fd;
+    return 0;
+  }
+  case STATS_READ:
+    return result(pread(fd_of(ev), buf, ev->size, ev->offset));
+  case STATS_WRITE:
+    return result(pwrite(fd_of(ev), buf, ev->size, ev->offset));
+  case STATS_STATFS: {
+    struct statvfs sv;
+    return result(statvfs(path, &sv));
+  }
+  case STATS_RELEASE: {
+    int fd = fd_of(ev);
+    fds[ev->handle] = -1;
+    return result(close(fd));
+  }
+  case STATS_FSYNC:
+    return result(ev->arg ? fdatasync(fd_of(ev)) : fsync(fd_of(ev)));
+  case STATS_SETXATTR:
+    return result(lsetxattr(path, ev->path2, buf, ev->size, ev->arg));
+  case STATS_GETXATTR:
+    return result(lgetxattr(path, ev->path2, buf, ev->size));
+  case STATS_LISTXATTR:
+    return result(llistxattr(path, buf, ev->size));
+  case STATS_REMOVEXATTR:
+    return result(lremovexattr(path, ev->path2));
+  case STATS_OPENDIR: {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+      return -errno;
+    }
+    while (readdir(dir) != NULL) {
+    }
+    closedir(dir);
+    return 0;
+  }
+  case STATS_ACCESS:
+    return result(access(path, ev->arg));
+  case STATS_FTRUNCATE:
+    return result(ftruncate(fd_of(ev), ev->offset));
+  case STATS_FGETATTR:
+    return result(fstat(fd_of(ev), &st));
+  default:
+    *skip = 1;
+    return 1;
+  }
+}
+
+static void sleep_until(uint64_t t) {
+  uint64_t now = stats_now();
+  if (t > now) {
+    struct timespec ts = { (t - now) / 1000000000, (t - now) % 1000000000 };
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void *worker_run(void *arg) {
+  struct worker *w = arg;
+  char *buf = malloc(max_size + 1);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(buf, 'x', max_size + 1);
+  for (size_t i = 0; i < w->count; i++) {
+    struct trace_event *ev = w->events[i];
+    if (speed > 0) {
+      uint64_t due = replay_start + (uint64_t) (ev->start_ns / speed);
+      sleep_until(due);
+      uint64_t now = stats_now();
+      if (now > due && now - due > w->max_lag_ns) {
+        w->max_lag_ns = now - due;
+      }
+    }
+    int skip;
+    uint64_t start = stats_now();
+    int rc = replay(ev, buf, &skip);
+    uint64_t latency = stats_now() - start;
+    if (skip) {
+      w->skipped++;
+      continue;
+    }
+    struct replay_op *op = &w->ops[ev->op];
+    op->calls++;
+    op->traced_ns += ev->latency_ns;
+    op->replayed_ns += latency;
+    if ((rc < 0) != (ev->result < 0) || ((ev->op == STATS_READ || ev->op == STATS_WRITE) && rc != ev->result)) {
+      op->mismatches++;
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+static int by_start(const void *a, const void *b) {
+  const struct trace_event *x = *(struct trace_event *const *) a, *y = *(struct trace_event *const *) b;
+  if (x->start_ns != y->start_ns) {
+    return x->start_ns < y->start_ns ? -1 : 1;
+  }
+  return x < y ? -1 : x > y;
+}
+
+static void add_event(struct worker *w, struct trace_event *ev) {
+  if (w->count == w->cap) {
+    w->cap = w->cap ? 2 * w->cap : 1024;
+    w->events = realloc(w->events, w->cap * sizeof(*w->events));
+    if (w->events == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  w->events[w->count++] = ev;
+}
+
+int main(int argc, char *argv[]) {
+  int threads = 1, opt;
+  while ((opt = getopt(argc, argv, "s:j:")) != -1) {
+    if (opt == 's') {
+      speed = atof(optarg);
+    } else if (opt == 'j') {
+      threads = atoi(optarg);
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc - optind != 2 || speed < 0 || threads < 1 || threads > REPLAY_THREADS_MAX) {
+    fprintf(stderr, "usage: %s [-s SPEED, 0 for no pauses] [-j THREADS] TRACE MOUNTPOINT\n", argv[0]);
+    return 1;
+  }
+  mount = argv[optind + 1];
+  FILE *in = fopen(argv[optind], "r");
+  if (in == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  // events point into their lines, which are kept
+  struct trace_event *events = NULL;
+  size_t count = 0, cap = 0;
+  uint64_t max_handle = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  while (getline(&line, &line_cap, in) > 0) {
+    if (count == cap) {
+      cap = cap ? 2 * cap : 4096;
+      events = realloc(events, cap * sizeof(*events));
+      if (events == NULL) {
+        perror("realloc");
+        return 1;
+      }
+    }
+    char *copy = strdup(line);
+    if (copy == NULL || trace_parse(copy, &events[count]) < 0) {
+      free(copy);
+      continue;
+    }
+    struct trace_event *ev = &events[count++];
+    if (ev->handle > max_handle) {
+      max_handle = ev->handle;
+    }
+    if (ev->size > max_size && ev->op != STATS_TRUNCATE) {
+      max_size = ev->size;
+    }
+  }
+  free(line);
+  fclose(in);
+
+  fds = malloc((max_handle + 1) * sizeof(int));
+  struct trace_event **order = malloc(count * sizeof(*order));
+  struct worker *workers = calloc(threads, sizeof(*workers));
+  if (fds == NULL || (count > 0 && order == NULL) || workers == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  for (uint64_t h = 0; h <= max_handle; h++) {
+    fds[h] = -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    order[i] = &events[i];
+  }
+  qsort(order, count, sizeof(*order), by_start);
+  uint64_t first = count > 0 ? order[0]->start_ns : 0, span = 0;
+  size_t dispatched = 0;
+  for (size_t i = 0; i < count; i++) {
+    struct trace_event *ev = order[i];
+    ev->start_ns -= first;
+    span = ev->start_ns + ev->latency_ns > span ? ev->start_ns + ev->latency_ns : span;
+    // what a failed open refers to never existed
+    if (ev->handle != 0 && ev->op != STATS_OPEN && fds[ev->handle] == -2) {
+      continue;
+    }
+    if (ev->op == STATS_OPEN && ev->result < 0) {
+      fds[ev->handle] = -2;
+      continue;
+    }
+    uint32_t key = ev->handle != 0 ? (uint32_t) ev->handle : bb_hash(ev->path);
+    add_event(&workers[key % threads], ev);
+    dispatched++;
+  }
+  for (uint64_t h = 0; h <= max_handle; h++) {
+    fds[h] = -1;
+  }
+
+  replay_start = stats_now();
+  for (int t = 0; t < threads; t++) {
+    pthread_create(&workers[t].thread, NULL, worker_run, &workers[t]);
+  }
+  struct replay_op total[STATS_OPS] = { { 0 } };
+  unsigned long skipped = 0;
+  uint64_t max_lag = 0;
+  for (int t = 0; t < threads; t++) {
+    pthread_join(workers[t].thread, NULL);
+    for (int op = 0; op < STATS_OPS; op++) {
+      total[op].calls += workers[t].ops[op].calls;
+      total[op].mismatches += workers[t].ops[op].mismatches;
+      total[op].traced_ns += workers[t].ops[op].traced_ns;
+      total[op].replayed_ns += workers[t].ops[op].replayed_ns;
+    }
+    skipped += workers[t].skipped;
+    max_lag = workers[t].max_lag_ns > max_lag ? workers[t].max_lag_ns : max_lag;
+  }
+  double elapsed = (stats_now() - replay_start) / 1e9;
+
+  printf("%-12s %10s %12s %12s %8s %10s\n", "op", "calls", "traced_us", "replayed_us", "ratio", "mismatch");
+  for (int op = 0; op < STATS_OPS; op++) {
+    struct replay_op *o = &total[op];
+    if (o->calls == 0) {
+      continue;
+    }
+    printf("%-12s %10lu %12.1f %12.1f %8.2f %10lu\n", stats_name(op), o->calls,
+           o->traced_ns / 1e3 / o->calls, o->replayed_ns / 1e3 / o->calls,
+           o->traced_ns > 0 ? (double) o->replayed_ns / o->traced_ns : 0.0, o->mismatches);
+  }
+  printf("%zu operations of a %.3f s trace replayed in %.3f s at speed %g, %lu skipped, at most %.1f ms behind\n",
+         dispatched, span / 1e9, elapsed, speed, skipped, max_lag / 1e6);
+  return 0;
+}
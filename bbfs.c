@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <malloc.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -22,6 +23,10 @@
 #endif
 
 #include "log.h"
+#include "util.h"
+
+struct bb_state *bb_global;
+__thread struct bb_conn *bb_thread_conn;
 
 void sys_error(const char* msg) {
   perror(msg);
@@ -33,7 +38,7 @@ void sys_error(const char* msg) {
 static void bb_fullpath(char fpath[PATH_MAX], const char *path) {
   strcpy(fpath, BB_DATA->rootdir);
   strncat(fpath, path, PATH_MAX); // ridiculously long paths will
-  log_msg("    bb_fullpath:  rootdir = \"%s\", path = \"%s\", fpath = \"%s\"\n", BB_DATA->rootdir, path, fpath);
+  log_debug("    bb_fullpath:  rootdir = \"%s\", path = \"%s\", fpath = \"%s\"\n", BB_DATA->rootdir, path, fpath);
 }
 
 /////// SSH stuff
@@ -44,7 +49,7 @@ void ssh_free_session(ssh_session session) {
 }
 
 void ssh_error(ssh_session session) {
-  log_msg("SSH Error: %s\n", ssh_get_error(session));
+  log_failure("SSH Error: %s\n", ssh_get_error(session));
   ssh_free_session(session);
   exit(SSH_ERROR);
 }
@@ -83,243 +88,2527 @@ int ssh_execute(ssh_session session, char* command, char* output, int size) {
   return SSH_OK;
 }
 
-char* scp_receive(ssh_session session, ssh_scp scp, int *size) {
+// An SFTP request of the ssh transport, counted for the stats report
+#define sftp_request(call) (bb_count(BB_DATA->sftp_requests, 1), (call))
+
+/**
+ * Map the status of the last failed sftp request to a negative errno
+ */
+int sftp_errno(sftp_session sftp) {
+  switch (sftp_get_error(sftp)) {
+    case SSH_FX_NO_SUCH_FILE:
+    case SSH_FX_NO_SUCH_PATH:
+      return -ENOENT;
+    case SSH_FX_PERMISSION_DENIED:
+    case SSH_FX_WRITE_PROTECT:
+      return -EACCES;
+    case SSH_FX_FILE_ALREADY_EXISTS:
+      return -EEXIST;
+    case SSH_FX_OP_UNSUPPORTED:
+      return -ENOSYS;
+    case SSH_FX_NO_CONNECTION:
+    case SSH_FX_CONNECTION_LOST:
+      return -ENOTCONN;
+    default:
+      return -EIO;
+  }
+}
+
+/**
+ * Check mask against the permission bits of st as the remote would for
+ * its login, whose ids were read at mount. Without them only existence is
+ * checked, and the remote refuses what it does not allow. Returns 0 or
+ * -EACCES.
+ */
+int bb_mode_access(const struct stat *st, int mask) {
+  if (BB_DATA->remote_ngroups < 0) {
+    return 0;
+  }
+  mode_t bits = st->st_mode;
+  if (BB_DATA->remote_uid == 0) {
+    // root reads and writes anything, and executes what anyone may
+    bits = S_ISDIR(st->st_mode) || (st->st_mode & 0111) ? 07 : 06;
+  } else if (st->st_uid == BB_DATA->remote_uid) {
+    bits >>= 6;
+  } else {
+    for (int i = 0; i < BB_DATA->remote_ngroups; i++) {
+      if (st->st_gid == BB_DATA->remote_gids[i]) {
+        bits >>= 3;
+        break;
+      }
+    }
+  }
+  return (mask & ~bits & 07) ? -EACCES : 0;
+}
+
+/**
+ * Fill a struct stat from sftp attributes. SFTP v3 carries no device,
+ * inode or link count, so those get the same defaults sshfs uses.
+ */
+void sftp_attr_to_stat(sftp_attributes attr, struct stat *statbuf) {
+  memset(statbuf, 0, sizeof(struct stat));
+  statbuf->st_mode = attr->permissions;
+  statbuf->st_nlink = 1;
+  statbuf->st_uid = attr->uid;
+  statbuf->st_gid = attr->gid;
+  statbuf->st_size = attr->size;
+  statbuf->st_blksize = BB_DATA->blksize;
+  statbuf->st_blocks = (attr->size + 511) / 512;
+  statbuf->st_atime = attr->atime;
+  statbuf->st_mtime = attr->mtime;
+  statbuf->st_ctime = attr->mtime;
+}
+
+/**
+ * Take a connection of the pool for the calling thread, until bb_conn_put:
+ * want if not NULL, any otherwise. Locks are taken in the order entry
+ * lock, connection, cache lock.
+ */
+void bb_conn_get(void *want) {
+  bb_thread_conn = conn_pool_acquire(&BB_DATA->pool, want);
+}
+
+void bb_conn_put(void) {
+  conn_pool_release(&BB_DATA->pool, bb_thread_conn);
+  bb_thread_conn = NULL;
+}
+
+int helper_channel_send(void *ctx, const void *data, size_t len) {
+  while (len > 0) {
+    int n = ssh_channel_write((ssh_channel) ctx, data, len);
+    if (n <= 0) {
+      return -1;
+    }
+    data = (const char *) data + n;
+    len -= n;
+  }
+  return 0;
+}
+
+int helper_channel_recv(void *ctx, void *data, size_t len) {
+  while (len > 0) {
+    int n = ssh_channel_read((ssh_channel) ctx, data, len, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    data = (char *) data + n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Run the helper command on a channel of conn and check that it answers.
+ * Returns 0, or -1 if it is not installed or speaks another version.
+ */
+int bb_helper_start(struct bb_conn *conn, const char *command) {
+  ssh_channel channel = ssh_channel_new(conn->session);
+  if (channel == NULL) {
+    return -1;
+  }
+  if (ssh_channel_open_session(channel) != SSH_OK
+      || ssh_channel_request_exec(channel, command) != SSH_OK) {
+    ssh_channel_free(channel);
+    return -1;
+  }
+  BB_DATA->helper.send = helper_channel_send;
+  BB_DATA->helper.recv = helper_channel_recv;
+  BB_DATA->helper.ctx = channel;
+  if (helper_open(&BB_DATA->helper) < 0) {
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return -1;
+  }
+  BB_DATA->helper_channel = channel;
+  return 0;
+}
+
+/**
+ * The helper, or NULL if there is none or it has gone away
+ */
+struct helper *bb_helper(void) {
+  if (BB_DATA->helper_channel == NULL || __atomic_load_n(&BB_DATA->helper.broken, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &BB_DATA->helper;
+}
+
+/**
+ * Whether a helper call failed because the helper could not serve it, so
+ * the caller has to take the sftp path instead
+ */
+int bb_helper_missed(int retstat) {
+  return retstat == -ENOTCONN || retstat == -ENOSYS || retstat == -E2BIG;
+}
+
+/**
+ * Write all of buf to fd at the current offset
+ */
+int write_full(int fd, const char *buf, size_t size) {
+  while (size > 0) {
+    ssize_t nwrite = write(fd, buf, size);
+    if (nwrite < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += nwrite;
+    size -= nwrite;
+  }
+  return 0;
+}
+
+/**
+ * Receive the file offered by scp straight into fd, at most chunk bytes
+ * at a time, so memory use does not depend on the file size.
+ * Returns the number of bytes received, or -1 on error.
+ */
+off_t scp_receive(ssh_session session, ssh_scp scp, int fd, size_t chunk) {
   int rc;
   int mode;
   char *filename, *buffer;
 
   rc = ssh_scp_init(scp);
   if (rc != SSH_OK) {
-    log_msg("Error initializing scp session: %s\n",
+    log_failure("Error initializing scp session: %s\n",
             ssh_get_error(session));
-    ssh_scp_free(scp);
-    return rc;
+    return -1;
   }
 
   rc = ssh_scp_pull_request(scp);
   if (rc != SSH_SCP_REQUEST_NEWFILE) {
-    log_msg("Error receiving information about file: %s\n",
+    log_failure("Error receiving information about file: %s\n",
           ssh_get_error(session));
-    return NULL;
+    return -1;
   }
 
-  *size = ssh_scp_request_get_size(scp);
+  off_t size = ssh_scp_request_get_size64(scp);
   filename = strdup(ssh_scp_request_get_filename(scp));
   mode = ssh_scp_request_get_permissions(scp);
-  log_msg("Receiving file %s, size %d, permissions 0%o\n",
-          filename, *size, mode);
+  log_msg("Receiving file %s, size %lld, permissions 0%o\n",
+          filename, (long long) size, mode);
   free(filename);
 
-  buffer = (char *)malloc((*size + 1) * sizeof(char));
+  buffer = (char *)malloc(chunk * sizeof(char));
   if (buffer == NULL) {
-    log_msg("Memory allocation error\n");
-    return NULL;
+    log_failure("Memory allocation error\n");
+    return -1;
   }
 
   ssh_scp_accept_request(scp);
-  for (int r = 0; r < *size; ) {
-    int st = ssh_scp_read(scp, buffer + r, *size - r);
-    if (rc == SSH_ERROR) {
-      log_msg("Error receiving file data: %s\n",
+  for (off_t r = 0; r < size; ) {
+    size_t want = size - r < chunk ? size - r : chunk;
+    int st = ssh_scp_read(scp, buffer, want);
+    if (st == SSH_ERROR) {
+      log_failure("Error receiving file data: %s\n",
               ssh_get_error(session));
       free(buffer);
-      return NULL;
+      return -1;
+    }
+    if (st == 0) {
+      log_failure("File data ended after %lld of %lld bytes\n",
+              (long long) r, (long long) size);
+      free(buffer);
+      return -1;
+    }
+    if (write_full(fd, buffer, st) < 0) {
+      log_error("write");
+      free(buffer);
+      return -1;
     }
     r += st;
   }
-  buffer[*size] = '\0';
+  free(buffer);
 
   rc = ssh_scp_pull_request(scp);
   if (rc != SSH_SCP_REQUEST_EOF) {
     log_msg("Unexpected request: %s\n",
             ssh_get_error(session));
-    return NULL;
+    return -1;
   }
 
-  return buffer;
+  return size;
 }
 
-int scp_write_remote(ssh_session session, ssh_scp scp, char* fpath, char* buf, int size) {
+/**
+ * Push size bytes read from fd to the remote file through scp, at most
+ * chunk bytes at a time, so memory use does not depend on the file size.
+ */
+int scp_write_remote(ssh_session session, ssh_scp scp, const char* fpath, int fd, off_t size, size_t chunk) {
   int rc;
   rc = ssh_scp_init(scp);
   if (rc != SSH_OK) {
-    log_msg("Error initializing scp session: %s\n",
-            ssh_get_error(BB_DATA->session));
+    log_failure("Error initializing scp session: %s\n",
+            ssh_get_error(session));
     return rc;
   }
-  rc = ssh_scp_push_file(scp, fpath, size, S_IRUSR |  S_IWUSR);
+  rc = ssh_scp_push_file64(scp, fpath, size, S_IRUSR |  S_IWUSR);
   if (rc != SSH_OK) {
-    log_msg("Can't open remote file: %s\n",
-            ssh_get_error(BB_DATA->session));
+    log_failure("Can't open remote file: %s\n",
+            ssh_get_error(session));
     return rc;
   }
-  rc = ssh_scp_write(scp, buf, size);
-  if (rc != SSH_OK) {
-    log_msg("Can't write to remote file: %s\n",
-            ssh_get_error(BB_DATA->session));
-    return rc;
+  char *buf = (char *)malloc(chunk * sizeof(char));
+  if (buf == NULL) {
+    log_failure("Memory allocation error\n");
+    return SSH_ERROR;
+  }
+  for (off_t w = 0; w < size; ) {
+    size_t want = size - w < chunk ? size - w : chunk;
+    ssize_t nread = pread(fd, buf, want, w);
+    if (nread <= 0) {
+      if (nread < 0 && errno == EINTR) continue;
+      log_error("pread");
+      free(buf);
+      return SSH_ERROR;
+    }
+    rc = ssh_scp_write(scp, buf, nread);
+    if (rc != SSH_OK) {
+      log_failure("Can't write to remote file: %s\n",
+              ssh_get_error(session));
+      free(buf);
+      return rc;
+    }
+    w += nread;
   }
+  free(buf);
   return SSH_OK;
 }
 
-/////// Local file caching system stuff
+/////// SSH transport
 
 /**
- * Open remote path by caching in temp file
-*/
-int cache_open(const char *fpath, char localpath[]) {
-  for (int i = 0; i < BB_DATA->num_cache; i++) {
-    if (strcmp(BB_DATA->cache[i].remotepath, fpath) == 0) {
-      BB_DATA->cache[i].access++;
-      strcpy(localpath, BB_DATA->cache[i].localpath);
-      log_msg("cached remote %s mapped to %s\n", fpath, localpath);
-      return EXIT_SUCCESS;
+ * lstat of a remote path: on the metadata pipeline, where concurrent
+ * lookups share round trips, through the helper, or on a connection of
+ * the pool
+ */
+int ssh_remote_lstat(void *ctx, const char *fpath, struct stat *statbuf) {
+  if (BB_DATA->pipeline) {
+    int retstat = mdpipe_lstat(&BB_DATA->pipe, fpath, statbuf);
+    if (retstat != -ENOTCONN) {
+      statbuf->st_blksize = BB_DATA->blksize;
+      return retstat;
     }
+    log_failure("metadata pipeline lost, using the pool\n");
   }
-  // no cached local file
-  if (BB_DATA->num_cache == CACHE_SIZE) { // cache is full
-    return EXIT_FAILURE;
+  struct helper *h = bb_helper();
+  if (h != NULL) {
+    int retstat = helper_stat(h, fpath, statbuf);
+    if (!bb_helper_missed(retstat)) {
+      statbuf->st_blksize = BB_DATA->blksize;
+      return retstat;
+    }
   }
-  int i = BB_DATA->num_cache++;
-  BB_DATA->cache[i].remotepath = (char*)malloc(sizeof(char) * (strlen(fpath) + 1));
-  strcpy(BB_DATA->cache[i].remotepath, fpath);
-  BB_DATA->cache[i].localpath = tmpnam(NULL);
-  BB_DATA->cache[i].access = 1;
-  // pull file content from SSH to buf using SCP
-  ssh_scp scp = ssh_scp_new(BB_DATA->session, SSH_SCP_READ, fpath);
-  if (scp == NULL) {
-    log_msg("Error allocating scp session: %s\n",
-            ssh_get_error(BB_DATA->session));
-    return EXIT_FAILURE;
+  bb_conn_get(NULL);
+  sftp_attributes attr = sftp_request(sftp_lstat(BB_CONN->sftp, fpath));
+  if (attr == NULL) {
+    log_failure("remote stat error: %s\n", ssh_get_error(BB_CONN->session));
+    int retstat = sftp_errno(BB_CONN->sftp);
+    bb_conn_put();
+    return retstat;
   }
-  int size;
-  char* buf = scp_receive(BB_DATA->session, scp, &size);
-  if (buf == NULL) {
-    log_msg("error reading remote file %s\n", fpath);
-    ssh_scp_close(scp);
-    ssh_scp_free(scp);
-    return EXIT_FAILURE;
+  bb_conn_put();
+  sftp_attr_to_stat(attr, statbuf);
+  sftp_attributes_free(attr);
+  return 0;
+}
+
+/**
+ * stat of a remote path, following symlinks as open does
+ */
+int ssh_remote_stat(void *ctx, const char *fpath, struct stat *statbuf) {
+  sftp_attributes attr = sftp_request(sftp_stat(BB_CONN->sftp, fpath));
+  if (attr == NULL) {
+    log_failure("remote stat error: %s\n", ssh_get_error(BB_CONN->session));
+    return sftp_errno(BB_CONN->sftp);
   }
-  ssh_scp_close(scp);
-  ssh_scp_free(scp);
-  // write file content from buf to local file
-  FILE* f = fopen(BB_DATA->cache[i].localpath, "w");
-  if (f == NULL) {
-    log_error("fopen");
-    return EXIT_FAILURE;
+  sftp_attr_to_stat(attr, statbuf);
+  sftp_attributes_free(attr);
+  return 0;
+}
+
+/**
+ * List a remote directory with the attributes of every entry: from the
+ * helper in a single reply, or from SFTP READDIR replies, which carry the
+ * attributes along with the names
+ */
+int ssh_remote_readdir(void *ctx, const char *fpath,
+                       int (*fill)(void *arg, const char *name, const struct stat *statbuf), void *arg) {
+  struct helper *h = bb_helper();
+  if (h != NULL) {
+    // a missed call has not listed anything yet
+    int retstat = helper_readdir(h, fpath, fill, arg);
+    if (!bb_helper_missed(retstat)) {
+      return retstat;
+    }
   }
-  int nwrite = fwrite(buf, sizeof(char), size, f);
-  if (nwrite < strlen(buf)) {
-    log_error("fwrite");
-    return EXIT_FAILURE;
+  bb_conn_get(NULL);
+  sftp_dir dp = sftp_request(sftp_opendir(BB_CONN->sftp, fpath));
+  if (dp == NULL) {
+    log_failure("remote opendir error: %s\n", ssh_get_error(BB_CONN->session));
+    int retstat = sftp_errno(BB_CONN->sftp);
+    bb_conn_put();
+    return retstat;
+  }
+  int stop = 0;
+  sftp_attributes attr;
+  while (!stop && (attr = sftp_readdir(BB_CONN->sftp, dp)) != NULL) {
+    if (strcmp(attr->name, ".") != 0 && strcmp(attr->name, "..") != 0) {
+      struct stat st;
+      sftp_attr_to_stat(attr, &st);
+      stop = fill(arg, attr->name, &st);
+    }
+    sftp_attributes_free(attr);
+  }
+  int retstat = 0;
+  if (!stop && !sftp_dir_eof(dp)) {
+    log_failure("remote readdir error: %s\n", ssh_get_error(BB_CONN->session));
+    retstat = sftp_errno(BB_CONN->sftp);
+  }
+  sftp_request(sftp_closedir(dp));
+  bb_conn_put();
+  return retstat;
+}
+
+int ssh_remote_readlink(void *ctx, const char *fpath, char *link, size_t size) {
+  if (BB_DATA->pipeline) {
+    int retstat = mdpipe_readlink(&BB_DATA->pipe, fpath, link, size);
+    if (retstat != -ENOTCONN) {
+      return retstat;
+    }
+  }
+  bb_conn_get(NULL);
+  char *target = sftp_request(sftp_readlink(BB_CONN->sftp, fpath));
+  int retstat = target == NULL ? sftp_errno(BB_CONN->sftp) : 0;
+  bb_conn_put();
+  if (target != NULL) {
+    snprintf(link, size, "%s", target);
+    ssh_string_free_char(target);
   }
+  return retstat;
+}
+
+/**
+ * SFTP has no access request, so the permission bits of an lstat are
+ * checked against the ids of the remote login
+ */
+int ssh_remote_access(void *ctx, const char *fpath, int mask) {
+  struct stat st;
+  int retstat = ssh_remote_lstat(ctx, fpath, &st);
+  return retstat < 0 ? retstat : bb_mode_access(&st, mask);
+}
+
+int ssh_remote_statvfs(void *ctx, const char *fpath, struct statvfs *statv) {
+  sftp_statvfs_t vfs = sftp_request(sftp_statvfs(BB_CONN->sftp, fpath));
+  if (vfs == NULL) {
+    return sftp_errno(BB_CONN->sftp);
+  }
+  memset(statv, 0, sizeof(struct statvfs));
+  statv->f_bsize = vfs->f_bsize;
+  statv->f_frsize = vfs->f_frsize;
+  statv->f_blocks = vfs->f_blocks;
+  statv->f_bfree = vfs->f_bfree;
+  statv->f_bavail = vfs->f_bavail;
+  statv->f_files = vfs->f_files;
+  statv->f_ffree = vfs->f_ffree;
+  statv->f_favail = vfs->f_favail;
+  statv->f_fsid = vfs->f_fsid;
+  statv->f_flag = vfs->f_flag;
+  statv->f_namemax = vfs->f_namemax;
+  sftp_statvfs_free(vfs);
+  return 0;
+}
+
+// A remote file open for ranged reads or writes. These go through the
+// helper when there is one, and otherwise over an sftp handle, opened on
+// first use on the connection held then, which later calls have to hold.
+struct ssh_remote_file {
+  char *path;
+  int flags;
+  sftp_file file;
+};
+
+int ssh_remote_open(void *ctx, const char *fpath, int flags, void **file) {
+  struct ssh_remote_file *f = malloc(sizeof(struct ssh_remote_file));
+  if (f == NULL || (f->path = strdup(fpath)) == NULL) {
+    free(f);
+    return -ENOMEM;
+  }
+  f->flags = flags;
+  f->file = NULL;
+  *file = f;
+  return 0;
+}
+
+/**
+ * The sftp handle of f, or NULL if it cannot be opened
+ */
+sftp_file ssh_remote_sftp_file(struct ssh_remote_file *f) {
+  if (f->file == NULL) {
+    f->file = sftp_request(sftp_open(BB_CONN->sftp, f->path, f->flags, 0));
+    if (f->file == NULL) {
+      log_failure("Can't open remote file: %s\n", ssh_get_error(BB_CONN->session));
+    }
+  }
+  return f->file;
+}
+
+ssize_t ssh_remote_read(void *ctx, void *file, void *buf, size_t size, off_t offset) {
+  struct ssh_remote_file *f = file;
+  struct helper *h = bb_helper();
+  if (h != NULL) {
+    ssize_t nread = helper_read(h, f->path, buf, size, offset);
+    if (!bb_helper_missed(nread)) {
+      return nread;
+    }
+  }
+  if (ssh_remote_sftp_file(f) == NULL) {
+    return sftp_errno(BB_CONN->sftp);
+  }
+  if (sftp_seek64(f->file, offset) < 0) {
+    log_failure("Can't seek in remote file: %s\n", ssh_get_error(BB_CONN->session));
+    return -EIO;
+  }
+  ssize_t nread = sftp_request(sftp_read(f->file, buf, size));
+  if (nread < 0) {
+    log_failure("Error receiving file data: %s\n", ssh_get_error(BB_CONN->session));
+    return -EIO;
+  }
+  return nread;
+}
+
+ssize_t ssh_remote_write(void *ctx, void *file, const void *buf, size_t size, off_t offset) {
+  struct ssh_remote_file *f = file;
+  struct helper *h = bb_helper();
+  if (h != NULL) {
+    ssize_t nwrite = helper_write(h, f->path, buf, size, offset);
+    if (!bb_helper_missed(nwrite)) {
+      return nwrite;
+    }
+  }
+  if (ssh_remote_sftp_file(f) == NULL) {
+    return sftp_errno(BB_CONN->sftp);
+  }
+  if (sftp_seek64(f->file, offset) < 0) {
+    log_failure("Can't seek in remote file: %s\n", ssh_get_error(BB_CONN->session));
+    return -EIO;
+  }
+  ssize_t nwrite = sftp_request(sftp_write(f->file, buf, size));
+  if (nwrite < 0) {
+    log_failure("Can't write to remote file: %s\n", ssh_get_error(BB_CONN->session));
+    return -EIO;
+  }
+  return nwrite;
+}
+
+void ssh_remote_close(void *ctx, void *file) {
+  struct ssh_remote_file *f = file;
+  if (f->file != NULL) {
+    sftp_request(sftp_close(f->file));
+  }
+  free(f->path);
+  free(f);
+}
+
+/**
+ * Ask for a range ahead of time, over sftp. The reply is picked up by
+ * ssh_remote_read_end, so the transfer overlaps with whatever the
+ * application does meanwhile.
+ */
+int ssh_remote_read_begin(void *ctx, void *file, size_t size, off_t offset) {
+  struct ssh_remote_file *f = file;
+  if (ssh_remote_sftp_file(f) == NULL || sftp_seek64(f->file, offset) < 0) {
+    return -EIO;
+  }
+  int id = sftp_request(sftp_async_read_begin(f->file, size));
+  if (id < 0) {
+    log_failure("Can't request remote block: %s\n", ssh_get_error(BB_CONN->session));
+    return -EIO;
+  }
+  return id;
+}
+
+ssize_t ssh_remote_read_end(void *ctx, void *file, void *buf, size_t size, int id, int wait) {
+  struct ssh_remote_file *f = file;
+  if (!wait) {
+    sftp_file_set_nonblocking(f->file);
+  }
+  int nread = sftp_async_read(f->file, buf, size, id);
+  sftp_file_set_blocking(f->file);
+  if (nread == SSH_AGAIN) {
+    return -EAGAIN;
+  }
+  return nread < 0 ? -EIO : nread;
+}
 
-  strcpy(localpath, BB_DATA->cache[i].localpath);
-  free(buf); fclose(f);
-  log_msg("remote %s mapped to %s\n", fpath, localpath);
+/**
+ * Copy a whole file between fd and the remote, split over as many
+ * connections as the tuner asks for and the pool has free besides the
+ * one held
+ */
+int ssh_remote_parallel(const char *fpath, int fd, off_t size, int upload) {
+  struct xfer_tuner *tuner = upload ? &BB_DATA->xfer_up : &BB_DATA->xfer_down;
+  size_t range;
+  int want = xfer_tuner_plan(tuner, &range);
+  struct bb_conn *conns[XFER_STREAMS_MAX];
+  int n = 0;
+  conns[n++] = BB_CONN;
+  while (n < want && (conns[n] = conn_pool_try_acquire(&BB_DATA->pool)) != NULL) {
+    n++;
+  }
+  double start = bb_now();
+  int rc = xfer_parallel(conns, n, fpath, fd, size, upload, range, BB_DATA->xfer_chunk);
+  double secs = bb_now() - start;
+  for (int i = 1; i < n; i++) {
+    conn_pool_release(&BB_DATA->pool, conns[i]);
+  }
+  if (rc < 0) {
+    log_failure("parallel %s of %s failed, using one stream\n", upload ? "upload" : "download", fpath);
+    return EXIT_FAILURE;
+  }
+  xfer_tuner_update(tuner, n, size, secs);
+  log_msg("%s %s: %lld bytes over %d streams of %zu-byte ranges, %.1f MB/s\n",
+          upload ? "uploaded" : "downloaded", fpath, (long long) size, n, range,
+          secs > 0 ? size / secs / 1e6 : 0.0);
   return EXIT_SUCCESS;
 }
 
 /**
- * Close remote path. Flush if access to remote 
-*/
-int cache_close(const char *fpath) {
-  for (int i = 0; i < BB_DATA->num_cache; i++) {
-    if (strcmp(BB_DATA->cache[i].remotepath, fpath) == 0) {
-      if (--BB_DATA->cache[i].access > 0) {
-        return EXIT_SUCCESS;
-      }
-      // no more local access to file, time to flush to remote
-      // pull file content from local to buf
-      struct stat sb;
-      int rc = lstat(BB_DATA->cache[i].localpath, &sb);
-      if (rc != EXIT_SUCCESS) {
-        log_error("lstat");
-        return EXIT_FAILURE;
+ * Copy the whole remote file into fd. Large files are split over several
+ * connections, the others come as one scp stream.
+ */
+off_t ssh_remote_get(void *ctx, const char *fpath, int fd, off_t size) {
+  if (BB_DATA->streams > 0 && size >= BB_DATA->parallel_min) {
+    if (ssh_remote_parallel(fpath, fd, size, 0) == EXIT_SUCCESS) {
+      return size;
+    }
+    if (ftruncate(fd, 0) < 0) {
+      log_error("ftruncate");
+    }
+  }
+  // stream file content from SSH into the local file using SCP
+  ssh_scp scp = ssh_scp_new(BB_CONN->session, SSH_SCP_READ, fpath);
+  if (scp == NULL) {
+    log_failure("Error allocating scp session: %s\n",
+            ssh_get_error(BB_CONN->session));
+    return -EIO;
+  }
+  size = scp_receive(BB_CONN->session, scp, fd, BB_DATA->xfer_chunk);
+  ssh_scp_close(scp);
+  ssh_scp_free(scp);
+  return size < 0 ? -EIO : size;
+}
+
+/**
+ * Replace the remote file with the contents of fd through the helper,
+ * sending only the blocks whose digest does not match the one the helper
+ * computes on the remote, so a file rewritten in place with mostly the
+ * same content is not copied in full
+ */
+int ssh_remote_put_helper(struct helper *h, const char *fpath, int fd, off_t size, off_t old_size) {
+  size_t block = BB_DATA->block_size;
+  if (block > HELPER_IO_MAX) {
+    return -E2BIG;
+  }
+  char *buf = (char *)malloc(block);
+  unsigned char *digests = malloc(HELPER_HASH_BATCH * HELPER_DIGEST_SIZE);
+  if (buf == NULL || digests == NULL) {
+    log_failure("Memory allocation error\n");
+    free(buf); free(digests);
+    return -ENOMEM;
+  }
+
+  off_t sent = 0;
+  size_t nblocks = (size + block - 1) / block;
+  // blocks that may already hold the same bytes on the remote
+  off_t common = size < old_size ? size : old_size;
+  size_t compared = common > 0 ? (common + block - 1) / block : 0;
+  int retstat = 0;
+  for (size_t b = 0; b < nblocks && retstat == 0; b++) {
+    off_t start = (off_t) b * block;
+    size_t len = size - start < (off_t) block ? size - start : block;
+    if (b < compared && b % HELPER_HASH_BATCH == 0) {
+      uint32_t count = compared - b < HELPER_HASH_BATCH ? compared - b : HELPER_HASH_BATCH;
+      if ((retstat = helper_hash_blocks(h, fpath, b, count, block, digests)) < 0) {
+        break;
       }
-      size_t size = sb.st_size;
-      char *buf = (char*)malloc(sizeof(char) * (size + 1));
-      FILE* f = fopen(BB_DATA->cache[i].localpath, "r");
-      int nbytes = fread(buf, sizeof(char), size, f);
-      if (nbytes < size) {
-        log_error("fread");
-        return EXIT_FAILURE;
+    }
+    size_t got = 0;
+    while (got < len) {
+      ssize_t nread = pread(fd, buf + got, len - got, start + got);
+      if (nread <= 0) {
+        if (nread < 0 && errno == EINTR) continue;
+        retstat = log_error("pread");
+        break;
       }
-      fclose(f);
-      // push file content from buf to remote
-      ssh_scp scp = ssh_scp_new(BB_DATA->session, SSH_SCP_WRITE, fpath);
-      if (scp == NULL) {
-        log_msg("Error allocating scp session: %s\n",
-                ssh_get_error(BB_DATA->session));
-        free(buf);
-        return EXIT_FAILURE;
+      got += nread;
+    }
+    if (retstat < 0) {
+      continue;
+    }
+    if (b < compared) {
+      unsigned char digest[HELPER_DIGEST_SIZE];
+      helper_digest((unsigned char *) buf, len, digest);
+      if (memcmp(digests + (b % HELPER_HASH_BATCH) * HELPER_DIGEST_SIZE, digest, HELPER_DIGEST_SIZE) == 0) {
+        continue;
       }
-      rc = scp_write_remote(BB_DATA->session, scp, fpath, buf, size);
-
-      ssh_scp_close(scp);
-      ssh_scp_free(scp);
-      log_msg("mapping %s -> %s is removed\n", BB_DATA->cache[i].remotepath, BB_DATA->cache[i].localpath);
-      free(buf);
-      // free(BB_DATA->cache[i].localpath); // we do not clean this up because .localpath is directly managed by tmpnam
-      free(BB_DATA->cache[i].remotepath);
-      for (int j = i; j + 1 < BB_DATA->num_cache; j++) {
-        BB_DATA->cache[j] = BB_DATA->cache[j + 1];
+    }
+    for (size_t w = 0; w < len; ) {
+      ssize_t nwrite = helper_write(h, fpath, buf + w, len - w, start + w);
+      if (nwrite <= 0) {
+        log_failure("Can't write to remote file through the helper: %d\n", (int) nwrite);
+        retstat = nwrite < 0 ? nwrite : -EIO;
+        break;
       }
-      BB_DATA->num_cache--;
-      // clean up here: remove file from cache + clean up pointers
-      return rc;
+      w += nwrite;
     }
+    sent += len;
   }
-  return EXIT_FAILURE; // no file in cache with name fpath
+  free(buf);
+  free(digests);
+  if (retstat < 0 || (retstat = helper_truncate(h, fpath, size)) < 0) {
+    return retstat;
+  }
+  log_msg("sent %lld of %lld bytes of %s through the helper\n", (long long) sent, (long long) size, fpath);
+  bb_count(BB_DATA->cache.delta_uploads, 1);
+  bb_count(BB_DATA->cache.delta_bytes, sent);
+  return 0;
 }
 
-/////// BBFS stuff
+/**
+ * Replace the remote file with the contents of fd: the blocks that differ
+ * through the helper, or all of it, split over several connections if it
+ * is large and as one scp stream otherwise
+ */
+int ssh_remote_put(void *ctx, const char *fpath, int fd, off_t size, off_t old_size) {
+  struct helper *h = bb_helper();
+  if (h != NULL && ssh_remote_put_helper(h, fpath, fd, size, old_size) == 0) {
+    return 0;
+  }
+  if (BB_DATA->streams > 0 && size >= BB_DATA->parallel_min && ssh_remote_parallel(fpath, fd, size, 1) == EXIT_SUCCESS) {
+    return 0;
+  }
+  ssh_scp scp = ssh_scp_new(BB_CONN->session, SSH_SCP_WRITE, fpath);
+  if (scp == NULL) {
+    log_failure("Error allocating scp session: %s\n",
+            ssh_get_error(BB_CONN->session));
+    return -EIO;
+  }
+  int rc = scp_write_remote(BB_CONN->session, scp, fpath, fd, size, BB_DATA->xfer_chunk);
+  ssh_scp_close(scp);
+  ssh_scp_free(scp);
+  return rc == SSH_OK ? 0 : -EIO;
+}
 
 /**
- * Get file attributes.
+ * Create a regular file. SFTP cannot make device nodes or fifos.
  */
-int bb_getattr(const char *path, struct stat *statbuf) {
-  char fpath[PATH_MAX];
+int ssh_remote_mknod(void *ctx, const char *fpath, mode_t mode, dev_t dev) {
+  if (!S_ISREG(mode)) {
+    return -EPERM;
+  }
+  sftp_file file = sftp_request(sftp_open(BB_CONN->sftp, fpath, O_CREAT | O_EXCL | O_WRONLY, mode & 07777));
+  if (file == NULL) {
+    return sftp_errno(BB_CONN->sftp);
+  }
+  sftp_request(sftp_close(file));
+  return 0;
+}
 
-  log_command("bb_getattr(path=\"%s\", statbuf=0x%08x)", path, statbuf);
-  bb_fullpath(fpath, path);
+int ssh_remote_mkdir(void *ctx, const char *fpath, mode_t mode) {
+  return sftp_request(sftp_mkdir(BB_CONN->sftp, fpath, mode)) == SSH_OK ? 0 : sftp_errno(BB_CONN->sftp);
+}
 
-  char output[BUF_SIZE], command[BUF_SIZE];
+int ssh_remote_unlink(void *ctx, const char *fpath) {
+  return sftp_request(sftp_unlink(BB_CONN->sftp, fpath)) == SSH_OK ? 0 : sftp_errno(BB_CONN->sftp);
+}
 
-  // non-fs stats
-  strcpy(command, "stat -c \"\%d \%i \%f \%h \%u \%g \%t \%s \%X \%Y \%Z \%b\" ");
-  strncat(command, fpath, BUF_SIZE);
-  int rc = ssh_execute(BB_DATA->session, command, output, BUF_SIZE);
-  if (rc != 0) {
-    log_msg("remote stat error\n");
-    return EXIT_FAILURE;
-  } else {
-    rc = sscanf(output, "%lu %lu %x %u %u %u %lx %ld %ld %ld %ld %ld",
-      &statbuf->st_dev, &statbuf->st_ino, &statbuf->st_mode, &statbuf->st_nlink,
-      &statbuf->st_uid, &statbuf->st_gid, &statbuf->st_rdev, &statbuf->st_size,
-      &statbuf->st_blocks, &statbuf->st_atime, &statbuf->st_mtime, &statbuf->st_ctime);
-    if (rc != 12) {
-      log_stat(statbuf);
-      return EXIT_FAILURE;
+int ssh_remote_rmdir(void *ctx, const char *fpath) {
+  return sftp_request(sftp_rmdir(BB_CONN->sftp, fpath)) == SSH_OK ? 0 : sftp_errno(BB_CONN->sftp);
+}
+
+int ssh_remote_symlink(void *ctx, const char *target, const char *fpath) {
+  return sftp_request(sftp_symlink(BB_CONN->sftp, target, fpath)) == SSH_OK ? 0 : sftp_errno(BB_CONN->sftp);
+}
+
+/**
+ * Rename through the helper if there is one. Over SFTP, libssh sends the
+ * rename as posix-rename@openssh.com when the server offers it, which
+ * replaces the target atomically. Plain SFTP v3 refuses to rename over an
+ * existing name with a generic failure; only then, with the source and
+ * target both there and of the same kind, the target is removed first,
+ * which is not atomic.
+ */
+int ssh_remote_rename(void *ctx, const char *fpath, const char *fnewpath) {
+  struct helper *h = bb_helper();
+  if (h != NULL) {
+    int retstat = helper_rename(h, fpath, fnewpath);
+    if (!bb_helper_missed(retstat)) {
+      return retstat;
     }
   }
-
-  // fs stats
-  strcpy(command, "stat -f -c \"\%s\" ");
-  strncat(command, fpath, BUF_SIZE);
-  rc = ssh_execute(BB_DATA->session, command, output, BUF_SIZE);
-  if (rc != 0) {
-    log_msg("remote stat error\n");
-    return EXIT_FAILURE;
-  } else {
-    rc = sscanf(output, "%ld", &statbuf->st_blksize);
-    if (rc != 1) {
-      log_stat(statbuf);
-      return EXIT_FAILURE;
+  if (sftp_request(sftp_rename(BB_CONN->sftp, fpath, fnewpath)) == SSH_OK) {
+    return 0;
+  }
+  int retstat = sftp_errno(BB_CONN->sftp);
+  if (sftp_get_error(BB_CONN->sftp) != SSH_FX_FAILURE
+      || sftp_extension_supported(BB_CONN->sftp, "posix-rename@openssh.com", "1")) {
+    return retstat;
+  }
+  sftp_attributes from = sftp_request(sftp_lstat(BB_CONN->sftp, fpath));
+  if (from == NULL) {
+    return retstat;
+  }
+  sftp_attributes to = sftp_request(sftp_lstat(BB_CONN->sftp, fnewpath));
+  int isdir = from->type == SSH_FILEXFER_TYPE_DIRECTORY;
+  int same = to != NULL && (to->type == SSH_FILEXFER_TYPE_DIRECTORY) == isdir;
+  sftp_attributes_free(from);
+  if (to != NULL) {
+    sftp_attributes_free(to);
+  }
+  if (!same) {
+    return retstat;
+  }
+  int rc = isdir ? sftp_request(sftp_rmdir(BB_CONN->sftp, fnewpath)) : sftp_request(sftp_unlink(BB_CONN->sftp, fnewpath));
+  if (rc != SSH_OK || sftp_request(sftp_rename(BB_CONN->sftp, fpath, fnewpath)) != SSH_OK) {
+    return sftp_errno(BB_CONN->sftp);
+  }
+  return 0;
+}
+
+/**
+ * SFTP v3 has no hard links
+ */
+int ssh_remote_link(void *ctx, const char *fpath, const char *fnewpath) {
+  return -EPERM;
+}
+
+int ssh_remote_chmod(void *ctx, const char *fpath, mode_t mode) {
+  return sftp_request(sftp_chmod(BB_CONN->sftp, fpath, mode)) == SSH_OK ? 0 : sftp_errno(BB_CONN->sftp);
+}
+
+int ssh_remote_chown(void *ctx, const char *fpath, uid_t uid, gid_t gid) {
+  return sftp_request(sftp_chown(BB_CONN->sftp, fpath, uid, gid)) == SSH_OK ? 0 : sftp_errno(BB_CONN->sftp);
+}
+
+/**
+ * Set the size of the remote file, through the helper if there is one
+ */
+int ssh_remote_truncate(void *ctx, const char *fpath, off_t size) {
+  struct helper *h = bb_helper();
+  if (h != NULL) {
+    int retstat = helper_truncate(h, fpath, size);
+    if (!bb_helper_missed(retstat)) {
+      return retstat;
+    }
+  }
+  struct sftp_attributes_struct attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.flags = SSH_FILEXFER_ATTR_SIZE;
+  attr.size = size;
+  if (sftp_request(sftp_setstat(BB_CONN->sftp, fpath, &attr)) != SSH_OK) {
+    log_failure("remote truncate error: %s\n", ssh_get_error(BB_CONN->session));
+    return sftp_errno(BB_CONN->sftp);
+  }
+  return 0;
+}
+
+int ssh_remote_utime(void *ctx, const char *fpath, struct utimbuf *ubuf) {
+  struct timeval times[2];
+  if (ubuf != NULL) {
+    times[0].tv_sec = ubuf->actime;
+    times[1].tv_sec = ubuf->modtime;
+    times[0].tv_usec = times[1].tv_usec = 0;
+  } else {
+    gettimeofday(&times[0], NULL);
+    times[1] = times[0];
+  }
+  return sftp_request(sftp_utimes(BB_CONN->sftp, fpath, times)) == SSH_OK ? 0 : sftp_errno(BB_CONN->sftp);
+}
+
+// The remote host reached over ssh: sftp for metadata and ranged access,
+// scp or parallel sftp streams for whole files, and the helper, the
+// metadata pipeline and readahead where they are available. SFTP has no
+// extended attributes.
+const struct transport ssh_transport = {
+  .name = "ssh",
+  .lstat = ssh_remote_lstat,
+  .stat = ssh_remote_stat,
+  .readdir = ssh_remote_readdir,
+  .readlink = ssh_remote_readlink,
+  .access = ssh_remote_access,
+  .statvfs = ssh_remote_statvfs,
+  .open = ssh_remote_open,
+  .read = ssh_remote_read,
+  .write = ssh_remote_write,
+  .close = ssh_remote_close,
+  .read_begin = ssh_remote_read_begin,
+  .read_end = ssh_remote_read_end,
+  .get = ssh_remote_get,
+  .put = ssh_remote_put,
+  .mknod = ssh_remote_mknod,
+  .mkdir = ssh_remote_mkdir,
+  .unlink = ssh_remote_unlink,
+  .rmdir = ssh_remote_rmdir,
+  .symlink = ssh_remote_symlink,
+  .rename = ssh_remote_rename,
+  .link = ssh_remote_link,
+  .chmod = ssh_remote_chmod,
+  .chown = ssh_remote_chown,
+  .truncate = ssh_remote_truncate,
+  .utime = ssh_remote_utime,
+};
+
+/////// Metadata snapshot stuff
+
+// One record per file: type, permissions, owner, group, links, size and
+// mtime, then the path below the starting point and the link target, both
+// NUL-terminated since names may hold any other byte.
+#define SNAP_FORMAT "%y %m %U %G %n %s %T@ %P\\0%l\\0"
+
+/**
+ * Append a copy of path to a list of paths, skipping duplicates
+ */
+int snap_push(char ***paths, int *count, const char *path) {
+  for (int i = 0; i < *count; i++) {
+    if (strcmp((*paths)[i], path) == 0) {
+      return 0;
+    }
+  }
+  // grown whenever count reaches a power of two
+  if ((*count & (*count - 1)) == 0) {
+    char **grown = realloc(*paths, (*count ? 2 * *count : 8) * sizeof(char *));
+    if (grown == NULL) {
+      return -ENOMEM;
+    }
+    *paths = grown;
+  }
+  if (((*paths)[*count] = strdup(path)) == NULL) {
+    return -ENOMEM;
+  }
+  (*count)++;
+  return 0;
+}
+
+void snap_free_paths(char **paths, int count) {
+  for (int i = 0; i < count; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+/**
+ * Add one find record to the snapshot. dir is the mount-relative path find
+ * started from.
+ */
+int snap_record(const char *dir, char *rec, int report_dirs, char ***dirs, int *ndirs) {
+  char type;
+  unsigned int mode, uid, gid;
+  unsigned long nlink;
+  long long size;
+  double mtime;
+  int n = 0;
+  if (sscanf(rec, "%c %o %u %u %lu %lld %lf %n", &type, &mode, &uid, &gid, &nlink, &size, &mtime, &n) < 7 || n == 0) {
+    return -1;
+  }
+  const char *rel = rec + n;
+  const char *link = rel + strlen(rel) + 1;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  switch (type) {
+    case 'd': st.st_mode = S_IFDIR; break;
+    case 'l': st.st_mode = S_IFLNK; break;
+    case 'b': st.st_mode = S_IFBLK; break;
+    case 'c': st.st_mode = S_IFCHR; break;
+    case 'p': st.st_mode = S_IFIFO; break;
+    case 's': st.st_mode = S_IFSOCK; break;
+    default: st.st_mode = S_IFREG; break;
+  }
+  st.st_mode |= mode & 07777;
+  st.st_uid = uid;
+  st.st_gid = gid;
+  st.st_nlink = nlink;
+  st.st_size = size;
+  st.st_mtime = (time_t) mtime;
+
+  char path[PATH_MAX];
+  if (*rel == '\0') {
+    snprintf(path, sizeof(path), "%s", dir);
+  } else if (snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, rel) >= (int) sizeof(path)) {
+    return 0;
+  }
+  // a file open or waiting for write-back is newer here than on the remote
+  int pending = 0;
+  if (!S_ISDIR(st.st_mode)) {
+    char fpath[PATH_MAX];
+    bb_fullpath(fpath, path);
+    pthread_mutex_lock(&BB_DATA->lock);
+    struct file_cache_local *entry = file_cache_find(&BB_DATA->cache, fpath);
+    pending = entry != NULL && (entry->access > 0 || entry->dirty || entry->flush != FLUSH_NONE);
+    pthread_mutex_unlock(&BB_DATA->lock);
+  }
+  int created = snapshot_add(&BB_DATA->snap, path, &st, link, pending);
+  if (dirs != NULL && S_ISDIR(st.st_mode) && (report_dirs || (created == 1 && *rel != '\0'))) {
+    return snap_push(dirs, ndirs, path);
+  }
+  return 0;
+}
+
+/**
+ * Run find on the remote from the mount-relative directory dir, with the
+ * extra options and tests in args, and put what it reports in the
+ * snapshot, streaming. Directories it adds, or with report_dirs all it
+ * reports, are appended to dirs. Returns the number of records.
+ */
+int snap_find(const char *dir, const char *args, int report_dirs, char ***dirs, int *ndirs) {
+  char fpath[PATH_MAX], quoted[2 * PATH_MAX], cmd[2 * PATH_MAX + BUF_SIZE];
+  bb_fullpath(fpath, dir);
+  // single-quoted for the remote shell, with ' written as '\''
+  char *q = quoted;
+  *q++ = '\'';
+  for (const char *p = fpath; *p && q < quoted + sizeof(quoted) - 5; p++) {
+    if (*p == '\'') {
+      memcpy(q, "'\\''", 4);
+      q += 4;
+    } else {
+      *q++ = *p;
+    }
+  }
+  *q++ = '\'';
+  *q = '\0';
+  snprintf(cmd, sizeof(cmd), "find -H %s %s -printf '" SNAP_FORMAT "' 2>/dev/null", quoted, args);
+
+  ssh_channel channel = ssh_channel_new(BB_CONN->session);
+  if (channel == NULL) {
+    return -1;
+  }
+  if (ssh_channel_open_session(channel) != SSH_OK || ssh_channel_request_exec(channel, cmd) != SSH_OK) {
+    log_failure("snapshot: cannot run find: %s\n", ssh_get_error(BB_CONN->session));
+    ssh_channel_free(channel);
+    return -1;
+  }
+  // a record is at most two paths and a line of numbers
+  size_t bufsize = 2 * PATH_MAX + BUF_SIZE;
+  char *buf = malloc(bufsize);
+  int records = 0;
+  size_t len = 0;
+  int rd = 0;
+  while (buf != NULL && (rd = ssh_channel_read(channel, buf + len, bufsize - len - 1, 0)) > 0) {
+    len += rd;
+    char *rec = buf, *end = buf + len;
+    while (1) {
+      char *path_end = memchr(rec, '\0', end - rec);
+      char *link_end = path_end == NULL ? NULL : memchr(path_end + 1, '\0', end - path_end - 1);
+      if (link_end == NULL) {
+        break;
+      }
+      if (snap_record(dir, rec, report_dirs, dirs, ndirs) == 0) {
+        records++;
+      }
+      rec = link_end + 1;
+    }
+    len = end - rec;
+    memmove(buf, rec, len);
+    if (len == bufsize - 1) {
+      log_msg("snapshot: find record too long\n");
+      break;
+    }
+  }
+  if (rd < 0) {
+    log_failure("snapshot: find output cut short: %s\n", ssh_get_error(BB_CONN->session));
+  }
+  free(buf);
+  ssh_channel_send_eof(channel);
+  ssh_channel_close(channel);
+  ssh_channel_free(channel);
+  return records;
+}
+
+/**
+ * Remote time in seconds since the epoch, so refreshes do not depend on
+ * the two clocks agreeing. 0 if it cannot be read.
+ */
+long long snap_remote_time(void) {
+  char out[BUF_SIZE];
+  if (ssh_execute(BB_CONN->session, "date +%s", out, sizeof(out) - 1) != SSH_OK) {
+    return 0;
+  }
+  return atoll(out);
+}
+
+/**
+ * Read the uid and groups of the remote login, holding a connection, for
+ * bb_mode_access. They stay unknown if id cannot be run.
+ */
+void ssh_remote_ids(void) {
+  char out[BUF_SIZE];
+  if (ssh_execute(BB_CONN->session, "id -u; id -G", out, sizeof(out) - 1) != SSH_OK) {
+    return;
+  }
+  char *p = out, *end;
+  long id = strtol(p, &end, 10);
+  if (end == p) {
+    return;
+  }
+  BB_DATA->remote_uid = id;
+  int n = 0;
+  for (p = end; n < REMOTE_GROUPS_MAX; p = end) {
+    id = strtol(p, &end, 10);
+    if (end == p) {
+      break;
+    }
+    BB_DATA->remote_gids[n++] = id;
+  }
+  if (n > 0) {
+    BB_DATA->remote_ngroups = n;
+  }
+  log_msg("remote login: uid %d, %d groups\n", (int) BB_DATA->remote_uid, n);
+}
+
+/**
+ * List the whole remote tree, holding a connection
+ */
+void snap_scan(void) {
+  double start = bb_now();
+  BB_DATA->snap_since = snap_remote_time();
+  int records = snap_find("/", "", 0, NULL, NULL);
+  log_msg("snapshot: %d entries in %.3fs, %zu bytes\n",
+          records, bb_now() - start, snapshot_memory(&BB_DATA->snap));
+}
+
+/**
+ * Bring the snapshot up to date, holding a connection. One find reports
+ * what changed since the last scan; the directories among them, and those
+ * changed through the mount, are listed again so removals are seen, and
+ * directories that turn up new are listed in turn.
+ */
+void snap_refresh(void) {
+  long long now = snap_remote_time();
+  if (now == 0) {
+    return;
+  }
+  snapshot_begin_pass(&BB_DATA->snap);
+  char **dirs = NULL;
+  int ndirs = 0;
+  char args[BUF_SIZE];
+  // a second early, as ctime has finer resolution than the remote clock read
+  snprintf(args, sizeof(args), "-newerct @%lld", BB_DATA->snap_since - 1);
+  int changed = snap_find("/", args, 1, &dirs, &ndirs);
+  if (changed < 0) {
+    snap_free_paths(dirs, ndirs);
+    return;
+  }
+  char **stale;
+  int nstale = snapshot_stale_dirs(&BB_DATA->snap, &stale);
+  for (int i = 0; i < nstale; i++) {
+    snap_push(&dirs, &ndirs, stale[i]);
+  }
+  snap_free_paths(stale, nstale > 0 ? nstale : 0);
+  int listed;
+  for (listed = 0; listed < ndirs; listed++) {
+    if (snap_find(dirs[listed], "-maxdepth 1", 0, &dirs, &ndirs) < 0) {
+      break;
+    }
+    snapshot_sweep(&BB_DATA->snap, dirs[listed]);
+  }
+  if (listed == ndirs) {
+    BB_DATA->snap_since = now;
+  }
+  log_msg("snapshot refresh: %d changed, %d directories listed\n", changed, listed);
+  snap_free_paths(dirs, ndirs);
+}
+
+/**
+ * Refresh the snapshot every snap.ttl seconds until unmount
+ */
+void *snap_worker(void *arg) {
+  pthread_mutex_lock(&BB_DATA->lock);
+  while (!BB_DATA->snap_stop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double wake = ts.tv_sec + ts.tv_nsec / 1e9 + BB_DATA->snap.ttl;
+    ts.tv_sec = (time_t) wake;
+    ts.tv_nsec = (long) ((wake - ts.tv_sec) * 1e9);
+    pthread_cond_timedwait(&BB_DATA->snap_wake, &BB_DATA->lock, &ts);
+    if (BB_DATA->snap_stop) {
+      break;
+    }
+    pthread_mutex_unlock(&BB_DATA->lock);
+    bb_conn_get(NULL);
+    snap_refresh();
+    bb_conn_put();
+    pthread_mutex_lock(&BB_DATA->lock);
+  }
+  pthread_mutex_unlock(&BB_DATA->lock);
+  return NULL;
+}
+
+/**
+ * The attributes of path were changed through the mount
+ */
+void snap_changed(const char *path) {
+  if (BB_DATA->snapshot) {
+    snapshot_invalidate(&BB_DATA->snap, path, 0);
+  }
+}
+
+/**
+ * path was created, removed or renamed through the mount
+ */
+void snap_moved(const char *path) {
+  if (BB_DATA->snapshot) {
+    snapshot_remove(&BB_DATA->snap, path);
+    snapshot_invalidate(&BB_DATA->snap, path, 1);
+  }
+}
+
+/////// Local file caching system stuff
+
+/**
+ * Copy the whole remote file, size bytes when it was last stat'ed, into
+ * the local copy of entry
+ */
+int cache_download(struct file_cache_local *entry, off_t size) {
+  int fd = open(entry->localpath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    log_error("open");
+    return EXIT_FAILURE;
+  }
+  size = bb_remote(get, entry->remotepath, fd, size);
+  close(fd);
+  if (size < 0) {
+    log_failure("error reading remote file %s\n", entry->remotepath);
+    return EXIT_FAILURE;
+  }
+  entry->remote_size = entry->trunc_size = size;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Create a sparse local copy of entry with the size of the remote file.
+ * Its blocks are filled in by cache_fetch as they are accessed.
+ */
+int cache_create_sparse(struct file_cache_local *entry, off_t size) {
+  int fd = open(entry->localpath, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    log_error("open");
+    return EXIT_FAILURE;
+  }
+  if (ftruncate(fd, size) < 0) {
+    log_error("ftruncate");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  entry->lazy = 1;
+  entry->fetch_fd = fd;
+  entry->fetch_limit = entry->remote_size = entry->trunc_size = size;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * The remote handle used for ranged reads of entry, opened on first use
+ */
+void *cache_remote_file(struct file_cache_local *entry) {
+  if (entry->remote_file == NULL) {
+    int retstat = bb_remote(open, entry->remotepath, O_RDONLY, &entry->remote_file);
+    if (retstat < 0) {
+      log_failure("Can't open remote file %s: %s\n", entry->remotepath, strerror(-retstat));
+      entry->remote_file = NULL;
+    }
+    // later reads of entry have to come back to this connection
+    entry->remote_conn = BB_CONN;
+  }
+  return entry->remote_file;
+}
+
+/**
+ * Read bytes [start, end) of entry into the local copy
+ */
+int cache_fetch_range(struct file_cache_local *entry, off_t start, off_t end) {
+  void *file = cache_remote_file(entry);
+  if (file == NULL) {
+    return -EIO;
+  }
+  char *buf = (char *)malloc(BB_DATA->xfer_chunk * sizeof(char));
+  if (buf == NULL) {
+    return -ENOMEM;
+  }
+  for (off_t r = start; r < end; ) {
+    size_t want = end - r < BB_DATA->xfer_chunk ? end - r : BB_DATA->xfer_chunk;
+    ssize_t nread = bb_remote(read, file, buf, want, r);
+    if (nread < 0) {
+      free(buf);
+      return nread;
+    }
+    if (nread == 0) {
+      break; // remote got shorter, the rest stays zero
+    }
+    if (pwrite(entry->fetch_fd, buf, nread, r) != nread) {
+      int retstat = log_error("pwrite");
+      free(buf);
+      return retstat;
+    }
+    r += nread;
+  }
+  free(buf);
+  return 0;
+}
+
+/**
+ * Read blocks [first, last) of entry from the remote into the local copy
+ */
+int cache_fetch_blocks(struct file_cache_local *entry, size_t first, size_t last) {
+  off_t start = (off_t) first * BB_DATA->block_size;
+  off_t end = (off_t) last * BB_DATA->block_size;
+  if (end > entry->fetch_limit) {
+    end = entry->fetch_limit;
+  }
+  int retstat = cache_fetch_range(entry, start, end);
+  if (retstat < 0) {
+    return retstat;
+  }
+
+  bb_count(BB_DATA->cache.fetches, 1);
+  bb_count(BB_DATA->cache.fetch_bytes, end - start);
+  if (block_map_set(&entry->present, first, last) < 0) {
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+/**
+ * Ask the remote for one block ahead of time. The reply is picked up by
+ * cache_prefetch_collect, so the transfer overlaps with whatever the
+ * application does until its next read.
+ */
+void cache_prefetch_block(struct file_cache_local *entry, size_t block) {
+  off_t start = (off_t) block * BB_DATA->block_size;
+  if (BB_DATA->transport.read_begin == NULL || start >= entry->fetch_limit || entry->ninflight == PREFETCH_MAX
+      || block_map_test(&entry->present, block) || block_map_test(&entry->prefetched, block)) {
+    return;
+  }
+  off_t len = entry->fetch_limit - start < BB_DATA->block_size ? entry->fetch_limit - start : BB_DATA->block_size;
+  void *file = cache_remote_file(entry);
+  int id = file != NULL ? bb_remote(read_begin, file, len, start) : -EIO;
+  if (id < 0) {
+    return;
+  }
+  if (block_map_set(&entry->prefetched, block, block + 1) < 0) {
+    return;
+  }
+  struct prefetch_req *req = &entry->inflight[entry->ninflight++];
+  req->block = block;
+  req->len = len;
+  req->id = id;
+  bb_count(BB_DATA->cache.prefetch_issued, 1);
+}
+
+/**
+ * Store readahead replies that have arrived. Requests for blocks in
+ * [first, last) are waited for, the others are only taken if ready.
+ */
+void cache_prefetch_collect(struct file_cache_local *entry, size_t first, size_t last) {
+  if (entry->ninflight == 0) {
+    return;
+  }
+  char *buf = (char *)malloc(BB_DATA->block_size * sizeof(char));
+  if (buf == NULL) {
+    return;
+  }
+  for (int i = 0; i < entry->ninflight; ) {
+    struct prefetch_req req = entry->inflight[i];
+    int wait = req.block >= first && req.block < last;
+    ssize_t nread = bb_remote(read_end, entry->remote_file, buf, req.len, req.id, wait);
+    if (nread == -EAGAIN) {
+      i++;
+      continue;
+    }
+    entry->inflight[i] = entry->inflight[--entry->ninflight];
+    // a short reply or a block written locally meanwhile is dropped
+    if (nread != req.len || block_map_test(&entry->present, req.block)) {
+      continue;
+    }
+    if (pwrite(entry->fetch_fd, buf, nread, (off_t) req.block * BB_DATA->block_size) != nread) {
+      log_error("pwrite");
+      continue;
+    }
+    block_map_set(&entry->present, req.block, req.block + 1);
+  }
+  free(buf);
+}
+
+/**
+ * Make sure bytes [offset, offset + size) of a lazily cached entry are in
+ * the local copy, fetching each run of missing blocks with one ranged read
+ */
+int cache_fetch(struct file_cache_local *entry, off_t offset, size_t size) {
+  if (entry == NULL || !entry->lazy) {
+    return 0;
+  }
+  off_t end = offset + size < entry->fetch_limit ? offset + size : entry->fetch_limit;
+  if (offset >= end) {
+    return 0;
+  }
+  size_t first = offset / BB_DATA->block_size;
+  size_t last = (end - 1) / BB_DATA->block_size + 1;
+  cache_prefetch_collect(entry, first, last);
+  for (size_t b = first; b < last; b++) {
+    if (block_map_test(&entry->present, b)) {
+      continue;
+    }
+    size_t e = b + 1;
+    while (e < last && !block_map_test(&entry->present, e)) {
+      e++;
+    }
+    int retstat = cache_fetch_blocks(entry, b, e);
+    if (retstat < 0) {
+      return retstat;
+    }
+    b = e;
+  }
+  return 0;
+}
+
+/**
+ * Name under which the local copy of remote fpath is kept: a hash of the
+ * host and path, so the same file maps to the same copy on every mount
+ */
+void cache_local_path(char localpath[PATH_MAX], const char *fpath) {
+  char key[CACHE_KEY_MAX];
+  snprintf(key, sizeof(key), "%s:%s", BB_DATA->cache_key, fpath);
+  snprintf(localpath, PATH_MAX, "%s/%016llx", BB_DATA->cache_dir, (unsigned long long) bb_hash64(key));
+}
+
+/**
+ * Record that the local copy of entry is in sync with the remote, so a
+ * later open can reuse it
+ */
+int cache_save(struct file_cache_local *entry) {
+  char key[CACHE_KEY_MAX], metapath[PATH_MAX];
+  snprintf(key, sizeof(key), "%s:%s", BB_DATA->cache_key, entry->remotepath);
+  snprintf(metapath, sizeof(metapath), "%s.meta", entry->localpath);
+  if (file_cache_save_meta(entry, key, metapath, BB_DATA->block_size) < 0) {
+    log_error("save cache metadata");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Stop trusting the local copy of entry, before it starts to differ from
+ * the remote
+ */
+void cache_unsave(struct file_cache_local *entry) {
+  char metapath[PATH_MAX];
+  snprintf(metapath, sizeof(metapath), "%s.meta", entry->localpath);
+  unlink(metapath);
+}
+
+/**
+ * Attributes of the remote file behind fpath, following symlinks as open
+ * does. A fresh attribute cache entry for a regular file saves the trip.
+ */
+int cache_remote_stat(const char *fpath, struct stat *statbuf) {
+  if (attr_cache_get(&BB_DATA->attrs, fpath, statbuf) && S_ISREG(statbuf->st_mode)) {
+    return 0;
+  }
+  return bb_remote(stat, fpath, statbuf);
+}
+
+/**
+ * Bring a released entry back into use. A clean copy is reused if the
+ * remote file still has the mtime and size it had at the last sync; a
+ * dirty one is newer than the remote and is always reused.
+ */
+int cache_reopen(struct file_cache_local *entry) {
+  if (!entry->dirty) {
+    struct stat remote, sb;
+    if (cache_remote_stat(entry->remotepath, &remote) < 0
+        || remote.st_mtime != entry->remote_mtime || remote.st_size != entry->remote_size
+        || lstat(entry->localpath, &sb) < 0 || sb.st_size != entry->remote_size) {
+      log_msg("cached copy of %s is stale\n", entry->remotepath);
+      bb_count(BB_DATA->cache.stale, 1);
+      return EXIT_FAILURE;
+    }
+  }
+  if (entry->lazy) {
+    entry->fetch_fd = open(entry->localpath, O_RDWR);
+    if (entry->fetch_fd < 0) {
+      log_error("open");
+      return EXIT_FAILURE;
+    }
+    // without -o lazy the copy is completed now, as a download would be
+    if (!BB_DATA->lazy && cache_fetch(entry, 0, entry->fetch_limit) < 0) {
+      return EXIT_FAILURE;
+    }
+  }
+  bb_count(BB_DATA->cache.reused, 1);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Let go of the descriptor and remote handle of entry once no file handle
+ * uses it. The local copy and what is known about it stay.
+ */
+void cache_detach(struct file_cache_local *entry) {
+  if (entry->remote_file != NULL) {
+    cache_prefetch_collect(entry, 0, SIZE_MAX);
+    bb_remote(close, entry->remote_file);
+    entry->remote_file = NULL;
+  }
+  entry->remote_conn = NULL;
+  bb_count(BB_DATA->cache.prefetch_wasted, (unsigned long long) block_map_count(&entry->prefetched) * BB_DATA->block_size);
+  block_map_clear(&entry->prefetched);
+  if (entry->fetch_fd >= 0) {
+    close(entry->fetch_fd);
+    entry->fetch_fd = -1;
+  }
+}
+
+/**
+ * Delete the local copy of entry and forget it
+ */
+void cache_drop(struct file_cache_local *entry) {
+  cache_detach(entry);
+  cache_unsave(entry);
+  unlink(entry->localpath);
+  file_cache_remove(&BB_DATA->cache, entry);
+}
+
+/**
+ * Charge the disk space now taken by the local copy of entry to the cache
+ */
+void cache_account(struct file_cache_local *entry) {
+  struct stat sb;
+  unsigned long long bytes = lstat(entry->localpath, &sb) == 0 ? (unsigned long long) sb.st_blocks * 512 : 0;
+  BB_DATA->cache.bytes += bytes - entry->disk_bytes;
+  entry->disk_bytes = bytes;
+}
+
+/**
+ * Count readahead hits for a read of [offset, offset + size), then detect
+ * sequential or strided access on this descriptor and keep the readahead
+ * window filled. The window starts at READAHEAD_INIT blocks, doubles each
+ * time the pattern carries on into a new block, up to -o readahead, and
+ * collapses when an access breaks the pattern.
+ */
+void cache_readahead(struct bb_file *file, off_t offset, size_t size) {
+  struct file_cache_local *entry = file->entry;
+  if (!entry->lazy || size == 0) {
+    return;
+  }
+  size_t bs = BB_DATA->block_size;
+  for (size_t b = offset / bs; b <= (offset + size - 1) / bs; b++) {
+    if (block_map_test(&entry->prefetched, b)) {
+      block_map_unset(&entry->prefetched, b);
+      bb_count(BB_DATA->cache.prefetch_hits, 1);
+    }
+  }
+  if (BB_DATA->readahead == 0) {
+    return;
+  }
+
+  off_t stride = 0;
+  if (offset != file->next_offset) {
+    stride = offset - file->last_offset;
+    if (stride != file->stride || stride == 0) {
+      // random access, or the first step of what may become a stride
+      file->stride = stride;
+      file->ra_window = 0;
+      file->last_offset = offset;
+      file->next_offset = offset + size;
+      return;
+    }
+  }
+  if (offset / bs != file->last_offset / bs || file->ra_window == 0) {
+    file->ra_window = file->ra_window == 0 ? READAHEAD_INIT : file->ra_window * 2;
+    if (file->ra_window > BB_DATA->readahead) {
+      file->ra_window = BB_DATA->readahead;
+    }
+  }
+  file->last_offset = offset;
+  file->next_offset = offset + size;
+
+  if (stride == 0) {
+    size_t next = (offset + size) / bs;
+    for (size_t b = next; b < next + file->ra_window; b++) {
+      cache_prefetch_block(entry, b);
+    }
+  } else {
+    for (unsigned int k = 1; k <= file->ra_window; k++) {
+      off_t ahead = offset + k * stride;
+      if (ahead < 0) {
+        break;
+      }
+      for (size_t b = ahead / bs; b <= (ahead + size - 1) / bs; b++) {
+        cache_prefetch_block(entry, b);
+      }
+    }
+  }
+}
+
+/**
+ * Note that bytes [offset, offset + size) of the local copy of entry were
+ * written
+ */
+void cache_mark_written(struct file_cache_local *entry, off_t offset, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  if (!entry->dirty) {
+    cache_unsave(entry);
+  }
+  entry->dirty = 1;
+  size_t first = offset / BB_DATA->block_size;
+  size_t last = (offset + size - 1) / BB_DATA->block_size + 1;
+  if (block_map_set(&entry->dirty_blocks, first, last) < 0) {
+    entry->dirty_all = 1;
+  }
+  // blocks overwritten completely are now local, the partial ones at the
+  // edges were fetched before the write
+  size_t full_first = (offset + BB_DATA->block_size - 1) / BB_DATA->block_size;
+  size_t full_last = (offset + size) / BB_DATA->block_size;
+  if (entry->lazy && full_first < full_last) {
+    block_map_set(&entry->present, full_first, full_last);
+  }
+}
+
+/**
+ * Note that the local copy of entry was truncated to size
+ */
+void cache_mark_truncated(struct file_cache_local *entry, off_t size) {
+  if (!entry->dirty) {
+    cache_unsave(entry);
+  }
+  entry->dirty = 1;
+  if (size < entry->trunc_size) {
+    entry->trunc_size = size;
+  }
+  if (size < entry->fetch_limit) {
+    entry->fetch_limit = size;
+  }
+}
+
+/**
+ * Fetch the block that a truncate to size will cut, so the part kept is
+ * the remote data and not a hole
+ */
+int cache_fetch_for_truncate(struct file_cache_local *entry, off_t size) {
+  off_t partial = size % BB_DATA->block_size;
+  return cache_fetch(entry, size - partial, partial);
+}
+
+/**
+ * Send only the blocks written since the last sync.
+ *
+ * If the file was shrunk in between, the remote is first cut to the
+ * smallest size it was truncated to, so that bytes past that point which
+ * were not rewritten read back as zeros, as they do locally.
+ */
+int cache_upload_delta(struct file_cache_local *entry, int fd, off_t size) {
+  void *file;
+  int retstat = bb_remote(open, entry->remotepath, O_WRONLY, &file);
+  if (retstat < 0) {
+    log_failure("Can't open remote file %s: %s\n", entry->remotepath, strerror(-retstat));
+    return EXIT_FAILURE;
+  }
+  if (entry->trunc_size < entry->remote_size && bb_remote(truncate, entry->remotepath, entry->trunc_size) < 0) {
+    bb_remote(close, file);
+    return EXIT_FAILURE;
+  }
+  char *buf = (char *)malloc(BB_DATA->xfer_chunk * sizeof(char));
+  if (buf == NULL) {
+    log_failure("Memory allocation error\n");
+    bb_remote(close, file);
+    return EXIT_FAILURE;
+  }
+
+  off_t sent = 0;
+  size_t nblocks = (size + BB_DATA->block_size - 1) / BB_DATA->block_size;
+  for (size_t b = 0; b < nblocks; b++) {
+    if (!block_map_test(&entry->dirty_blocks, b)) {
+      continue;
+    }
+    // coalesce a run of dirty blocks into one sequential write
+    size_t e = b + 1;
+    while (e < nblocks && block_map_test(&entry->dirty_blocks, e)) {
+      e++;
+    }
+    off_t start = (off_t) b * BB_DATA->block_size;
+    off_t end = (off_t) e * BB_DATA->block_size < size ? (off_t) e * BB_DATA->block_size : size;
+    for (off_t w = start; w < end; ) {
+      size_t want = end - w < BB_DATA->xfer_chunk ? end - w : BB_DATA->xfer_chunk;
+      ssize_t nread = pread(fd, buf, want, w);
+      if (nread <= 0) {
+        if (nread < 0 && errno == EINTR) continue;
+        log_error("pread");
+        free(buf); bb_remote(close, file);
+        return EXIT_FAILURE;
+      }
+      for (ssize_t done = 0; done < nread; ) {
+        ssize_t nwrite = bb_remote(write, file, buf + done, nread - done, w + done);
+        if (nwrite <= 0) {
+          log_failure("Can't write to remote file %s: %d\n", entry->remotepath, (int) nwrite);
+          free(buf); bb_remote(close, file);
+          return EXIT_FAILURE;
+        }
+        done += nwrite;
+      }
+      w += nread;
+    }
+    sent += end - start;
+    b = e;
+  }
+  free(buf);
+  bb_remote(close, file);
+
+  if ((size != entry->remote_size || entry->trunc_size < entry->remote_size)
+      && bb_remote(truncate, entry->remotepath, size) < 0) {
+    return EXIT_FAILURE;
+  }
+  log_msg("sent %lld of %lld bytes of %s\n", (long long) sent, (long long) size, entry->remotepath);
+  bb_count(BB_DATA->cache.delta_uploads, 1);
+  bb_count(BB_DATA->cache.delta_bytes, sent);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Replace the remote file with the whole local copy of entry. The
+ * transport may still send only what differs from the remote.
+ */
+int cache_upload_full(struct file_cache_local *entry, int fd, off_t size) {
+  int retstat = bb_remote(put, entry->remotepath, fd, size, entry->remote_size);
+  if (retstat < 0) {
+    log_failure("Can't upload %s: %s\n", entry->remotepath, strerror(-retstat));
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Push the local copy of entry back to the remote, sending only the dirty
+ * blocks when they are known and falling back to a full copy otherwise
+ */
+int cache_upload(struct file_cache_local *entry) {
+  int fd = open(entry->localpath, O_RDONLY);
+  if (fd < 0) {
+    log_error("open");
+    return EXIT_FAILURE;
+  }
+  struct stat sb;
+  int rc = fstat(fd, &sb);
+  if (rc != EXIT_SUCCESS) {
+    log_error("fstat");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  rc = EXIT_FAILURE;
+  if (!entry->dirty_all) {
+    rc = cache_upload_delta(entry, fd, sb.st_size);
+  }
+  if (rc != EXIT_SUCCESS && cache_fetch(entry, 0, sb.st_size) == 0) {
+    rc = cache_upload_full(entry, fd, sb.st_size);
+  }
+  close(fd);
+  attr_cache_invalidate(&BB_DATA->attrs, entry->remotepath);
+  // marked in the current pass, so a refresh that listed the file before
+  // the upload landed does not make its node fresh again
+  snap_changed(entry->remotepath + strlen(BB_DATA->rootdir));
+
+  if (rc == EXIT_SUCCESS) {
+    entry->dirty = 0;
+    entry->dirty_all = 0;
+    block_map_clear(&entry->dirty_blocks);
+    entry->remote_size = entry->trunc_size = sb.st_size;
+    // the upload set a new remote mtime, which the sidecar has to carry
+    struct stat remote;
+    entry->remote_mtime = cache_remote_stat(entry->remotepath, &remote) == 0 ? remote.st_mtime : -1;
+    bb_count(BB_DATA->cache.uploads, 1);
+  }
+  return rc;
+}
+
+/**
+ * Push a released entry back to the remote if it is dirty. Used by the
+ * write-back worker, and before dropping an entry.
+ */
+int cache_writeback(struct file_cache_local *entry) {
+  if (!entry->dirty) {
+    return EXIT_SUCCESS;
+  }
+  if (entry->lazy && entry->fetch_fd < 0) {
+    entry->fetch_fd = open(entry->localpath, O_RDWR);
+  }
+  int rc = cache_upload(entry);
+  cache_detach(entry);
+  if (rc == EXIT_SUCCESS) {
+    cache_save(entry);
+  }
+  return rc;
+}
+
+/**
+ * cache_writeback with the cache lock dropped during the upload, so the
+ * rest of the mount is not held up by it. entry is marked FLUSH_RUNNING
+ * meanwhile, which keeps everyone else off it.
+ */
+int cache_writeback_unlocked(struct file_cache_local *entry) {
+  if (!entry->dirty) {
+    return EXIT_SUCCESS;
+  }
+  entry->flush = FLUSH_RUNNING;
+  pthread_mutex_unlock(&BB_DATA->lock);
+  int rc = cache_writeback(entry);
+  pthread_mutex_lock(&BB_DATA->lock);
+  entry->flush = FLUSH_NONE;
+  pthread_cond_broadcast(&BB_DATA->idle);
+  return rc;
+}
+
+/**
+ * Evict released entries, least recently used first, until the cache is
+ * within its entry and byte budgets. A dirty entry is written back first
+ * and kept if that fails, entries waiting for the write-back worker are
+ * left to it. Open entries are never evicted, so the budgets are exceeded
+ * rather than failing an open while many files are in use. The cache lock
+ * is dropped during write-backs.
+ *
+ * This and the other cache functions below expect the cache lock held.
+ */
+void cache_evict(void) {
+  struct file_cache *fc = &BB_DATA->cache;
+  struct file_cache_local *entry = fc->lru_head;
+  while (entry != NULL && (fc->num_cache > fc->max_cache || fc->bytes > fc->max_bytes)) {
+    // the list may change while a write-back has the lock dropped, but
+    // entry stays on it until it is dropped here
+    if (entry->flush != FLUSH_NONE || cache_writeback_unlocked(entry) != EXIT_SUCCESS) {
+      entry = entry->lru_next;
+      continue;
+    }
+    struct file_cache_local *next = entry->lru_next;
+    log_msg("evicting %s (%llu bytes)\n", entry->remotepath, entry->disk_bytes);
+    fc->evictions++;
+    cache_drop(entry);
+    entry = next;
+  }
+}
+
+/**
+ * Hand entry to the write-back worker
+ */
+void cache_flush_enqueue(struct file_cache_local *entry) {
+  entry->flush = FLUSH_QUEUED;
+  entry->flush_next = NULL;
+  if (BB_DATA->flush_tail != NULL) {
+    BB_DATA->flush_tail->flush_next = entry;
+  } else {
+    BB_DATA->flush_head = entry;
+  }
+  BB_DATA->flush_tail = entry;
+  BB_DATA->flush_len++;
+  pthread_cond_signal(&BB_DATA->flush_work);
+}
+
+/**
+ * Take a queued entry back from the write-back worker
+ */
+void cache_flush_dequeue(struct file_cache_local *entry) {
+  struct file_cache_local **slot = &BB_DATA->flush_head, *prev = NULL;
+  while (*slot != entry) {
+    prev = *slot;
+    slot = &(*slot)->flush_next;
+  }
+  *slot = entry->flush_next;
+  if (BB_DATA->flush_tail == entry) {
+    BB_DATA->flush_tail = prev;
+  }
+  entry->flush = FLUSH_NONE;
+  entry->flush_next = NULL;
+  BB_DATA->flush_len--;
+  pthread_cond_broadcast(&BB_DATA->flush_space);
+}
+
+/**
+ * Write-back worker: uploads released dirty entries in the order they
+ * were queued, over its own connection. The cache lock is dropped during
+ * each upload; the entry is marked FLUSH_RUNNING meanwhile, which keeps
+ * everyone else off it. Exits once the queue is empty and flush_stop is
+ * set.
+ */
+void *cache_flush_worker(void *arg) {
+  bb_thread_conn = &BB_DATA->flush_conn;
+  pthread_mutex_lock(&BB_DATA->lock);
+  for (;;) {
+    while (BB_DATA->flush_head == NULL && !BB_DATA->flush_stop) {
+      pthread_cond_wait(&BB_DATA->flush_work, &BB_DATA->lock);
+    }
+    struct file_cache_local *entry = BB_DATA->flush_head;
+    if (entry == NULL) {
+      break;
+    }
+    cache_flush_dequeue(entry);
+    int rc = cache_writeback_unlocked(entry);
+    if (rc == EXIT_SUCCESS) {
+      BB_DATA->cache.flushes++;
+    } else {
+      log_failure("write-back of %s failed, kept dirty\n", entry->remotepath);
+    }
+    cache_account(entry);
+    cache_evict();
+  }
+  pthread_mutex_unlock(&BB_DATA->lock);
+  return NULL;
+}
+
+/**
+ * Look fpath up in the cache, waiting for a load or an upload of it in
+ * progress to finish first
+ */
+struct file_cache_local *cache_find_idle(const char *fpath) {
+  struct file_cache_local *entry;
+  while ((entry = file_cache_find(&BB_DATA->cache, fpath)) != NULL
+         && (entry->flush == FLUSH_RUNNING || entry->loading)) {
+    pthread_cond_wait(&BB_DATA->idle, &BB_DATA->lock);
+  }
+  return entry;
+}
+
+/**
+ * Open remote path by caching in the cache directory. A copy kept from an
+ * earlier open is revalidated with one stat and only fetched again if the
+ * remote file changed.
+ *
+ * The cache lock is dropped while the remote is consulted, so other files
+ * can be opened and released meanwhile. The entry is marked loading, which
+ * makes other opens of the same path wait for the outcome.
+*/
+struct file_cache_local *cache_open(const char *fpath) {
+  struct file_cache_local *entry = cache_find_idle(fpath);
+  if (entry != NULL && entry->access > 0) {
+    entry->access++;
+    log_msg("cached remote %s mapped to %s\n", fpath, entry->localpath);
+    return entry;
+  }
+  if (entry != NULL) {
+    if (entry->flush == FLUSH_QUEUED) {
+      // still dirty, the next release uploads both rounds of changes
+      cache_flush_dequeue(entry);
+      BB_DATA->cache.coalesced++;
+    }
+    file_cache_lru_remove(&BB_DATA->cache, entry);
+    entry->access = 1;
+    entry->loading = 1;
+    pthread_mutex_unlock(&BB_DATA->lock);
+    int rc = cache_reopen(entry);
+    pthread_mutex_lock(&BB_DATA->lock);
+    entry->loading = 0;
+    pthread_cond_broadcast(&BB_DATA->idle);
+    if (rc == EXIT_SUCCESS) {
+      log_msg("remote %s still mapped to %s\n", fpath, entry->localpath);
+      return entry;
+    }
+    cache_drop(entry);
+  }
+  // no usable local copy
+  char localpath[PATH_MAX];
+  cache_local_path(localpath, fpath);
+  entry = file_cache_insert(&BB_DATA->cache, fpath, localpath);
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->loading = 1;
+  cache_evict();
+  pthread_mutex_unlock(&BB_DATA->lock);
+  struct stat remote;
+  int rc = EXIT_FAILURE;
+  if (cache_remote_stat(fpath, &remote) == 0) {
+    rc = BB_DATA->lazy ? cache_create_sparse(entry, remote.st_size) : cache_download(entry, remote.st_size);
+  }
+  pthread_mutex_lock(&BB_DATA->lock);
+  entry->loading = 0;
+  pthread_cond_broadcast(&BB_DATA->idle);
+  if (rc != EXIT_SUCCESS) {
+    cache_drop(entry);
+    return NULL;
+  }
+  entry->remote_mtime = remote.st_mtime;
+
+  log_msg("remote %s mapped to %s\n", fpath, entry->localpath);
+  return entry;
+}
+
+/**
+ * Close remote path. Flush if access to remote 
+*/
+int cache_close(struct file_cache_local *entry) {
+  if (--entry->access > 0) {
+    return EXIT_SUCCESS;
+  }
+  if (entry->deleted) {
+    // the remote file is gone, so are the changes to it
+    log_msg("%s was deleted while open, not uploading\n", entry->remotepath);
+    cache_detach(entry);
+    file_cache_remove(&BB_DATA->cache, entry);
+    return EXIT_SUCCESS;
+  }
+  if (entry->dirty && BB_DATA->flush_queue > 0) {
+    cache_detach(entry);
+    cache_account(entry);
+    file_cache_lru_push(&BB_DATA->cache, entry);
+    cache_flush_enqueue(entry);
+    log_msg("%s queued for upload\n", entry->remotepath);
+    // a full queue holds back the releasing thread; entry belongs to the
+    // worker from here on and may be gone once the wait returns
+    while (BB_DATA->flush_len > BB_DATA->flush_queue) {
+      pthread_cond_wait(&BB_DATA->flush_space, &BB_DATA->lock);
+    }
+    return EXIT_SUCCESS;
+  }
+  // no more local access to file, time to flush to remote if it changed
+  int rc = EXIT_SUCCESS;
+  if (entry->dirty) {
+    rc = cache_upload(entry);
+  } else {
+    struct stat sb;
+    if (lstat(entry->localpath, &sb) == 0) {
+      bb_count(BB_DATA->cache.bytes_saved, sb.st_size);
+    }
+    bb_count(BB_DATA->cache.uploads_avoided, 1);
+    log_msg("%s is clean, not uploading\n", entry->remotepath);
+  }
+  cache_detach(entry);
+  // a copy in sync can be reused by later opens and mounts, one that failed
+  // to upload stays dirty and is written back again before eviction
+  if (rc == EXIT_SUCCESS) {
+    cache_save(entry);
+  }
+  cache_account(entry);
+  file_cache_lru_push(&BB_DATA->cache, entry);
+  log_msg("mapping %s -> %s is kept\n", entry->remotepath, entry->localpath);
+  return rc;
+}
+
+/**
+ * Changes to fpath that have not reached the remote yet, in an open file
+ * or one waiting for write-back, make the local copy the newer one: take
+ * the size and times in statbuf from it. Returns 1 if it did.
+ */
+int cache_local_attrs(const char *fpath, struct stat *statbuf) {
+  struct stat sb;
+  int pending = 0;
+  pthread_mutex_lock(&BB_DATA->lock);
+  struct file_cache_local *entry = file_cache_find(&BB_DATA->cache, fpath);
+  if (entry != NULL && !entry->loading && (entry->dirty || entry->flush != FLUSH_NONE)) {
+    pending = lstat(entry->localpath, &sb) == 0;
+  }
+  pthread_mutex_unlock(&BB_DATA->lock);
+  if (pending) {
+    statbuf->st_size = sb.st_size;
+    statbuf->st_blocks = sb.st_blocks;
+    statbuf->st_mtime = sb.st_mtime;
+    statbuf->st_ctime = sb.st_ctime;
+  }
+  return pending;
+}
+
+/**
+ * Start an operation through an open handle of entry: lock the entry and,
+ * if the operation may go to the remote, take the connection the entry's
+ * remote handle lives on
+ */
+void cache_enter(struct file_cache_local *entry, int remote) {
+  pthread_mutex_lock(&entry->lock);
+  if (remote || entry->lazy) {
+    bb_conn_get(entry->remote_conn);
+  }
+}
+
+void cache_leave(struct file_cache_local *entry) {
+  if (BB_CONN != NULL) {
+    bb_conn_put();
+  }
+  pthread_mutex_unlock(&entry->lock);
+}
+
+/**
+ * Drop a handle's reference to an entry entered with a connection, and
+ * leave it. The entry is unlocked before cache_close: a released entry
+ * may be uploaded and evicted as soon as the cache lock is dropped, which
+ * cache_close does while it waits for room in the write-back queue.
+ */
+int cache_release(struct file_cache_local *entry) {
+  pthread_mutex_lock(&BB_DATA->lock);
+  pthread_mutex_unlock(&entry->lock);
+  int rc = cache_close(entry);
+  cache_evict();
+  pthread_mutex_unlock(&BB_DATA->lock);
+  bb_conn_put();
+  return rc;
+}
+
+/**
+ * Drop the copy of fpath from the cache, if it is not open. With flush
+ * set, changes still waiting for write-back are uploaded first and the
+ * copy is kept if that fails; without it they are discarded, as for a
+ * file being deleted. The cache lock is dropped during the upload.
+ * Returns EXIT_FAILURE if changes could not be uploaded and are kept.
+ */
+int cache_forget(const char *fpath, int flush) {
+  struct file_cache_local *entry = cache_find_idle(fpath);
+  if (entry == NULL || entry->access > 0) {
+    return EXIT_SUCCESS;
+  }
+  if (entry->flush == FLUSH_QUEUED) {
+    cache_flush_dequeue(entry);
+  }
+  if (flush && cache_writeback_unlocked(entry) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  cache_drop(entry);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * cache_forget every released copy below the directory fpath
+ */
+void cache_forget_tree(const char *fpath, int flush) {
+  size_t len = strlen(fpath), n = 0;
+  char **paths = malloc(BB_DATA->cache.num_cache * sizeof(char *));
+  if (paths == NULL) {
+    return;
+  }
+  // collect the paths first, cache_forget may drop the lock
+  for (struct file_cache_local *entry = BB_DATA->cache.lru_head; entry != NULL; entry = entry->lru_next) {
+    if (strncmp(entry->remotepath, fpath, len) == 0 && entry->remotepath[len] == '/'
+        && (paths[n] = strdup(entry->remotepath)) != NULL) {
+      n++;
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    cache_forget(paths[i], flush);
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+/**
+ * Discard the copy of fpath once the remote file has been removed or
+ * replaced. An open copy is taken out of the cache and marked deleted
+ * instead, so its last release throws it away rather than uploading it
+ * again; its handles keep the local file as an unlinked one.
+ */
+void cache_delete(const char *fpath) {
+  struct file_cache_local *entry = cache_find_idle(fpath);
+  if (entry == NULL) {
+    return;
+  }
+  if (entry->access == 0) {
+    cache_forget(fpath, 0);
+    return;
+  }
+  entry->deleted = 1;
+  file_cache_unhash(&BB_DATA->cache, entry);
+  cache_unsave(entry);
+  unlink(entry->localpath);
+}
+
+/**
+ * File entry under fnewpath, whose copy of fnewpath must be gone: the
+ * local copy is renamed to the name that path maps to, and the sidecar is
+ * written again for the new key if the copy is in sync.
+ */
+void cache_rekey(struct file_cache_local *entry, const char *fnewpath) {
+  char localpath[PATH_MAX];
+  cache_local_path(localpath, fnewpath);
+  cache_unsave(entry);
+  if (rename(entry->localpath, localpath) < 0) {
+    log_error("rename cached copy");
+    return;
+  }
+  if (file_cache_rekey(&BB_DATA->cache, entry, fnewpath, localpath) < 0) {
+    rename(localpath, entry->localpath);
+    return;
+  }
+  if (!entry->dirty) {
+    cache_save(entry);
+  }
+  log_msg("cached copy moved along to %s\n", fnewpath);
+}
+
+/**
+ * Wait until fpath is idle, with nothing cached for fnewpath any more;
+ * whatever was is discarded as by cache_delete. Returns the entry of
+ * fpath.
+ */
+struct file_cache_local *cache_find_moved(const char *fpath, const char *fnewpath) {
+  struct file_cache_local *entry;
+  do {
+    cache_delete(fnewpath);
+    entry = cache_find_idle(fpath);
+  } while (entry != NULL && file_cache_find(&BB_DATA->cache, fnewpath) != NULL);
+  return entry;
+}
+
+/**
+ * Move the copy of fpath over to fnewpath once the remote file has been
+ * renamed, so it is uploaded to where the file now is. Open copies are
+ * held like a handle and entered meanwhile, as bb_truncate does, since
+ * their handles use the paths being changed. Takes the cache lock.
+ */
+void cache_rename(const char *fpath, const char *fnewpath) {
+  if (strcmp(fpath, fnewpath) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&BB_DATA->lock);
+  struct file_cache_local *entry = cache_find_moved(fpath, fnewpath);
+  if (entry == NULL || entry->access == 0) {
+    if (entry != NULL) {
+      cache_rekey(entry, fnewpath);
+    }
+    pthread_mutex_unlock(&BB_DATA->lock);
+    return;
+  }
+  entry->access++;
+  pthread_mutex_unlock(&BB_DATA->lock);
+  cache_enter(entry, 1);
+  pthread_mutex_lock(&BB_DATA->lock);
+  // an unlink or another rename may have got there first
+  if (cache_find_moved(fpath, fnewpath) == entry) {
+    cache_rekey(entry, fnewpath);
+  }
+  pthread_mutex_unlock(&BB_DATA->lock);
+  cache_release(entry);
+}
+
+/**
+ * cache_rename every copy, open or not, below the directory fpath
+ */
+void cache_rename_tree(const char *fpath, const char *fnewpath) {
+  size_t len = strlen(fpath), n = 0;
+  pthread_mutex_lock(&BB_DATA->lock);
+  char **paths = malloc(BB_DATA->cache.num_cache * sizeof(char *));
+  if (paths == NULL) {
+    pthread_mutex_unlock(&BB_DATA->lock);
+    return;
+  }
+  // open copies are on no list, so the whole table is walked
+  for (int b = 0; b < CACHE_BUCKETS; b++) {
+    for (struct file_cache_local *entry = BB_DATA->cache.buckets[b]; entry != NULL; entry = entry->next) {
+      if (strncmp(entry->remotepath, fpath, len) == 0 && entry->remotepath[len] == '/'
+          && (paths[n] = strdup(entry->remotepath)) != NULL) {
+        n++;
+      }
+    }
+  }
+  pthread_mutex_unlock(&BB_DATA->lock);
+  char newpath[PATH_MAX];
+  for (size_t i = 0; i < n; i++) {
+    if (snprintf(newpath, sizeof(newpath), "%s%s", fnewpath, paths[i] + len) < (int) sizeof(newpath)) {
+      cache_rename(paths[i], newpath);
+    }
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+/**
+ * Check the copies picked up by cache_scan against the remote, a batch of
+ * stats per round trip. Stale ones are dropped now, the attributes of the
+ * others are kept so reopening them soon needs no further stat.
+ */
+void cache_scan_validate(void) {
+  struct file_cache_local *batch[MDPIPE_BATCH];
+  const char *paths[MDPIPE_BATCH];
+  struct stat remote[MDPIPE_BATCH];
+  int status[MDPIPE_BATCH];
+  int dropped = 0;
+  struct file_cache_local *entry = BB_DATA->cache.lru_head;
+  while (entry != NULL) {
+    int n = 0;
+    for (; entry != NULL && n < MDPIPE_BATCH; entry = entry->lru_next) {
+      batch[n] = entry;
+      paths[n++] = entry->remotepath;
+    }
+    if (mdpipe_stat_batch(&BB_DATA->pipe, paths, n, remote, status) < 0) {
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      if (status[i] == 0 && remote[i].st_mtime == batch[i]->remote_mtime
+          && remote[i].st_size == batch[i]->remote_size) {
+        remote[i].st_blksize = BB_DATA->blksize;
+        attr_cache_put(&BB_DATA->attrs, batch[i]->remotepath, &remote[i]);
+      } else if (status[i] == 0 || status[i] == -ENOENT) {
+        file_cache_lru_remove(&BB_DATA->cache, batch[i]);
+        cache_drop(batch[i]);
+        dropped++;
+      }
+    }
+  }
+  log_msg("cache directory: %d stale copies dropped\n", dropped);
+}
+
+/**
+ * Pick up the copies a previous mount left in the cache directory, as
+ * released entries. Copies whose sidecar is unusable are deleted, those
+ * of other hosts are left alone.
+ */
+void cache_scan(void) {
+  DIR *dp = opendir(BB_DATA->cache_dir);
+  if (dp == NULL) {
+    log_error("cache_scan opendir");
+    return;
+  }
+  char prefix[CACHE_KEY_MAX], key[CACHE_KEY_MAX];
+  char localpath[PATH_MAX], metapath[PATH_MAX], expected[PATH_MAX];
+  size_t prefixlen = snprintf(prefix, sizeof(prefix), "%s:", BB_DATA->cache_key);
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (len <= 5 || strcmp(de->d_name + len - 5, ".meta") != 0) {
+      continue;
+    }
+    snprintf(metapath, sizeof(metapath), "%s/%s", BB_DATA->cache_dir, de->d_name);
+    snprintf(localpath, sizeof(localpath), "%s/%.*s", BB_DATA->cache_dir, (int) len - 5, de->d_name);
+    time_t mtime;
+    off_t size;
+    struct block_map present = { NULL, 0 };
+    int partial = file_cache_load_meta(metapath, BB_DATA->block_size, key, sizeof(key), &mtime, &size, &present);
+    if (partial >= 0 && strncmp(key, prefix, prefixlen) != 0) {
+      block_map_clear(&present);
+      continue;
+    }
+    struct stat sb;
+    struct file_cache_local *entry = NULL;
+    if (partial >= 0) {
+      cache_local_path(expected, key + prefixlen);
+      if (strcmp(expected, localpath) == 0 && lstat(localpath, &sb) == 0 && sb.st_size == size
+          && file_cache_find(&BB_DATA->cache, key + prefixlen) == NULL) {
+        entry = file_cache_insert(&BB_DATA->cache, key + prefixlen, localpath);
+      }
+    }
+    if (entry == NULL) {
+      block_map_clear(&present);
+      unlink(metapath);
+      unlink(localpath);
+      continue;
+    }
+    entry->access = 0;
+    entry->remote_mtime = mtime;
+    entry->remote_size = entry->trunc_size = entry->fetch_limit = size;
+    entry->lazy = partial;
+    entry->present = present;
+    cache_account(entry);
+    file_cache_lru_push(&BB_DATA->cache, entry);
+  }
+  closedir(dp);
+  if (BB_DATA->pipeline) {
+    cache_scan_validate();
+  }
+  log_msg("cache directory %s holds %d copies, %llu bytes\n",
+          BB_DATA->cache_dir, BB_DATA->cache.num_cache, BB_DATA->cache.bytes);
+  cache_evict();
+}
+
+/////// Statistics stuff
+
+/**
+ * Which of the virtual statistics paths path is: 1 for the directory,
+ * 2 for the file, 0 for a path of the remote tree
+ */
+int bb_stats_path(const char *path) {
+  if (strcmp(path, STATS_DIR) == 0) {
+    return 1;
+  }
+  return strcmp(path, STATS_FILE) == 0 ? 2 : 0;
+}
+
+/**
+ * Nonzero for the statistics paths and anything below the directory, all
+ * of which is served here: changes to them are refused instead of being
+ * passed on to the remote
+ */
+int bb_stats_fixed(const char *path) {
+  size_t len = strlen(STATS_DIR);
+  return strncmp(path, STATS_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+void bb_stats_stat(int which, struct stat *statbuf) {
+  memset(statbuf, 0, sizeof(struct stat));
+  statbuf->st_uid = getuid();
+  statbuf->st_gid = getgid();
+  statbuf->st_mtime = statbuf->st_atime = statbuf->st_ctime = time(NULL);
+  statbuf->st_blksize = BB_DATA->blksize;
+  if (which == 1) {
+    statbuf->st_mode = S_IFDIR | 0555;
+    statbuf->st_nlink = 2;
+  } else {
+    // the contents change on every read, so the file is opened with
+    // direct_io and the size is only a hint
+    statbuf->st_mode = S_IFREG | 0444;
+    statbuf->st_nlink = 1;
+    statbuf->st_size = 4096;
+  }
+}
+
+/**
+ * The text of STATS_FILE: per-operation counts and latencies, then the
+ * counters of the caches, connections and transfers. The caller frees it.
+ */
+char *bb_stats_report(size_t *len) {
+  char *report = NULL;
+  FILE *f = open_memstream(&report, len);
+  if (f == NULL) {
+    return NULL;
+  }
+  stats_print(&BB_DATA->stats, f);
+  fprintf(f, "\n");
+  fprintf(f, "attr cache: %lu hits, %lu misses, ttl %.3fs\n",
+             BB_DATA->attrs.hits, BB_DATA->attrs.misses, BB_DATA->attrs.ttl);
+  fprintf(f, "negative cache: %lu hits, ttl %.3fs\n",
+             BB_DATA->attrs.neg_hits, BB_DATA->attrs.neg_ttl);
+  fprintf(f, "file cache: %lu uploads, %lu avoided, %llu bytes saved\n",
+             BB_DATA->cache.uploads, BB_DATA->cache.uploads_avoided, BB_DATA->cache.bytes_saved);
+  fprintf(f, "delta sync: %lu uploads, %llu bytes sent\n",
+             BB_DATA->cache.delta_uploads, BB_DATA->cache.delta_bytes);
+  fprintf(f, "lazy fetch: %lu reads, %llu bytes\n",
+             BB_DATA->cache.fetches, BB_DATA->cache.fetch_bytes);
+  fprintf(f, "readahead: %lu blocks issued, %lu hits (%.1f%%), %llu bytes wasted\n",
+             BB_DATA->cache.prefetch_issued, BB_DATA->cache.prefetch_hits,
+             BB_DATA->cache.prefetch_issued ? 100.0 * BB_DATA->cache.prefetch_hits / BB_DATA->cache.prefetch_issued : 0.0,
+             BB_DATA->cache.prefetch_wasted);
+  fprintf(f, "persistent cache: %lu opens reused a local copy, %lu copies were stale\n",
+             BB_DATA->cache.reused, BB_DATA->cache.stale);
+  fprintf(f, "cache budget: %d entries, %llu bytes kept, %lu evictions\n",
+             BB_DATA->cache.num_cache, BB_DATA->cache.bytes, BB_DATA->cache.evictions);
+  fprintf(f, "write-back: %lu uploads after release, %lu coalesced by a reopen\n",
+             BB_DATA->cache.flushes, BB_DATA->cache.coalesced);
+  fprintf(f, "connections: %d, %lu acquired, %lu had to wait\n",
+             BB_DATA->pool.size, BB_DATA->pool.acquires, BB_DATA->pool.waits);
+  fprintf(f, "remote: %lu %s transport calls, %lu sftp requests\n",
+             BB_DATA->remote_calls, BB_DATA->transport.name, BB_DATA->sftp_requests);
+  fprintf(f, "metadata pipeline: %lu requests, at most %lu in flight\n",
+             BB_DATA->pipe.requests, BB_DATA->pipe.max_inflight);
+  if (BB_DATA->helper_channel != NULL) {
+    fprintf(f, "helper: %lu requests%s\n", BB_DATA->helper.requests,
+               BB_DATA->helper.broken ? ", lost during the mount" : "");
+  }
+  fprintf(f, "parallel download: %lu files, %llu bytes, next over %d streams of %zu-byte ranges\n",
+             BB_DATA->xfer_down.transfers, BB_DATA->xfer_down.bytes,
+             BB_DATA->xfer_down.streams, BB_DATA->xfer_down.range);
+  fprintf(f, "parallel upload: %lu files, %llu bytes, next over %d streams of %zu-byte ranges\n",
+             BB_DATA->xfer_up.transfers, BB_DATA->xfer_up.bytes,
+             BB_DATA->xfer_up.streams, BB_DATA->xfer_up.range);
+  if (BB_DATA->snapshot) {
+    fprintf(f, "snapshot: %u entries, %zu bytes, %lu answered, %lu asked the remote\n",
+               BB_DATA->snap.count, snapshot_memory(&BB_DATA->snap), BB_DATA->snap.hits, BB_DATA->snap.misses);
+  }
+  fclose(f);
+  return report;
+}
+
+/**
+ * Open STATS_FILE read-only, taking a copy of the report that reads of
+ * this descriptor return
+ */
+int bb_stats_open(const char *path, struct fuse_file_info *fi) {
+  if (bb_stats_path(path) == 1) {
+    return -EISDIR;
+  }
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EACCES;
+  }
+  struct bb_file *file = calloc(1, sizeof(struct bb_file));
+  if (file == NULL) {
+    return -ENOMEM;
+  }
+  file->fd = -1;
+  file->handle = __atomic_add_fetch(&BB_DATA->trace.handles, 1, __ATOMIC_RELAXED);
+  file->text = bb_stats_report(&file->text_len);
+  if (file->text == NULL) {
+    free(file);
+    return -ENOMEM;
+  }
+  fi->direct_io = 1;
+  fi->fh = (uintptr_t) file;
+  return 0;
+}
+
+int bb_stats_read(struct bb_file *file, char *buf, size_t size, off_t offset) {
+  if (offset >= (off_t) file->text_len) {
+    return 0;
+  }
+  size = file->text_len - offset < size ? file->text_len - offset : size;
+  memcpy(buf, file->text + offset, size);
+  return size;
+}
+
+/////// BBFS stuff
+
+/**
+ * Log the outcome of a call to the transport, as log_syscall does for a
+ * system call
+ */
+int bb_remote_result(char *func, int retstat) {
+  log_retstat(func, retstat);
+  if (retstat < 0) {
+    log_failure("    ERROR %s: %s\n", func, strerror(-retstat));
+  }
+  return retstat;
+}
+
+/**
+ * Get file attributes.
+ *
+ * Served from the snapshot or the attribute cache when fresh, otherwise
+ * by the transport: over ssh one LSTAT on the metadata pipeline, which
+ * concurrent lookups share. The size and times of a file with changes not
+ * uploaded yet come from its local copy.
+ */
+int bb_getattr(const char *path, struct stat *statbuf) {
+  char fpath[PATH_MAX];
+
+  log_command("bb_getattr(path=\"%s\", statbuf=0x%08x)", path, statbuf);
+  int which = bb_stats_path(path);
+  if (which != 0) {
+    bb_stats_stat(which, statbuf);
+    return 0;
+  }
+  bb_fullpath(fpath, path);
+
+  int retstat = BB_DATA->snapshot ? snapshot_getattr(&BB_DATA->snap, path, statbuf) : 1;
+  if (retstat <= 0) {
+    log_msg("    snapshot hit\n");
+    if (retstat == 0) {
+      statbuf->st_blksize = BB_DATA->blksize;
+      cache_local_attrs(fpath, statbuf);
+      log_stat(statbuf);
+    }
+    return retstat;
+  }
+  if (attr_cache_get(&BB_DATA->attrs, fpath, statbuf)) {
+    log_msg("    attr cache hit\n");
+    cache_local_attrs(fpath, statbuf);
+    log_stat(statbuf);
+    return 0;
+  }
+  if (attr_cache_is_missing(&BB_DATA->attrs, fpath)) {
+    log_msg("    negative cache hit\n");
+    return -ENOENT;
+  }
+
+  retstat = bb_remote(lstat, fpath, statbuf);
+  if (retstat < 0) {
+    if (retstat == -ENOENT) {
+      attr_cache_put_missing(&BB_DATA->attrs, fpath);
     }
+    return retstat;
+  }
+  // until a pending upload lands the remote attributes are not worth keeping
+  if (!cache_local_attrs(fpath, statbuf)) {
+    attr_cache_put(&BB_DATA->attrs, fpath, statbuf);
   }
 
   log_stat(statbuf);
+  return 0;
 }
 
 /**
@@ -331,14 +2620,11 @@ int bb_readlink(const char *path, char *link, size_t size) {
 
   log_msg("bb_readlink(path=\"%s\", link=\"%s\", size=%d)", path, link, size);
   bb_fullpath(fpath, path);
-
-  retstat = log_syscall("fpath", readlink(fpath, link, size - 1), 0);
-  if (retstat >= 0) {
-    link[retstat] = '\0';
-    retstat = 0;
+  if (BB_DATA->snapshot && (retstat = snapshot_readlink(&BB_DATA->snap, path, link, size)) <= 0) {
+    return retstat;
   }
 
-  return retstat;
+  return bb_remote_result("readlink", bb_remote(readlink, fpath, link, size));
 }
 
 /**
@@ -349,17 +2635,17 @@ int bb_mknod(const char *path, mode_t mode, dev_t dev) {
   char fpath[PATH_MAX];
 
   log_command("bb_mknod(path=\"%s\", mode=0%3o, dev=%lld)", path, mode, dev);
-  bb_fullpath(fpath, path);
-  if (S_ISREG(mode)) {
-    retstat = log_syscall("open", open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode), 0);
-    if (retstat >= 0) {
-      retstat = log_syscall("close", close(retstat), 0);
-    }
-  } else if (S_ISFIFO(mode)) {
-    retstat = log_syscall("mkfifo", mkfifo(fpath, mode), 0);
-  } else {
-    retstat = log_syscall("mknod", mknod(fpath, mode, dev), 0);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
   }
+  bb_fullpath(fpath, path);
+  attr_cache_forget_missing(&BB_DATA->attrs, fpath);
+  snap_moved(path);
+  bb_conn_get(NULL);
+  retstat = bb_remote_result("mknod", bb_remote(mknod, fpath, mode, dev));
+  bb_conn_put();
+  // again, in case a concurrent lookup found the path missing meanwhile
+  attr_cache_forget_missing(&BB_DATA->attrs, fpath);
 
   return retstat;
 }
@@ -371,9 +2657,18 @@ int bb_mkdir(const char *path, mode_t mode) {
   char fpath[PATH_MAX];
 
   log_command("bb_mkdir(path=\"%s\", mode=0%3o)", path, mode);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  attr_cache_forget_missing(&BB_DATA->attrs, fpath);
+  snap_moved(path);
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("mkdir", bb_remote(mkdir, fpath, mode));
+  bb_conn_put();
+  attr_cache_forget_missing(&BB_DATA->attrs, fpath);
 
-  return log_syscall("mkdir", mkdir(fpath, mode), 0);
+  return retstat;
 }
 
 /**
@@ -383,9 +2678,28 @@ int bb_unlink(const char *path) {
   char fpath[PATH_MAX];
 
   log_command("bb_unlink(path=\"%s\")", path);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
+  snap_moved(path);
+  bb_conn_get(NULL);
+  pthread_mutex_lock(&BB_DATA->lock);
+  cache_forget(fpath, 0);
+  pthread_mutex_unlock(&BB_DATA->lock);
+  int retstat = bb_remote_result("unlink", bb_remote(unlink, fpath));
+  // an open copy, or one released meanwhile, must not bring the file back
+  if (retstat == 0) {
+    pthread_mutex_lock(&BB_DATA->lock);
+    cache_delete(fpath);
+    pthread_mutex_unlock(&BB_DATA->lock);
+  }
+  bb_conn_put();
+  // again, in case a concurrent lookup cached the file meanwhile
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
 
-  return log_syscall("unlink", unlink(fpath), 0);
+  return retstat;
 }
 
 /**
@@ -395,9 +2709,18 @@ int bb_rmdir(const char *path) {
   char fpath[PATH_MAX];
 
   log_command("bb_rmdir(path=\"%s\")", path);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
+  snap_moved(path);
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("rmdir", bb_remote(rmdir, fpath));
+  bb_conn_put();
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
 
-  return log_syscall("rmdir", rmdir(fpath), 0);
+  return retstat;
 }
 
 /**
@@ -407,9 +2730,18 @@ int bb_symlink(const char *path, const char *link) {
   char flink[PATH_MAX];
 
   log_command("bb_symlink(path=\"%s\", link=\"%s\")", path, link);
+  if (bb_stats_fixed(link)) {
+    return -EACCES;
+  }
   bb_fullpath(flink, link);
+  attr_cache_forget_missing(&BB_DATA->attrs, flink);
+  snap_moved(link);
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("symlink", bb_remote(symlink, path, flink));
+  bb_conn_put();
+  attr_cache_forget_missing(&BB_DATA->attrs, flink);
 
-  return log_syscall("symlink", symlink(path, flink), 0);
+  return retstat;
 }
 
 /**
@@ -420,10 +2752,35 @@ int bb_rename(const char *path, const char *newpath) {
   char fnewpath[PATH_MAX];
 
   log_command("bb_rename(fpath=\"%s\", newpath=\"%s\")", path, newpath);
+  if (bb_stats_fixed(path) || bb_stats_fixed(newpath)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
   bb_fullpath(fnewpath, newpath);
+  // a directory takes everything below it along
+  attr_cache_invalidate_tree(&BB_DATA->attrs, fpath);
+  attr_cache_invalidate_tree(&BB_DATA->attrs, fnewpath);
+  snap_moved(path);
+  snap_moved(newpath);
+  bb_conn_get(NULL);
+  pthread_mutex_lock(&BB_DATA->lock);
+  cache_forget(fpath, 1);
+  cache_forget(fnewpath, 0);
+  cache_forget_tree(fpath, 1);
+  cache_forget_tree(fnewpath, 0);
+  pthread_mutex_unlock(&BB_DATA->lock);
+  int retstat = bb_remote_result("rename", bb_remote(rename, fpath, fnewpath));
+  bb_conn_put();
+  // copies still open, or kept dirty, are uploaded to where the file went
+  if (retstat == 0) {
+    cache_rename(fpath, fnewpath);
+    cache_rename_tree(fpath, fnewpath);
+  }
+  // again, in case concurrent lookups cached either side meanwhile
+  attr_cache_invalidate_tree(&BB_DATA->attrs, fpath);
+  attr_cache_invalidate_tree(&BB_DATA->attrs, fnewpath);
 
-  return log_syscall("rename", rename(fpath, fnewpath), 0);
+  return retstat;
 }
 
 /**
@@ -433,10 +2790,22 @@ int bb_link(const char *path, const char *newpath) {
   char fpath[PATH_MAX], fnewpath[PATH_MAX];
 
   log_command("bb_link(path=\"%s\", newpath=\"%s\")", path, newpath);
+  if (bb_stats_fixed(path) || bb_stats_fixed(newpath)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
   bb_fullpath(fnewpath, newpath);
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
+  attr_cache_forget_missing(&BB_DATA->attrs, fnewpath);
+  snap_changed(path);
+  snap_moved(newpath);
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("link", bb_remote(link, fpath, fnewpath));
+  bb_conn_put();
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
+  attr_cache_forget_missing(&BB_DATA->attrs, fnewpath);
 
-  return log_syscall("link", link(fpath, fnewpath), 0);
+  return retstat;
 }
 
 /**
@@ -446,9 +2815,18 @@ int bb_chmod(const char *path, mode_t mode) {
   char fpath[PATH_MAX];
 
   log_command("bb_chmod(fpath=\"%s\", mode=0%03o)", path, mode);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
+  snap_changed(path);
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("chmod", bb_remote(chmod, fpath, mode));
+  bb_conn_put();
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
 
-  return log_syscall("chmod", chmod(fpath, mode), 0);
+  return retstat;
 }
 
 /**
@@ -458,9 +2836,18 @@ int bb_chown(const char *path, uid_t uid, gid_t gid) {
   char fpath[PATH_MAX];
 
   log_command("bb_chown(path=\"%s\", uid=%d, gid=%d)", path, uid, gid);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
+  snap_changed(path);
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("chown", bb_remote(chown, fpath, uid, gid));
+  bb_conn_put();
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
 
-  return log_syscall("chown", chown(fpath, uid, gid), 0);
+  return retstat;
 }
 
 /**
@@ -470,9 +2857,51 @@ int bb_truncate(const char *path, off_t newsize) {
   char fpath[PATH_MAX];
 
   log_command("bb_truncate(path=\"%s\", newsize=%lld)", path, newsize);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
+  snap_changed(path);
+
+  // an open file is truncated in its local copy and pushed on release, a
+  // released one has its pending changes pushed first
+  bb_conn_get(NULL);
+  pthread_mutex_lock(&BB_DATA->lock);
+  struct file_cache_local *entry = cache_find_idle(fpath);
+  int retstat;
+  if (entry != NULL && entry->access == 0) {
+    // truncating the remote under changes kept locally would lose them
+    if (cache_forget(fpath, 1) != EXIT_SUCCESS) {
+      pthread_mutex_unlock(&BB_DATA->lock);
+      bb_conn_put();
+      log_failure("pending changes to %s could not be uploaded, not truncating\n", fpath);
+      return -EIO;
+    }
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    entry->access++; // held like a handle, so it stays open
+  }
+  pthread_mutex_unlock(&BB_DATA->lock);
+  if (entry == NULL) {
+    retstat = bb_remote_result("truncate", bb_remote(truncate, fpath, newsize));
+    bb_conn_put();
+    attr_cache_invalidate(&BB_DATA->attrs, fpath);
+    return retstat;
+  }
+  bb_conn_put();
 
-  return log_syscall("truncate", truncate(fpath, newsize), 0);
+  cache_enter(entry, 1);
+  retstat = cache_fetch_for_truncate(entry, newsize);
+  if (retstat == 0) {
+    retstat = log_syscall("truncate", truncate(entry->localpath, newsize), 0);
+  }
+  if (retstat == 0) {
+    cache_mark_truncated(entry, newsize);
+  }
+  cache_release(entry);
+  return retstat;
 }
 
 /**
@@ -482,60 +2911,135 @@ int bb_utime(const char *path, struct utimbuf *ubuf) {
   char fpath[PATH_MAX];
 
   log_command("bb_utime(path=\"%s\", ubuf=0x%08x)", path, ubuf);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
+  snap_changed(path);
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("utime", bb_remote(utime, fpath, ubuf));
+  bb_conn_put();
+  attr_cache_invalidate(&BB_DATA->attrs, fpath);
 
-  return log_syscall("utime", utime(fpath, ubuf), 0);
+  return retstat;
 }
 
 /**
  * File open operation
  */
 int bb_open(const char *path, struct fuse_file_info *fi) {
-  int retstat = 0;
   int fd;
   char fpath[PATH_MAX];
 
   log_command("bb_open(path\"%s\", fi=0x%08x)",
               path, fi);
+  if (bb_stats_path(path)) {
+    return bb_stats_open(path, fi);
+  }
   bb_fullpath(fpath, path);
 
-  char localpath[L_tmpnam + 1];
-  int rc = cache_open(fpath, localpath);
-  if (rc == EXIT_FAILURE) {
-    log_msg("open failure\n");
-    return rc;
+  struct bb_file *file = malloc(sizeof(struct bb_file));
+  if (file == NULL) {
+    return -ENOMEM;
   }
-
-  fd = log_syscall("open", open(localpath, fi->flags), 0);
+  // size and mtime are the snapshot's no longer once it can be written
+  if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+    snap_changed(path);
+  }
+  bb_conn_get(NULL);
+  pthread_mutex_lock(&BB_DATA->lock);
+  struct file_cache_local *entry = cache_open(fpath);
+  pthread_mutex_unlock(&BB_DATA->lock);
+  bb_conn_put();
+  if (entry == NULL) {
+    log_failure("open failure\n");
+    free(file);
+    return -EIO;
+  }
+  // under the entry lock, as a rename may move the local copy
+  pthread_mutex_lock(&entry->lock);
+  if (fi->flags & O_TRUNC) {
+    cache_mark_truncated(entry, 0);
+  }
+  fd = log_syscall("open", open(entry->localpath, fi->flags), 0);
+  pthread_mutex_unlock(&entry->lock);
   if (fd < 0) {
-    retstat = log_error("open");
+    cache_enter(entry, 1);
+    cache_release(entry);
+    free(file);
+    return fd;
   }
 
-  fi->fh = fd;
+  file->fd = fd;
+  file->handle = __atomic_add_fetch(&BB_DATA->trace.handles, 1, __ATOMIC_RELAXED);
+  file->entry = entry;
+  file->last_offset = 0;
+  file->next_offset = 0;
+  file->stride = 0;
+  file->ra_window = 0;
+  file->text = NULL;
+  fi->fh = (uintptr_t) file;
 
   log_fi(fi);
 
-  return retstat;
+  return 0;
 }
 
 /**
  * Read data from an open file
  */
 int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-  log_command("bb_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)", path, buf, size, offset, fi);
+  struct bb_file *file = BB_FILE(fi);
+
+  // reads and writes are logged only at debug level, they are the hot path
+  log_command_at(BB_LOG_DEBUG, "bb_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)", path, buf, size, offset, fi);
   log_fi(fi);
 
-  return log_syscall("pread", pread(fi->fh, buf, size, offset), 0);
+  if (file->text != NULL) {
+    return bb_stats_read(file, buf, size, offset);
+  }
+  cache_enter(file->entry, 0);
+  int retstat = cache_fetch(file->entry, offset, size);
+  if (retstat == 0) {
+    retstat = log_syscall("pread", pread(file->fd, buf, size, offset), 0);
+  }
+  if (retstat > 0) {
+    cache_readahead(file, offset, retstat);
+  }
+  cache_leave(file->entry);
+
+  return retstat;
 }
 
 /**
  * Write data to an open file
  */
 int bb_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-  log_command("bb_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)", path, buf, size, offset, fi);
+  struct file_cache_local *entry = BB_FILE(fi)->entry;
+
+  log_command_at(BB_LOG_DEBUG, "bb_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)", path, buf, size, offset, fi);
   log_fi(fi);
 
-  return log_syscall("pwrite", pwrite(fi->fh, buf, size, offset), 0);
+  // blocks only partly overwritten need their remote content first
+  cache_enter(entry, 0);
+  int retstat = 0;
+  if (offset % BB_DATA->block_size != 0) {
+    retstat = cache_fetch(entry, offset, 1);
+  }
+  if (retstat == 0 && (offset + size) % BB_DATA->block_size != 0) {
+    retstat = cache_fetch(entry, offset + size - 1, 1);
+  }
+  if (retstat == 0) {
+    retstat = log_syscall("pwrite", pwrite(BB_FILE(fi)->fd, buf, size, offset), 0);
+  }
+  if (retstat > 0) {
+    cache_mark_written(entry, offset, retstat);
+    attr_cache_extend(&BB_DATA->attrs, entry->remotepath, offset + retstat);
+  }
+  cache_leave(entry);
+
+  return retstat;
 }
 
 /**
@@ -549,8 +3053,10 @@ int bb_statfs(const char *path, struct statvfs *statv)
   log_command("bb_statfs(path=\"%s\", statv=0x%08x)", path, statv);
   bb_fullpath(fpath, path);
 
-  // get stats for underlying filesystem
-  retstat = log_syscall("statvfs", statvfs(fpath, statv), 0);
+  // get stats for the remote filesystem
+  bb_conn_get(NULL);
+  retstat = bb_remote_result("statvfs", bb_remote(statvfs, fpath, statv));
+  bb_conn_put();
 
   log_statvfs(statv);
 
@@ -574,13 +3080,19 @@ int bb_release(const char *path, struct fuse_file_info *fi) {
   log_command("bb_release(path=\"%s\", fi=0x%08x)", path, fi);
   log_fi(fi);
 
-  int rc = log_syscall("close", close(fi->fh), 0);
-  if (rc != EXIT_SUCCESS) {
-    return rc;
+  struct bb_file *file = BB_FILE(fi);
+  if (file->text != NULL) {
+    free(file->text);
+    free(file);
+    return 0;
   }
-  char fpath[PATH_MAX];
-  bb_fullpath(fpath, path);
-  return cache_close(fpath);
+  int rc = log_syscall("close", close(file->fd), 0);
+  cache_enter(file->entry, 1);
+  if (cache_release(file->entry) != EXIT_SUCCESS && rc == 0) {
+    rc = -EIO;
+  }
+  free(file);
+  return rc;
 }
 
 /**
@@ -590,13 +3102,29 @@ int bb_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
   log_command("bb_fsync(path=\"%s\", datasync=%d, fi=0x%08x)", path, datasync, fi);
   log_fi(fi);
 
+  if (BB_FILE(fi)->text != NULL) {
+    return 0;
+  }
   // some unix-like systems (notably freebsd) don't have a datasync call
+  int retstat;
 #ifdef HAVE_FDATASYNC
   if (datasync)
-      return log_syscall("fdatasync", fdatasync(fi->fh), 0);
+      retstat = log_syscall("fdatasync", fdatasync(BB_FILE(fi)->fd), 0);
     else
 #endif
-  return log_syscall("fsync", fsync(fi->fh), 0);
+  retstat = log_syscall("fsync", fsync(BB_FILE(fi)->fd), 0);
+  if (retstat < 0) {
+    return retstat;
+  }
+
+  // durable means on the remote, so changes are not left for the release
+  struct file_cache_local *entry = BB_FILE(fi)->entry;
+  cache_enter(entry, 1);
+  if (entry->dirty && cache_upload(entry) != EXIT_SUCCESS) {
+    retstat = -EIO;
+  }
+  cache_leave(entry);
+  return retstat;
 }
 
 #ifdef HAVE_SYS_XATTR_H
@@ -606,9 +3134,18 @@ int bb_setxattr(const char *path, const char *name, const char *value, size_t si
 
   log_command("bb_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%d, flags=0x%08x)", path, name, value, size,
               flags);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  if (BB_DATA->transport.setxattr == NULL) {
+    return -ENOTSUP;
+  }
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("setxattr", bb_remote(setxattr, fpath, name, value, size, flags));
+  bb_conn_put();
 
-  return log_syscall("lsetxattr", lsetxattr(fpath, name, value, size, flags), 0);
+  return retstat;
 }
 
 /**
@@ -620,8 +3157,12 @@ int bb_getxattr(const char *path, const char *name, char *value, size_t size) {
 
   log_command("bb_getxattr(path=\"%s\", name=\"%s\", value=0x%08x, size=%d)", path, name, value, size);
   bb_fullpath(fpath, path);
-
-  retstat = log_syscall("lgetxattr", lgetxattr(fpath, name, value, size), 0);
+  if (BB_DATA->transport.getxattr == NULL) {
+    return -ENOTSUP;
+  }
+  bb_conn_get(NULL);
+  retstat = bb_remote_result("getxattr", bb_remote(getxattr, fpath, name, value, size));
+  bb_conn_put();
   if (retstat >= 0) {
     log_msg("    value = \"%s\"\n", value);
   }
@@ -639,8 +3180,12 @@ int bb_listxattr(const char *path, char *list, size_t size) {
 
   log_command("bb_listxattr(path=\"%s\", list=0x%08x, size=%d)", path, list, size);
   bb_fullpath(fpath, path);
-
-  retstat = log_syscall("llistxattr", llistxattr(fpath, list, size), 0);
+  if (BB_DATA->transport.listxattr == NULL) {
+    return -ENOTSUP;
+  }
+  bb_conn_get(NULL);
+  retstat = bb_remote_result("listxattr", bb_remote(listxattr, fpath, list, size));
+  bb_conn_put();
   if (retstat >= 0) {
     log_msg("    returned attributes (length %d):\n", retstat);
     for (ptr = list; ptr < list + retstat; ptr += strlen(ptr)+1) {
@@ -658,34 +3203,147 @@ int bb_removexattr(const char *path, const char *name) {
   char fpath[PATH_MAX];
 
   log_command("bb_removexattr(path=\"%s\", name=\"%s\")", path, name);
+  if (bb_stats_fixed(path)) {
+    return -EACCES;
+  }
   bb_fullpath(fpath, path);
+  if (BB_DATA->transport.removexattr == NULL) {
+    return -ENOTSUP;
+  }
+  bb_conn_get(NULL);
+  int retstat = bb_remote_result("removexattr", bb_remote(removexattr, fpath, name));
+  bb_conn_put();
 
-  return log_syscall("lremovexattr", lremovexattr(fpath, name), 0);
+  return retstat;
 }
 #endif
 
+/**
+ * Free a directory listing made by bb_opendir
+ */
+void bb_dir_free(struct bb_dir *dir) {
+  for (int i = 0; i < dir->count; i++) {
+    free(dir->entries[i].name);
+  }
+  free(dir->entries);
+  free(dir);
+}
+
+/**
+ * Append a name to a directory listing
+ */
+int bb_dir_add(void *arg, const char *name, mode_t mode) {
+  struct bb_dir *dir = arg;
+  if (dir->count == dir->capacity) {
+    int capacity = dir->capacity ? dir->capacity * 2 : 64;
+    struct bb_dirent *entries = realloc(dir->entries, capacity * sizeof(struct bb_dirent));
+    if (entries == NULL) {
+      return -ENOMEM;
+    }
+    dir->entries = entries;
+    dir->capacity = capacity;
+  }
+  struct bb_dirent *e = &dir->entries[dir->count];
+  e->name = strdup(name);
+  if (e->name == NULL) {
+    return -ENOMEM;
+  }
+  e->mode = mode;
+  dir->count++;
+  return 0;
+}
+
+// Where bb_dir_fill_entry puts an entry of a listing from the remote
+struct bb_dir_fill {
+  struct bb_dir *dir;
+  const char *path; // of the directory, relative to the mount
+  int retstat;
+};
+
+/**
+ * Add an entry of a listing from the remote, caching its attributes under
+ * the full path getattr looks it up by
+ */
+int bb_dir_fill_entry(void *arg, const char *name, const struct stat *statbuf) {
+  struct bb_dir_fill *fill = arg;
+  char epath[PATH_MAX], fpath[PATH_MAX];
+  size_t len = strlen(fill->path);
+  const char *sep = len > 0 && fill->path[len - 1] == '/' ? "" : "/";
+  if (snprintf(epath, sizeof(epath), "%s%s%s", fill->path, sep, name) < (int) sizeof(epath)) {
+    struct stat st = *statbuf;
+    st.st_blksize = BB_DATA->blksize;
+    bb_fullpath(fpath, epath);
+    attr_cache_put(&BB_DATA->attrs, fpath, &st);
+  }
+  fill->retstat = bb_dir_add(fill->dir, name, statbuf->st_mode);
+  return fill->retstat;
+}
+
 /**
  * Open directory
+ *
+ * The whole listing is read from the remote here, unless the snapshot
+ * has it. The transport hands over the attributes of each name along
+ * with it (SFTP READDIR replies carry them, the helper answers with the
+ * whole listing in a single reply), and these go into the attribute
+ * cache, so the getattr calls that follow a listing (ls -l, find, make)
+ * are answered locally.
  */
 int bb_opendir(const char *path, struct fuse_file_info *fi) {
-  DIR *dp;
-  int retstat = 0;
   char fpath[PATH_MAX];
 
   log_command("bb_opendir(path=\"%s\", fi=0x%08x)", path, fi);
   bb_fullpath(fpath, path);
 
-  dp = opendir(fpath);
-  log_msg("    opendir returned 0x%p\n", dp);
-  if (dp == NULL) {
-    retstat = log_error("bb_opendir opendir");
+  struct bb_dir *dir = calloc(1, sizeof(struct bb_dir));
+  if (dir == NULL) {
+    return -ENOMEM;
+  }
+  if (bb_stats_path(path)) {
+    if (bb_stats_path(path) == 2) {
+      free(dir);
+      return -ENOTDIR;
+    }
+    if (bb_dir_add(dir, ".", S_IFDIR) < 0 || bb_dir_add(dir, "..", S_IFDIR) < 0
+        || bb_dir_add(dir, strrchr(STATS_FILE, '/') + 1, S_IFREG) < 0) {
+      bb_dir_free(dir);
+      return -ENOMEM;
+    }
+    fi->fh = (uintptr_t) dir;
+    return 0;
+  }
+  int retstat = BB_DATA->snapshot ? snapshot_readdir(&BB_DATA->snap, path, bb_dir_add, dir) : 1;
+  if (retstat < 0) {
+    bb_dir_free(dir);
+    return retstat;
+  }
+  if (retstat == 0) {
+    log_msg("    snapshot hit, %d entries\n", dir->count);
+    fi->fh = (uintptr_t) dir;
+    return 0;
+  }
+  // a partial listing from the snapshot is read again
+  bb_dir_free(dir);
+  dir = calloc(1, sizeof(struct bb_dir));
+  if (dir == NULL) {
+    return -ENOMEM;
+  }
+  struct bb_dir_fill fill = {dir, path, 0};
+  if ((retstat = bb_dir_add(dir, ".", S_IFDIR)) == 0 && (retstat = bb_dir_add(dir, "..", S_IFDIR)) == 0) {
+    retstat = bb_remote(readdir, fpath, bb_dir_fill_entry, &fill);
+    retstat = retstat == 0 ? fill.retstat : retstat;
+  }
+  log_msg("    opendir read %d entries\n", dir->count);
+  if (retstat < 0) {
+    bb_dir_free(dir);
+    return bb_remote_result("readdir", retstat);
   }
 
-  fi->fh = (intptr_t) dp;
+  fi->fh = (uintptr_t) dir;
 
   log_fi(fi);
 
-  return retstat;
+  return 0;
 }
 
 /**
@@ -693,46 +3351,36 @@ int bb_opendir(const char *path, struct fuse_file_info *fi) {
  */
 
 int bb_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-  int retstat = 0;
-  DIR *dp;
-  struct dirent *de;
-
   log_command("bb_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)",
               path, buf, filler, offset, fi);
-  // once again, no need for fullpath -- but note that I need to cast fi->fh
-  dp = (DIR *) (uintptr_t) fi->fh;
-
-  de = readdir(dp);
-  log_msg("    readdir returned 0x%p\n", de);
-  if (de == 0) {
-    retstat = log_error("bb_readdir readdir");
-    return retstat;
-  }
-
-  do {
-    if (filler(buf, de->d_name, NULL, 0) != 0) {
-      log_msg("    ERROR bb_readdir filler:  buffer full");
+  // the listing was read by bb_opendir
+  struct bb_dir *dir = (struct bb_dir *) (uintptr_t) fi->fh;
+
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  for (int i = 0; i < dir->count; i++) {
+    st.st_mode = dir->entries[i].mode;
+    if (filler(buf, dir->entries[i].name, &st, 0) != 0) {
+      log_failure("    ERROR bb_readdir filler:  buffer full");
       return -ENOMEM;
     }
-  } while ((de = readdir(dp)) != NULL);
+  }
 
   log_fi(fi);
 
-  return retstat;
+  return 0;
 }
 
 /**
  * Release directory
  */
 int bb_releasedir(const char *path, struct fuse_file_info *fi) {
-  int retstat = 0;
-
   log_command("bb_releasedir(path=\"%s\", fi=0x%08x)", path, fi);
   log_fi(fi);
 
-  closedir((DIR *) (uintptr_t) fi->fh);
+  bb_dir_free((struct bb_dir *) (uintptr_t) fi->fh);
 
-  return retstat;
+  return 0;
 }
 
 /**
@@ -755,21 +3403,103 @@ int bb_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
  * destroy() method.
  */
 void *bb_init(struct fuse_conn_info *conn) {
+  // fuse has daemonized by now, so the log writer thread survives
+  log_start();
   log_command("bb_init()");
 
   log_conn(conn);
   log_fuse_context(fuse_get_context());
 
+  if (!BB_DATA->cache_tmp) {
+    cache_scan();
+  }
+  if (BB_DATA->snapshot && BB_DATA->snap.ttl > 0
+      && pthread_create(&BB_DATA->snap_thread, NULL, snap_worker, NULL) != 0) {
+    log_failure("cannot start the snapshot refresh, it stays as scanned at mount\n");
+    BB_DATA->snap.ttl = 0;
+  }
+  if (BB_DATA->flush_queue > 0 && pthread_create(&BB_DATA->flush_thread, NULL, cache_flush_worker, NULL) != 0) {
+    log_failure("cannot start the write-back worker, uploading on release\n");
+    BB_DATA->flush_queue = 0;
+  }
+
   return BB_DATA;
 }
 
+/**
+ * Delete a cache directory made for this mount and everything in it
+ */
+void cache_remove_dir(const char *dir) {
+  DIR *dp = opendir(dir);
+  if (dp == NULL) {
+    return;
+  }
+  struct dirent *de;
+  char path[PATH_MAX];
+  while ((de = readdir(dp)) != NULL) {
+    if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+      snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dp);
+  rmdir(dir);
+}
+
 /**
  * Clean up filesystem
  *
  * Called on filesystem exit.
  */
 void bb_destroy(void *userdata) {
+  struct bb_state *bb_data = userdata;
+
   log_command("bb_destroy(userdata=0x%08x)\n", userdata);
+  if (bb_data->snapshot && bb_data->snap.ttl > 0) {
+    pthread_mutex_lock(&bb_data->lock);
+    bb_data->snap_stop = 1;
+    pthread_cond_signal(&bb_data->snap_wake);
+    pthread_mutex_unlock(&bb_data->lock);
+    pthread_join(bb_data->snap_thread, NULL);
+  }
+  // everything queued for write-back is uploaded before unmount completes
+  if (bb_data->flush_queue > 0) {
+    pthread_mutex_lock(&bb_data->lock);
+    bb_data->flush_stop = 1;
+    pthread_cond_signal(&bb_data->flush_work);
+    pthread_mutex_unlock(&bb_data->lock);
+    pthread_join(bb_data->flush_thread, NULL);
+  }
+  // changes that could not be uploaded on release get a last try
+  int unsaved = 0;
+  bb_conn_get(NULL);
+  for (struct file_cache_local *entry = bb_data->cache.lru_head; entry != NULL; entry = entry->lru_next) {
+    if (cache_writeback(entry) != EXIT_SUCCESS) {
+      log_failure("    changes to %s are not uploaded, kept in %s\n", entry->remotepath, entry->localpath);
+      unsaved++;
+    }
+  }
+  bb_conn_put();
+  size_t len;
+  char *report = bb_stats_report(&len);
+  for (char *line = report, *next; line != NULL && *line != '\0'; line = next) {
+    next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+    log_msg("    %s\n", line);
+  }
+  free(report);
+  snapshot_destroy(&bb_data->snap);
+  attr_cache_destroy(&bb_data->attrs);
+  // the local copies are the only ones of changes that failed to upload
+  if (bb_data->cache_tmp && unsaved == 0) {
+    cache_remove_dir(bb_data->cache_dir);
+  } else if (bb_data->cache_tmp) {
+    log_failure("    keeping %s, %d file(s) in it were not uploaded\n", bb_data->cache_dir, unsaved);
+  }
+  trace_close(&bb_data->trace);
+  log_flush();
 }
 
 /** Check file access permissions */
@@ -778,15 +3508,17 @@ int bb_access(const char *path, int mask) {
   char fpath[PATH_MAX];
 
   log_command("bb_access(path=\"%s\", mask=0%o)", path, mask);
+  if (bb_stats_path(path)) {
+    return (mask & W_OK) ? -EACCES : 0;
+  }
   bb_fullpath(fpath, path);
 
-  retstat = access(fpath, mask);
-
-  if (retstat < 0) {
-    retstat = log_error("bb_access access");
+  struct stat st;
+  if (BB_DATA->snapshot && (retstat = snapshot_getattr(&BB_DATA->snap, path, &st)) <= 0) {
+    return retstat < 0 ? retstat : bb_mode_access(&st, mask);
   }
 
-  return retstat;
+  return bb_remote_result("access", bb_remote(access, fpath, mask));
 }
 
 /**
@@ -803,10 +3535,20 @@ int bb_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
   log_command("bb_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)", path, offset, fi);
   log_fi(fi);
 
-  retstat = ftruncate(fi->fh, offset);
-  if (retstat < 0) {
-    retstat = log_error("bb_ftruncate ftruncate");
+  struct bb_file *file = BB_FILE(fi);
+  cache_enter(file->entry, 0);
+  retstat = cache_fetch_for_truncate(file->entry, offset);
+  if (retstat == 0) {
+    retstat = ftruncate(file->fd, offset);
+    if (retstat < 0) {
+      retstat = log_error("bb_ftruncate ftruncate");
+    }
   }
+  if (retstat == 0) {
+    cache_mark_truncated(file->entry, offset);
+  }
+  cache_leave(file->entry);
+  attr_cache_invalidate(&BB_DATA->attrs, file->entry->remotepath);
 
   return retstat;
 }
@@ -822,8 +3564,13 @@ int bb_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *f
   if (!strcmp(path, "/")) {
     return bb_getattr(path, statbuf);
   }
+  if (BB_FILE(fi)->text != NULL) {
+    bb_stats_stat(2, statbuf);
+    statbuf->st_size = BB_FILE(fi)->text_len;
+    return 0;
+  }
 
-  retstat = fstat(fi->fh, statbuf);
+  retstat = fstat(BB_FILE(fi)->fd, statbuf);
   if (retstat < 0) {
     retstat = log_error("bb_fgetattr fstat");
   }
@@ -833,52 +3580,316 @@ int bb_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *f
   return retstat;
 }
 
+/**
+ * Number of the open file behind fi in traces, 0 if there is none yet
+ */
+uint64_t bb_trace_handle(struct fuse_file_info *fi) {
+  return fi != NULL && fi->fh != 0 ? BB_FILE(fi)->handle : 0;
+}
+
+/**
+ * Write one operation to the trace. fi is NULL for operations without an
+ * open file (directory handles are not bb_files); the handle of an open
+ * is only known once it returns.
+ */
+void bb_trace(enum stats_op op, uint64_t start, uint64_t latency, int retstat, uint64_t handle,
+              const char *path, const char *path2, int64_t offset, uint64_t size,
+              struct fuse_file_info *fi, int arg) {
+  struct trace_event ev = {
+    .start_ns = start, .latency_ns = latency, .op = op, .result = retstat,
+    .handle = handle != 0 || retstat < 0 ? handle : bb_trace_handle(fi),
+    .offset = offset, .size = size, .arg = arg, .path = path, .path2 = path2,
+  };
+  trace_record(&BB_DATA->trace, &ev);
+}
+
+#define BB_TRACE_ARGS(path, path2, offset, size, fi, arg) path, path2, offset, size, fi, arg
+#define BB_TRACE_FI(path, path2, offset, size, fi, arg) fi
+
+// Every operation goes through a wrapper that times it into BB_DATA->stats
+// and, with -o trace, writes it to the trace with what the last argument
+// names: (path, second path, offset, size, fi, flags or mode)
+#define BB_TIMED(name, op, params, args, traced) \
+  int bb_timed_##name params { \
+    uint64_t start = stats_now(); \
+    uint64_t handle = BB_DATA->trace.file != NULL ? bb_trace_handle(BB_TRACE_FI traced) : 0; \
+    int retstat = bb_##name args; \
+    uint64_t latency = stats_record(&BB_DATA->stats, op, start, retstat); \
+    if (BB_DATA->trace.file != NULL) { \
+      bb_trace(op, start, latency, retstat, handle, BB_TRACE_ARGS traced); \
+    } \
+    return retstat; \
+  }
+
+BB_TIMED(getattr, STATS_GETATTR, (const char *path, struct stat *statbuf), (path, statbuf),
+         (path, NULL, 0, 0, NULL, 0))
+BB_TIMED(readlink, STATS_READLINK, (const char *path, char *link, size_t size), (path, link, size),
+         (path, NULL, 0, size, NULL, 0))
+BB_TIMED(mknod, STATS_MKNOD, (const char *path, mode_t mode, dev_t dev), (path, mode, dev),
+         (path, NULL, 0, 0, NULL, mode))
+BB_TIMED(mkdir, STATS_MKDIR, (const char *path, mode_t mode), (path, mode),
+         (path, NULL, 0, 0, NULL, mode))
+BB_TIMED(unlink, STATS_UNLINK, (const char *path), (path),
+         (path, NULL, 0, 0, NULL, 0))
+BB_TIMED(rmdir, STATS_RMDIR, (const char *path), (path),
+         (path, NULL, 0, 0, NULL, 0))
+BB_TIMED(symlink, STATS_SYMLINK, (const char *path, const char *link), (path, link),
+         (path, link, 0, 0, NULL, 0))
+BB_TIMED(rename, STATS_RENAME, (const char *path, const char *newpath), (path, newpath),
+         (path, newpath, 0, 0, NULL, 0))
+BB_TIMED(link, STATS_LINK, (const char *path, const char *newpath), (path, newpath),
+         (path, newpath, 0, 0, NULL, 0))
+BB_TIMED(chmod, STATS_CHMOD, (const char *path, mode_t mode), (path, mode),
+         (path, NULL, 0, 0, NULL, mode))
+BB_TIMED(chown, STATS_CHOWN, (const char *path, uid_t uid, gid_t gid), (path, uid, gid),
+         (path, NULL, 0, 0, NULL, 0))
+BB_TIMED(truncate, STATS_TRUNCATE, (const char *path, off_t newsize), (path, newsize),
+         (path, NULL, newsize, 0, NULL, 0))
+BB_TIMED(utime, STATS_UTIME, (const char *path, struct utimbuf *ubuf), (path, ubuf),
+         (path, NULL, 0, 0, NULL, 0))
+BB_TIMED(open, STATS_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi),
+         (path, NULL, 0, 0, fi, fi->flags))
+BB_TIMED(read, STATS_READ, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi),
+         (path, NULL, offset, size, fi, 0))
+BB_TIMED(write, STATS_WRITE, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi),
+         (path, NULL, offset, size, fi, 0))
+BB_TIMED(statfs, STATS_STATFS, (const char *path, struct statvfs *statv), (path, statv),
+         (path, NULL, 0, 0, NULL, 0))
+BB_TIMED(flush, STATS_FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi),
+         (path, NULL, 0, 0, fi, 0))
+BB_TIMED(release, STATS_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi),
+         (path, NULL, 0, 0, fi, 0))
+BB_TIMED(fsync, STATS_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi),
+         (path, NULL, 0, 0, fi, datasync))
+#ifdef HAVE_SYS_XATTR_H
+BB_TIMED(setxattr, STATS_SETXATTR, (const char *path, const char *name, const char *value, size_t size, int flags), (path, name, value, size, flags),
+         (path, name, 0, size, NULL, flags))
+BB_TIMED(getxattr, STATS_GETXATTR, (const char *path, const char *name, char *value, size_t size), (path, name, value, size),
+         (path, name, 0, size, NULL, 0))
+BB_TIMED(listxattr, STATS_LISTXATTR, (const char *path, char *list, size_t size), (path, list, size),
+         (path, NULL, 0, size, NULL, 0))
+BB_TIMED(removexattr, STATS_REMOVEXATTR, (const char *path, const char *name), (path, name),
+         (path, name, 0, 0, NULL, 0))
+#endif
+BB_TIMED(opendir, STATS_OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi),
+         (path, NULL, 0, 0, NULL, 0))
+BB_TIMED(readdir, STATS_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi),
+         (path, NULL, offset, 0, NULL, 0))
+BB_TIMED(releasedir, STATS_RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi),
+         (path, NULL, 0, 0, NULL, 0))
+BB_TIMED(fsyncdir, STATS_FSYNCDIR, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi),
+         (path, NULL, 0, 0, NULL, datasync))
+BB_TIMED(access, STATS_ACCESS, (const char *path, int mask), (path, mask),
+         (path, NULL, 0, 0, NULL, mask))
+BB_TIMED(ftruncate, STATS_FTRUNCATE, (const char *path, off_t offset, struct fuse_file_info *fi), (path, offset, fi),
+         (path, NULL, offset, 0, fi, 0))
+BB_TIMED(fgetattr, STATS_FGETATTR, (const char *path, struct stat *statbuf, struct fuse_file_info *fi), (path, statbuf, fi),
+         (path, NULL, 0, 0, fi, 0))
+
 struct fuse_operations bb_oper = {
-    .getattr = bb_getattr,
-    .readlink = bb_readlink,
+    .getattr = bb_timed_getattr,
+    .readlink = bb_timed_readlink,
     .getdir = NULL,
-    .mknod = bb_mknod,
-    .mkdir = bb_mkdir,
-    .unlink = bb_unlink,
-    .rmdir = bb_rmdir,
-    .symlink = bb_symlink,
-    .rename = bb_rename,
-    .link = bb_link,
-    .chmod = bb_chmod,
-    .chown = bb_chown,
-    .truncate = bb_truncate,
-    .utime = bb_utime,
-    .open = bb_open,
-    .read = bb_read,
-    .write = bb_write,
-    .statfs = bb_statfs,
-    .flush = bb_flush,
-    .release = bb_release,
-    .fsync = bb_fsync,
+    .mknod = bb_timed_mknod,
+    .mkdir = bb_timed_mkdir,
+    .unlink = bb_timed_unlink,
+    .rmdir = bb_timed_rmdir,
+    .symlink = bb_timed_symlink,
+    .rename = bb_timed_rename,
+    .link = bb_timed_link,
+    .chmod = bb_timed_chmod,
+    .chown = bb_timed_chown,
+    .truncate = bb_timed_truncate,
+    .utime = bb_timed_utime,
+    .open = bb_timed_open,
+    .read = bb_timed_read,
+    .write = bb_timed_write,
+    .statfs = bb_timed_statfs,
+    .flush = bb_timed_flush,
+    .release = bb_timed_release,
+    .fsync = bb_timed_fsync,
 
 #ifdef HAVE_SYS_XATTR_H
-    .setxattr = bb_setxattr,
-    .getxattr = bb_getxattr,
-    .listxattr = bb_listxattr,
-    .removexattr = bb_removexattr,
+    .setxattr = bb_timed_setxattr,
+    .getxattr = bb_timed_getxattr,
+    .listxattr = bb_timed_listxattr,
+    .removexattr = bb_timed_removexattr,
 #endif
 
-    .opendir = bb_opendir,
-    .readdir = bb_readdir,
-    .releasedir = bb_releasedir,
-    .fsyncdir = bb_fsyncdir,
+    .opendir = bb_timed_opendir,
+    .readdir = bb_timed_readdir,
+    .releasedir = bb_timed_releasedir,
+    .fsyncdir = bb_timed_fsyncdir,
     .init = bb_init,
     .destroy = bb_destroy,
-    .access = bb_access,
-    .ftruncate = bb_ftruncate,
-    .fgetattr = bb_fgetattr
+    .access = bb_timed_access,
+    .ftruncate = bb_timed_ftruncate,
+    .fgetattr = bb_timed_fgetattr
+};
+
+#define BB_OPT(t, p) { t, offsetof(struct bb_state, p), 0 }
+
+static struct fuse_opt bb_opts[] = {
+  { "log_text", offsetof(struct bb_state, log_text), 1 },
+  BB_OPT("log_level=%d", log_level),
+  BB_OPT("trace=%s", trace_file),
+  BB_OPT("attr_ttl=%lf", attrs.ttl),
+  BB_OPT("neg_ttl=%lf", attrs.neg_ttl),
+  BB_OPT("xfer_chunk=%u", xfer_chunk),
+  BB_OPT("block_size=%u", block_size),
+  { "lazy", offsetof(struct bb_state, lazy), 1 },
+  BB_OPT("readahead=%u", readahead),
+  BB_OPT("cache_dir=%s", cache_dir),
+  BB_OPT("cache_entries=%d", cache.max_cache),
+  BB_OPT("cache_bytes=%llu", cache.max_bytes),
+  BB_OPT("flush_queue=%u", flush_queue),
+  BB_OPT("latency=%lf", latency),
+  BB_OPT("bandwidth=%lf", bandwidth),
+  BB_OPT("port=%u", port),
+  BB_OPT("identity=%s", identity),
+  BB_OPT("connections=%d", pool.size),
+  BB_OPT("pipeline=%d", pipeline),
+  BB_OPT("helper=%s", helper_cmd),
+  BB_OPT("streams=%d", streams),
+  BB_OPT("parallel_min=%lld", parallel_min),
+  { "snapshot", offsetof(struct bb_state, snapshot), 1 },
+  BB_OPT("snapshot_ttl=%lf", snap.ttl),
+  FUSE_OPT_END
 };
 
 void bb_usage() {
   fprintf(stderr, "usage:  bbfs [FUSE and mount options] remoteAddress mountPoint logFile\n");
+  fprintf(stderr, "remoteAddress is user@host:/path, or /path for a local directory\n");
+  fprintf(stderr, "bbfs options:\n");
+  fprintf(stderr, "    -o log_text            write the log as text right away instead of buffered\n");
+  fprintf(stderr, "                           binary records (read those with bbfs-logdump)\n");
+  fprintf(stderr, "    -o log_level=N         0 off, 1 errors, 2 operations (default), 3 also reads,\n");
+  fprintf(stderr, "                           writes and details (above %d is compiled out)\n", BB_LOG_MAX);
+  fprintf(stderr, "    -o trace=FILE          write every operation with its arguments and latency\n");
+  fprintf(stderr, "                           to FILE, for bbfs-replay\n");
+  fprintf(stderr, "    -o attr_ttl=SECS       attribute cache timeout (default %.1f, 0 disables)\n", ATTR_CACHE_TTL);
+  fprintf(stderr, "    -o neg_ttl=SECS        nonexistent path cache timeout (default %.1f, 0 disables)\n", NEG_CACHE_TTL);
+  fprintf(stderr, "    -o xfer_chunk=BYTES    transfer buffer size (default %d)\n", XFER_CHUNK);
+  fprintf(stderr, "    -o block_size=BYTES    dirty tracking and lazy fetch granularity (default %d)\n", BLOCK_SIZE);
+  fprintf(stderr, "    -o lazy                fetch file blocks on first read instead of at open\n");
+  fprintf(stderr, "    -o readahead=BLOCKS    largest lazy readahead window (default %d, 0 disables)\n", READAHEAD_MAX);
+  fprintf(stderr, "    -o cache_dir=DIR       keep local copies in DIR across opens and mounts\n");
+  fprintf(stderr, "                           (default: a temporary directory removed at unmount)\n");
+  fprintf(stderr, "    -o cache_entries=N     files cached before released ones are evicted (default %d)\n", CACHE_SIZE);
+  fprintf(stderr, "    -o cache_bytes=BYTES   disk space for released cached files (default %llu)\n", CACHE_BYTES);
+  fprintf(stderr, "    -o flush_queue=N       files waiting for background upload before release blocks\n");
+  fprintf(stderr, "                           (default %d, 0 uploads during release)\n", FLUSH_QUEUE_MAX);
+  fprintf(stderr, "    -o latency=MS          local directory: round-trip time added to each call\n");
+  fprintf(stderr, "    -o bandwidth=MBIT      local directory: rate data moves at (default unlimited)\n");
+  fprintf(stderr, "    -o port=N              ssh port of the remote (default from the ssh config, or 22)\n");
+  fprintf(stderr, "    -o identity=FILE       private key to try besides the agent and the default keys\n");
+  fprintf(stderr, "    -o connections=N       ssh connections shared by filesystem operations (default %d)\n", CONN_POOL_SIZE);
+  fprintf(stderr, "    -o pipeline=0|1        metadata requests share one pipelined channel (default 1)\n");
+  fprintf(stderr, "    -o helper=COMMAND      run bbfs-helper on the remote for stat, listings, reads,\n");
+  fprintf(stderr, "                           writes and block hashes (default: sftp only)\n");
+  fprintf(stderr, "    -o streams=N           connections a large transfer is split over at most\n");
+  fprintf(stderr, "                           (default %d, 0 uses one scp stream)\n", XFER_STREAMS);
+  fprintf(stderr, "    -o parallel_min=BYTES  smallest file that is split (default %d)\n", XFER_PARALLEL_MIN);
+  fprintf(stderr, "    -o snapshot            list the remote tree at mount and serve metadata from memory\n");
+  fprintf(stderr, "    -o snapshot_ttl=SECS   seconds between snapshot refreshes (default %.1f, 0 never)\n", SNAPSHOT_TTL);
   abort();
 }
 
+/**
+ * Connect and authenticate to user@host and open an sftp channel, exiting
+ * on failure
+ */
+void bb_conn_open(struct bb_conn *conn, const char *user, const char *host) {
+  conn->session = ssh_new();
+  if (conn->session == NULL) {
+    fprintf(stderr, "cannot initialize ssh session");
+    exit(SSH_ERROR);
+  }
+
+  ssh_options_set(conn->session, SSH_OPTIONS_HOST, host);
+  ssh_options_set(conn->session, SSH_OPTIONS_USER, user);
+  if (BB_DATA->port != 0) {
+    ssh_options_set(conn->session, SSH_OPTIONS_PORT, &BB_DATA->port);
+  }
+  if (BB_DATA->identity != NULL) {
+    ssh_options_set(conn->session, SSH_OPTIONS_ADD_IDENTITY, BB_DATA->identity);
+  }
+
+  fprintf(stderr, "connecting ...\n");
+  int rc = ssh_connect(conn->session);
+  if (rc != SSH_OK) ssh_error(conn->session);
+  fprintf(stderr, "connected ...\n");
+
+  fprintf(stderr, "authenticating ...\n");
+  rc = ssh_userauth_publickey_auto(conn->session, NULL, NULL);
+  if (rc != SSH_AUTH_SUCCESS) ssh_error(conn->session);
+  fprintf(stderr, "authenticated to %s@%s\n", user, host);
+
+  // metadata goes over a single sftp channel kept open for the whole mount
+  conn->sftp = sftp_new(conn->session);
+  if (conn->sftp == NULL) ssh_error(conn->session);
+  rc = sftp_init(conn->sftp);
+  if (rc != SSH_OK) {
+    fprintf(stderr, "cannot initialize sftp session: %d\n", sftp_get_error(conn->sftp));
+    sftp_free(conn->sftp);
+    ssh_error(conn->session);
+  }
+}
+
+void bb_conn_close(struct bb_conn *conn) {
+  sftp_free(conn->sftp);
+  ssh_free_session(conn->session);
+}
+
+/**
+ * Open the connections of the ssh transport: the pool, and those of the
+ * write-back worker, the metadata pipeline and the helper when enabled
+ */
+void ssh_transport_open(struct bb_state *bb_data, const char *user, const char *host) {
+  for (int i = 0; i < bb_data->pool.size; i++) {
+    bb_conn_open(&bb_data->pool.conns[i], user, host);
+  }
+  // uploads after release go over a second connection, so they do not
+  // hold up the filesystem operations
+  if (bb_data->flush_queue > 0) {
+    bb_conn_open(&bb_data->flush_conn, user, host);
+  }
+  if (bb_data->pipeline) {
+    bb_conn_open(&bb_data->pipe_conn, user, host);
+    if (mdpipe_open(&bb_data->pipe, bb_data->pipe_conn.session) < 0) {
+      fprintf(stderr, "cannot open the metadata pipeline, using the pool\n");
+      bb_conn_close(&bb_data->pipe_conn);
+      bb_data->pipeline = 0;
+    }
+  }
+  if (bb_data->helper_cmd != NULL) {
+    bb_conn_open(&bb_data->helper_conn, user, host);
+    if (bb_helper_start(&bb_data->helper_conn, bb_data->helper_cmd) < 0) {
+      fprintf(stderr, "cannot start %s on the remote, using sftp\n", bb_data->helper_cmd);
+      bb_conn_close(&bb_data->helper_conn);
+    }
+  }
+}
+
+void ssh_transport_close(struct bb_state *bb_data) {
+  if (bb_data->helper_channel != NULL) {
+    ssh_channel_send_eof(bb_data->helper_channel);
+    ssh_channel_close(bb_data->helper_channel);
+    ssh_channel_free(bb_data->helper_channel);
+    bb_conn_close(&bb_data->helper_conn);
+  }
+  if (bb_data->pipeline) {
+    mdpipe_close(&bb_data->pipe);
+    bb_conn_close(&bb_data->pipe_conn);
+  }
+  if (bb_data->flush_queue > 0) {
+    bb_conn_close(&bb_data->flush_conn);
+  }
+  for (int i = 0; i < bb_data->pool.size; i++) {
+    bb_conn_close(&bb_data->pool.conns[i]);
+  }
+}
+
 int main(int argc, char *argv[]) {
   if ((getuid() == 0) || (geteuid() == 0)) {
     fprintf(stderr, "Please do not run bb as root\n");
@@ -902,42 +3913,154 @@ int main(int argc, char *argv[]) {
   argc -= 2;
 
   bb_data->logfile = log_open(logFile);
+  bb_data->log_text = 0;
+  bb_data->log_level = BB_LOG_INFO;
   char user[BUF_SIZE], host[BUF_SIZE], remotepath[BUF_SIZE];
-  if (sscanf(remoteAddress, "%[^@]@%[^:]:%s", user, host, remotepath) < 3) {
+  // a local directory stands in for the remote, see transport_local.c
+  int local = remoteAddress[0] == '/';
+  if (local) {
+    snprintf(remotepath, sizeof(remotepath), "%s", remoteAddress);
+    fprintf(stderr, "local %s\n", remotepath);
+  } else if (sscanf(remoteAddress, "%[^@]@%[^:]:%s", user, host, remotepath) < 3) {
     fprintf(stderr, "cannot parse address");
     exit(EXIT_FAILURE);
+  } else {
+    fprintf(stderr, "%s %s %s\n", user, host, remotepath);
   }
-  fprintf(stderr, "%s %s %s\n", user, host, remotepath);
   bb_data->rootdir = remotepath;
-
-  bb_data->num_cache = 0;
-
-  // intializing SSH session
-  bb_data->session = ssh_new();
-  if (bb_data->session == NULL) {
-    fprintf(stderr, "cannot initialize ssh session");
-    exit(SSH_ERROR);
+  bb_data->transport = ssh_transport;
+  bb_data->latency = 0;
+  bb_data->bandwidth = 0;
+
+  file_cache_init(&bb_data->cache, CACHE_SIZE);
+  bb_data->cache.max_bytes = CACHE_BYTES;
+  attr_cache_init(&bb_data->attrs);
+  bb_data->xfer_chunk = XFER_CHUNK;
+  bb_data->block_size = BLOCK_SIZE;
+  bb_data->lazy = 0;
+  bb_data->readahead = READAHEAD_MAX;
+  bb_data->cache_dir = NULL;
+  bb_data->cache_tmp = 0;
+  pthread_mutex_init(&bb_data->lock, NULL);
+  bb_data->flush_head = bb_data->flush_tail = NULL;
+  bb_data->flush_len = 0;
+  bb_data->flush_queue = FLUSH_QUEUE_MAX;
+  bb_data->flush_stop = 0;
+  pthread_cond_init(&bb_data->flush_work, NULL);
+  pthread_cond_init(&bb_data->flush_space, NULL);
+  pthread_cond_init(&bb_data->idle, NULL);
+  bb_data->port = 0;
+  bb_data->identity = NULL;
+  bb_data->pool.size = CONN_POOL_SIZE;
+  bb_data->pipeline = 1;
+  bb_data->helper_cmd = NULL;
+  bb_data->helper_channel = NULL;
+  bb_data->streams = XFER_STREAMS;
+  bb_data->parallel_min = XFER_PARALLEL_MIN;
+  bb_data->snapshot = 0;
+  snapshot_init(&bb_data->snap);
+  bb_data->snap_stop = 0;
+  pthread_cond_init(&bb_data->snap_wake, NULL);
+  memset(&bb_data->stats, 0, sizeof(bb_data->stats));
+  bb_data->remote_calls = 0;
+  bb_data->sftp_requests = 0;
+  bb_data->trace_file = NULL;
+  bb_data->trace.file = NULL;
+  bb_data->trace.handles = 0;
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, bb_data, bb_opts, NULL) == -1 || bb_data->xfer_chunk == 0 || bb_data->block_size == 0) {
+    bb_usage();
   }
+  if (bb_data->readahead > PREFETCH_MAX) {
+    bb_data->readahead = PREFETCH_MAX;
+  }
+  if (bb_data->pool.size < 1 || conn_pool_init(&bb_data->pool, bb_data->pool.size) < 0) {
+    bb_usage();
+  }
+  xfer_tuner_init(&bb_data->xfer_down, bb_data->streams);
+  xfer_tuner_init(&bb_data->xfer_up, bb_data->streams);
+  if (local) {
+    if (transport_local_init(&bb_data->transport, bb_data->latency, bb_data->bandwidth) < 0) {
+      sys_error("transport");
+    }
+    // these need a shell on the remote
+    if (bb_data->helper_cmd != NULL || bb_data->snapshot) {
+      fprintf(stderr, "-o helper and -o snapshot need an ssh remote, ignored\n");
+    }
+    bb_data->helper_cmd = NULL;
+    bb_data->snapshot = 0;
+    bb_data->pipeline = 0;
+  }
+  if (bb_data->trace_file != NULL && trace_open(&bb_data->trace, bb_data->trace_file) < 0) {
+    sys_error("trace");
+  }
+  bb_global = bb_data;
+
+  // fuse changes to / when it daemonizes, so the cache directory must be
+  // an absolute path
+  char *cache_dir = bb_data->cache_dir;
+  if (cache_dir == NULL) {
+    char tmpl[] = "/tmp/bbfs-XXXXXX";
+    if (mkdtemp(tmpl) == NULL) {
+      sys_error("mkdtemp");
+    }
+    bb_data->cache_dir = strdup(tmpl);
+    bb_data->cache_tmp = 1;
+  } else {
+    if (mkdir(cache_dir, S_IRWXU) < 0 && errno != EEXIST) {
+      sys_error("mkdir");
+    }
+    bb_data->cache_dir = realpath(cache_dir, NULL);
+    if (bb_data->cache_dir == NULL) {
+      sys_error("realpath");
+    }
+    free(cache_dir);
+  }
+  char cache_key[BUF_SIZE];
+  if (local) {
+    snprintf(cache_key, sizeof(cache_key), "local");
+  } else {
+    snprintf(cache_key, sizeof(cache_key), "%s@%s", user, host);
+  }
+  bb_data->cache_key = cache_key;
 
-  ssh_options_set(bb_data->session, SSH_OPTIONS_HOST, host);
-  ssh_options_set(bb_data->session, SSH_OPTIONS_USER, user);
-
-  fprintf(stderr, "connecting ...\n");
-  int rc = ssh_connect(bb_data->session);
-  if (rc != SSH_OK) ssh_error(bb_data->session);
-  fprintf(stderr, "connected ...\n");
-
-  fprintf(stderr, "authenticating ...\n");
-  rc = ssh_userauth_publickey_auto(bb_data->session, NULL, NULL);
-  if (rc != SSH_AUTH_SUCCESS) ssh_error(bb_data->session);
-  fprintf(stderr, "authenticated to %s@%s\n", user, host);
+  if (!local) {
+    ssh_transport_open(bb_data, user, host);
+  }
+  bb_data->blksize = BUF_SIZE;
+  bb_data->remote_ngroups = -1;
+  struct statvfs vfs;
+  bb_conn_get(NULL);
+  if (bb_remote(statvfs, remotepath, &vfs) == 0) {
+    bb_data->blksize = vfs.f_bsize;
+  }
+  if (!local) {
+    ssh_remote_ids();
+  }
+  bb_conn_put();
+
+  if (bb_data->snapshot) {
+    fprintf(stderr, "listing the remote tree ...\n");
+    bb_conn_get(NULL);
+    snap_scan();
+    bb_conn_put();
+    fprintf(stderr, "%u entries\n", bb_data->snap.count);
+  }
 
   // starting fuse
   fprintf(stderr, "about to call fuse_main\n");
-  int fuse_stat = fuse_main(argc, argv, &bb_oper, bb_data);
+  int fuse_stat = fuse_main(args.argc, args.argv, &bb_oper, bb_data);
   fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+  log_flush();
 
-  ssh_free_session(bb_data->session);
+  fuse_opt_free_args(&args);
+  if (local) {
+    transport_local_destroy(&bb_data->transport);
+  } else {
+    ssh_transport_close(bb_data);
+  }
+  conn_pool_destroy(&bb_data->pool);
   free(bb_data);
   return fuse_stat;
 }
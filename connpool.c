@@ -0,0 +1,96 @@
+/*
+  Connection pool
+
+  libssh sessions are not safe to use from two threads at once, so the
+  filesystem threads share a small set of them. A thread takes any free
+  connection, or a specific one when it needs a handle opened on it, and
+  waits if none is free.
+*/
+
+#include "connpool.h"
+
+#include <stdlib.h>
+
+int conn_pool_init(struct conn_pool *pool, int size) {
+  pool->conns = calloc(size, sizeof(struct bb_conn));
+  if (pool->conns == NULL) {
+    return -1;
+  }
+  pool->size = size;
+  pool->next = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->freed, NULL);
+  pool->acquires = 0;
+  pool->waits = 0;
+  return 0;
+}
+
+void conn_pool_destroy(struct conn_pool *pool) {
+  free(pool->conns);
+  pool->conns = NULL;
+  pool->size = 0;
+}
+
+/**
+ * A free connection, taken round robin so the sessions share the load,
+ * or NULL. Called with the pool lock held.
+ */
+static struct bb_conn *conn_pool_find_free(struct conn_pool *pool) {
+  for (int i = 0; i < pool->size; i++) {
+    struct bb_conn *c = &pool->conns[(pool->next + i) % pool->size];
+    if (!c->busy) {
+      pool->next = (pool->next + i + 1) % pool->size;
+      return c;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Take want, or any free connection if want is NULL, waiting until it is
+ * free
+ */
+struct bb_conn *conn_pool_acquire(struct conn_pool *pool, struct bb_conn *want) {
+  pthread_mutex_lock(&pool->lock);
+  pool->acquires++;
+  struct bb_conn *conn = NULL;
+  int waited = 0;
+  for (;;) {
+    if (want != NULL) {
+      conn = want->busy ? NULL : want;
+    } else {
+      conn = conn_pool_find_free(pool);
+    }
+    if (conn != NULL) {
+      break;
+    }
+    waited = 1;
+    pthread_cond_wait(&pool->freed, &pool->lock);
+  }
+  conn->busy = 1;
+  pool->waits += waited;
+  pthread_mutex_unlock(&pool->lock);
+  return conn;
+}
+
+/**
+ * Take any free connection without waiting, NULL if all are busy. For
+ * extra connections taken while already holding one.
+ */
+struct bb_conn *conn_pool_try_acquire(struct conn_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  struct bb_conn *conn = conn_pool_find_free(pool);
+  if (conn != NULL) {
+    conn->busy = 1;
+    pool->acquires++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return conn;
+}
+
+void conn_pool_release(struct conn_pool *pool, struct bb_conn *conn) {
+  pthread_mutex_lock(&pool->lock);
+  conn->busy = 0;
+  pthread_cond_broadcast(&pool->freed);
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <pthread.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#define CONN_POOL_SIZE 4
+
+// An ssh session with the sftp channel opened on it
+struct bb_conn {
+  ssh_session session;
+  sftp_session sftp;
+  int busy; // held by a thread, changed under the pool lock
+};
+
+// Fixed set of connections shared by the filesystem threads. A thread
+// holds one for the duration of an operation, so each session is only
+// ever used by one thread at a time.
+struct conn_pool {
+  struct bb_conn *conns;
+  int size;
+  int next; // where the search for a free connection starts
+  pthread_mutex_t lock;
+  pthread_cond_t freed;
+  unsigned long acquires;
+  unsigned long waits; // acquires that found no connection free
+};
+
+int conn_pool_init(struct conn_pool *pool, int size);
+void conn_pool_destroy(struct conn_pool *pool);
+struct bb_conn *conn_pool_acquire(struct conn_pool *pool, struct bb_conn *want);
+struct bb_conn *conn_pool_try_acquire(struct conn_pool *pool);
+void conn_pool_release(struct conn_pool *pool, struct bb_conn *conn);
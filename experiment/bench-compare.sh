@@ -0,0 +1,56 @@
+#!/bin/sh
+# Line up two result files of bench-suite.sh, e.g. of two commits.
+#
+# For every workload, link and option set present in both files prints the
+# seconds and p99 latency before and after and the ratio of the times, and
+# flags a run as slower when it took more than the threshold longer
+# (BENCH_THRESHOLD, default 1.10). Runs repeated within a file are averaged.
+# Exits with 1 if any run got slower, so it can gate a change.
+#
+# Run: ./bench-compare.sh <before.jsonl> <after.jsonl>
+
+set -eu
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 <before.jsonl> <after.jsonl>" >&2
+    exit 1
+fi
+
+awk -v threshold="${BENCH_THRESHOLD:-1.10}" '
+function field(name,    m) {
+    if (match($0, "\"" name "\":(\"[^\"]*\"|[-0-9.e]+)")) {
+        m = substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+        gsub(/"/, "", m)
+        return m
+    }
+    return ""
+}
+{
+    key = field("workload") " x" field("scale") " " field("rtt_ms") "ms " field("mbit") "Mbit " field("options")
+    file = FNR == NR ? 0 : 1
+    seconds[file, key] += field("seconds")
+    p99[file, key] += field("p99_us")
+    runs[file, key]++
+    if (file == 0 && !(key in order)) {
+        order[key] = ++keys
+        names[keys] = key
+    }
+}
+END {
+    printf "%-44s %10s %10s %10s %10s %7s\n", "run", "before s", "after s", "before p99", "after p99", "ratio"
+    slower = 0
+    for (i = 1; i <= keys; i++) {
+        key = names[i]
+        if (!((1, key) in runs)) {
+            continue
+        }
+        b = seconds[0, key] / runs[0, key]
+        a = seconds[1, key] / runs[1, key]
+        ratio = b > 0 ? a / b : 1
+        flag = ratio > threshold ? "  slower" : ""
+        slower += flag != ""
+        printf "%-44s %10.3f %10.3f %8.0fus %8.0fus %7.2f%s\n", key, b, a,
+               p99[0, key] / runs[0, key], p99[1, key] / runs[1, key], ratio, flag
+    }
+    exit slower > 0
+}' "$1" "$2"
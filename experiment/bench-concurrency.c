@@ -0,0 +1,114 @@
+// Aggregate read throughput through a bbfs mount as client concurrency grows.
+//
+// Creates FILES files of SIZE bytes under DIR (on the mount) if they are not
+// there yet, then for 1 to 16 threads reads all of them once, each thread
+// taking the next unread file. Mount with
+//   -o cache_entries=0,cache_bytes=0
+// so that every open goes back to the remote instead of a kept local copy,
+// and compare -o connections=1 with the default.
+//
+// Build: gcc -O2 -pthread bench-concurrency.c -o bench-concurrency
+// Run:   ./bench-concurrency <dir> [files] [size]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK 65536
+#define MAX_THREADS 16
+
+static const char *dir;
+static int files;
+static long size;
+static int next_file;
+static long long bytes_read;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void create_files(void) {
+    char path[4096], buf[CHUNK];
+    for (int i = 0; i < CHUNK; i++) {
+        buf[i] = (char) rand();
+    }
+    for (int f = 0; f < files; f++) {
+        snprintf(path, sizeof(path), "%s/bench-%d", dir, f);
+        struct stat sb;
+        if (stat(path, &sb) == 0 && sb.st_size == size) {
+            continue;
+        }
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(path);
+            exit(1);
+        }
+        for (long w = 0; w < size; w += CHUNK) {
+            write(fd, buf, size - w < CHUNK ? size - w : CHUNK);
+        }
+        fsync(fd); // on the remote before the timed rounds start
+        close(fd);
+    }
+}
+
+static void *reader(void *arg) {
+    char path[4096], buf[CHUNK];
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        int f = next_file++;
+        pthread_mutex_unlock(&lock);
+        if (f >= files) {
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "%s/bench-%d", dir, f);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            perror(path);
+            continue;
+        }
+        long long n = 0;
+        ssize_t r;
+        while ((r = read(fd, buf, CHUNK)) > 0) {
+            n += r;
+        }
+        close(fd);
+        pthread_mutex_lock(&lock);
+        bytes_read += n;
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <dir> [files] [size]\n", argv[0]);
+        return -1;
+    }
+    dir = argv[1];
+    files = argc > 2 ? atoi(argv[2]) : 64;
+    size = argc > 3 ? atol(argv[3]) : 1048576;
+    create_files();
+
+    printf("%8s %12s %12s\n", "threads", "MB/s", "files/s");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        pthread_t tid[MAX_THREADS];
+        next_file = 0;
+        bytes_read = 0;
+        double t0 = now();
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&tid[t], NULL, reader, NULL);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tid[t], NULL);
+        }
+        double elapsed = now() - t0;
+        printf("%8d %12.1f %12.1f\n", threads, bytes_read / elapsed / 1e6, files / elapsed);
+    }
+    return 0;
+}
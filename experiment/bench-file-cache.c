@@ -0,0 +1,137 @@
+// Micro-benchmark for the open-file cache behind cache_open/cache_close.
+//
+// For a growing number of simultaneously open files it times
+//   - reopen:  open + release of a file that is already open (find, access++/--)
+//   - churn:   open + release of a file that is not open yet (insert, remove)
+// for the hash table in filecache.c and for the old linear array scan.
+//
+// Build: gcc -O2 -I.. bench-file-cache.c ../filecache.c -o bench-file-cache
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filecache.h"
+
+#define OPS 200000
+#define MAX_OPEN 8192
+
+static char paths[MAX_OPEN + 1][64];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The previous implementation: array scan with strcmp, shift on removal.
+struct linear_cache {
+    char *remotepath[MAX_OPEN + 1];
+    int access[MAX_OPEN + 1];
+    int num;
+};
+
+static int linear_open(struct linear_cache *lc, const char *path) {
+    for (int i = 0; i < lc->num; i++) {
+        if (strcmp(lc->remotepath[i], path) == 0) {
+            lc->access[i]++;
+            return i;
+        }
+    }
+    lc->remotepath[lc->num] = strdup(path);
+    lc->access[lc->num] = 1;
+    return lc->num++;
+}
+
+static void linear_close(struct linear_cache *lc, const char *path) {
+    for (int i = 0; i < lc->num; i++) {
+        if (strcmp(lc->remotepath[i], path) == 0) {
+            if (--lc->access[i] > 0) {
+                return;
+            }
+            free(lc->remotepath[i]);
+            for (int j = i; j + 1 < lc->num; j++) {
+                lc->remotepath[j] = lc->remotepath[j + 1];
+                lc->access[j] = lc->access[j + 1];
+            }
+            lc->num--;
+            return;
+        }
+    }
+}
+
+static void hash_open(struct file_cache *fc, const char *path) {
+    struct file_cache_local *entry = file_cache_find(fc, path);
+    if (entry != NULL) {
+        entry->access++;
+    } else {
+        file_cache_insert(fc, path, "/tmp/local");
+    }
+}
+
+static void hash_close(struct file_cache *fc, const char *path) {
+    struct file_cache_local *entry = file_cache_find(fc, path);
+    if (entry != NULL && --entry->access == 0) {
+        file_cache_remove(fc, entry);
+    }
+}
+
+int main(void) {
+    static struct file_cache fc;
+    static struct linear_cache lc;
+
+    for (int i = 0; i <= MAX_OPEN; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/home/user/project/src/module%d/file.c", i);
+    }
+    srand(1);
+
+    printf("%8s %14s %14s %14s %14s\n", "open", "hash reopen", "hash churn", "linear reopen", "linear churn");
+    for (int n = 16; n <= MAX_OPEN; n *= 2) {
+        // no cap here, so the table can be measured past CACHE_SIZE
+        file_cache_init(&fc, INT_MAX);
+        lc.num = 0;
+        for (int i = 0; i < n; i++) {
+            hash_open(&fc, paths[i]);
+            linear_open(&lc, paths[i]);
+        }
+
+        double t0 = now();
+        for (int op = 0; op < OPS; op++) {
+            const char *p = paths[rand() % n];
+            hash_open(&fc, p);
+            hash_close(&fc, p);
+        }
+        double t1 = now();
+        for (int op = 0; op < OPS; op++) {
+            hash_open(&fc, paths[MAX_OPEN]);
+            hash_close(&fc, paths[MAX_OPEN]);
+        }
+        double t2 = now();
+        for (int op = 0; op < OPS; op++) {
+            const char *p = paths[rand() % n];
+            linear_open(&lc, p);
+            linear_close(&lc, p);
+        }
+        double t3 = now();
+        for (int op = 0; op < OPS; op++) {
+            // close the oldest entry and reopen it, so removal has to shift
+            linear_close(&lc, paths[0]);
+            linear_open(&lc, paths[0]);
+        }
+        double t4 = now();
+
+        printf("%8d %11.1f ns %11.1f ns %11.1f ns %11.1f ns\n", n,
+               (t1 - t0) / OPS * 1e9, (t2 - t1) / OPS * 1e9,
+               (t3 - t2) / OPS * 1e9, (t4 - t3) / OPS * 1e9);
+
+        for (int i = 0; i < n; i++) {
+            hash_close(&fc, paths[i]);
+        }
+        while (lc.num > 0) {
+            linear_close(&lc, lc.remotepath[0]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+// Cost of logging on the read path, by log level.
+//
+// Repeats what bb_read does for a request served from the local copy:
+// its log_command_at, log_fi and log_syscall around a 4 KiB pread of a
+// cached file, and prints the time per request with logging off, at
+// errors only, at one line per operation and at full verbosity, for the
+// buffered binary log and for -o log_text. The log files are written
+// next to the file read, so put them on the disk or tmpfs of interest.
+//
+// Build: gcc -O2 -pthread -D_FILE_OFFSET_BITS=64 -I.. $(pkg-config --cflags fuse) bench-logging.c ../log.c ../logbuf.c -o bench-logging
+// Run:   ./bench-logging [dir]
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "params.h"
+#include "log.h"
+
+#define OPS 200000
+#define READ_SIZE 4096
+#define FILE_SIZE (64 << 20)
+
+struct bb_state *bb_global;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// bb_read, less the cache bookkeeping
+static int read_op(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    log_command_at(BB_LOG_DEBUG, "bb_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)",
+                   path, buf, size, offset, fi);
+    log_fi(fi);
+    return log_syscall("pread", pread((int) fi->fh, buf, size, offset), 0);
+}
+
+static double run(int fd) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = fd;
+    static char buf[READ_SIZE];
+    double t0 = now();
+    for (int op = 0; op < OPS; op++) {
+        off_t offset = (off_t) (op % (FILE_SIZE / READ_SIZE)) * READ_SIZE;
+        if (read_op("/project/src/main.c", buf, READ_SIZE, offset, &fi) != READ_SIZE) {
+            fprintf(stderr, "short read\n");
+            exit(1);
+        }
+    }
+    return (now() - t0) / OPS * 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    char data[4096], binlog[4096], textlog[4096];
+    snprintf(data, sizeof(data), "%s/bench-logging.data", dir);
+    snprintf(binlog, sizeof(binlog), "%s/bench-logging.bin", dir);
+    snprintf(textlog, sizeof(textlog), "%s/bench-logging.log", dir);
+
+    int fd = open(data, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, FILE_SIZE) < 0) {
+        perror(data);
+        return 1;
+    }
+    static char block[READ_SIZE];
+    for (off_t w = 0; w < FILE_SIZE; w += READ_SIZE) {
+        if (pwrite(fd, block, READ_SIZE, w) != READ_SIZE) {
+            perror("pwrite");
+            return 1;
+        }
+    }
+    bb_global = calloc(1, sizeof(struct bb_state));
+    run(fd); // page cache and rings warm
+
+    const char *levels[] = {"off", "errors", "operations", "debug"};
+    printf("%-12s %14s %14s\n", "level", "binary ns/op", "text ns/op");
+    double binary[4], text[4];
+    bb_global->logfile = log_open(binlog);
+    log_start();
+    for (int level = BB_LOG_OFF; level <= BB_LOG_DEBUG; level++) {
+        bb_global->log_level = level;
+        binary[level] = run(fd);
+    }
+    log_flush();
+    fclose(bb_global->logfile);
+    bb_global->logfile = log_open(textlog);
+    bb_global->log_text = 1;
+    for (int level = BB_LOG_OFF; level <= BB_LOG_DEBUG; level++) {
+        bb_global->log_level = level;
+        text[level] = run(fd);
+    }
+    fclose(bb_global->logfile);
+    for (int level = BB_LOG_OFF; level <= BB_LOG_DEBUG; level++) {
+        printf("%-12s %14.1f %14.1f\n", levels[level], binary[level], text[level]);
+    }
+    printf("(levels above %d are compiled out of this build)\n", BB_LOG_MAX);
+
+    close(fd);
+    unlink(data);
+    unlink(binlog);
+    unlink(textlog);
+    return 0;
+}
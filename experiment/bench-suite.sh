@@ -0,0 +1,137 @@
+#!/bin/sh
+# Benchmark matrix against a local ssh server behind a simulated link.
+#
+# Starts a private sshd on 127.0.0.1 with throwaway keys, puts latency-proxy
+# in front of it for every RTT and bandwidth of the matrix, and for every
+# workload prepares its files in the exported directory, mounts bbfs through
+# the proxy, runs bench-workload under the mount and unmounts again, so every
+# run starts with cold caches. Each run appends one JSON line to the results
+# file, with the commit, the link and the mount options added to what
+# bench-workload reports; bench-compare.sh lines up two such files.
+#
+# Must not run as root, like bbfs itself. The matrix is set through
+#   BENCH_RTT_MS     round-trip times in ms (default "0 20 80")
+#   BENCH_MBIT       bandwidth caps in Mbit/s, 0 for none (default "0 100")
+#   BENCH_WORKLOADS  default "metadata seqread seqwrite randread rewrite tinyread"
+#   BENCH_SCALE      size multiplier of the workloads (default 1)
+#   BENCH_OPTIONS    extra bbfs options, e.g. "-o lazy" (default none)
+#   BENCH_PORT       first of the two local ports used (default 22220)
+#   SSHD             sshd binary (default /usr/sbin/sshd)
+#
+# Build: make bench (cmake), or build bbfs, latency-proxy and bench-workload
+# Run:   ./bench-suite.sh <bbfs> <latency-proxy> <bench-workload> <results.jsonl>
+
+set -eu
+
+if [ $# -ne 4 ]; then
+    echo "usage: $0 <bbfs> <latency-proxy> <bench-workload> <results.jsonl>" >&2
+    exit 1
+fi
+bbfs=$(realpath "$1")
+proxy=$(realpath "$2")
+workload=$(realpath "$3")
+results=$(realpath "$4")
+
+rtts=${BENCH_RTT_MS:-"0 20 80"}
+rates=${BENCH_MBIT:-"0 100"}
+workloads=${BENCH_WORKLOADS:-"metadata seqread seqwrite randread rewrite tinyread"}
+scale=${BENCH_SCALE:-1}
+options=${BENCH_OPTIONS:-}
+ssh_port=${BENCH_PORT:-22220}
+proxy_port=$((ssh_port + 1))
+sshd=${SSHD:-/usr/sbin/sshd}
+commit=$(git -C "$(dirname "$0")" describe --always --dirty 2>/dev/null || echo unknown)
+
+work=$(mktemp -d /tmp/bbfs-bench-XXXXXX)
+sshd_pid=
+proxy_pid=
+bbfs_pid=
+
+cleanup() {
+    if [ -n "$bbfs_pid" ]; then
+        fusermount -u "$work/mnt" 2>/dev/null || kill "$bbfs_pid" 2>/dev/null || true
+        wait "$bbfs_pid" 2>/dev/null || true
+    fi
+    for pid in $proxy_pid $sshd_pid; do
+        kill "$pid" 2>/dev/null || true
+    done
+    rm -rf "$work"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# wait_for <seconds> <test arguments...>
+wait_for() {
+    tries=$(($1 * 10))
+    shift
+    while ! test "$@"; do
+        tries=$((tries - 1))
+        if [ $tries -le 0 ]; then
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+ssh-keygen -q -t ed25519 -N '' -f "$work/host_key"
+ssh-keygen -q -t ed25519 -N '' -f "$work/user_key"
+cp "$work/user_key.pub" "$work/authorized_keys"
+cat > "$work/sshd_config" <<EOF
+Port $ssh_port
+ListenAddress 127.0.0.1
+HostKey $work/host_key
+AuthorizedKeysFile $work/authorized_keys
+PidFile $work/sshd.pid
+StrictModes no
+PasswordAuthentication no
+KbdInteractiveAuthentication no
+UsePAM no
+Subsystem sftp internal-sftp
+EOF
+"$sshd" -D -e -f "$work/sshd_config" 2>"$work/sshd.log" &
+sshd_pid=$!
+tries=50
+until grep -q "Server listening" "$work/sshd.log"; do
+    tries=$((tries - 1))
+    if [ $tries -le 0 ] || ! kill -0 "$sshd_pid" 2>/dev/null; then
+        cat "$work/sshd.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+mkdir "$work/remote" "$work/mnt"
+for rtt in $rtts; do
+    for rate in $rates; do
+        "$proxy" "$proxy_port" "127.0.0.1:$ssh_port" "$rtt" "$rate" &
+        proxy_pid=$!
+        # give it the moment it needs to listen
+        sleep 0.2
+        for name in $workloads; do
+            rm -rf "$work/remote"
+            mkdir "$work/remote"
+            "$workload" prepare "$name" "$work/remote" "$scale"
+
+            # shellcheck disable=SC2086
+            "$bbfs" -f -o "port=$proxy_port,identity=$work/user_key" $options \
+                "$(id -un)@127.0.0.1:$work/remote" "$work/mnt" "$work/bbfs.log" 2>"$work/bbfs.err" &
+            bbfs_pid=$!
+            if ! wait_for 60 -e "$work/mnt/.bbfs/stats"; then
+                echo "bbfs did not mount:" >&2
+                cat "$work/bbfs.err" >&2
+                exit 1
+            fi
+
+            line=$("$workload" run "$name" "$work/mnt" "$scale")
+            echo "$line" | sed "s|}\$|,\"commit\":\"$commit\",\"rtt_ms\":$rtt,\"mbit\":$rate,\"options\":\"$options\"}|" >> "$results"
+            echo "rtt ${rtt}ms, ${rate}Mbit/s: $line" >&2
+
+            fusermount -u "$work/mnt"
+            wait "$bbfs_pid" || true
+            bbfs_pid=
+        done
+        kill "$proxy_pid"
+        wait "$proxy_pid" 2>/dev/null || true
+        proxy_pid=
+    done
+done
@@ -0,0 +1,126 @@
+// Large-file transfer throughput against file size and number of streams.
+//
+// Opens MAX_STREAMS ssh connections to user@host, then for each file size
+// uploads a local file of that size to DIR on the remote and downloads it
+// back with xfer_parallel over 1 to MAX_STREAMS connections, printing MB/s.
+// One stream is the single-channel baseline. Finally it downloads the
+// largest file repeatedly through the tuner bbfs uses and prints the
+// streams and range size it settles on.
+//
+// Build: gcc -O2 -pthread -I.. bench-transfer.c ../xfer.c -lssh -o bench-transfer
+// Run:   ./bench-transfer user@host <remote dir> [largest size in MB]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xfer.h"
+
+#define MAX_STREAMS 8
+#define CHUNK 65536
+#define TUNER_ROUNDS 8
+
+static struct bb_conn conns[MAX_STREAMS];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void connect_all(const char *user, const char *host) {
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        ssh_session session = ssh_new();
+        ssh_options_set(session, SSH_OPTIONS_HOST, host);
+        ssh_options_set(session, SSH_OPTIONS_USER, user);
+        if (ssh_connect(session) != SSH_OK
+            || ssh_userauth_publickey_auto(session, NULL, NULL) != SSH_AUTH_SUCCESS) {
+            fprintf(stderr, "cannot connect to %s@%s: %s\n", user, host, ssh_get_error(session));
+            exit(1);
+        }
+        conns[i].session = session;
+        conns[i].sftp = sftp_new(session);
+        if (conns[i].sftp == NULL || sftp_init(conns[i].sftp) != SSH_OK) {
+            fprintf(stderr, "cannot start sftp: %s\n", ssh_get_error(session));
+            exit(1);
+        }
+    }
+}
+
+static int make_local(const char *path, long size) {
+    char buf[CHUNK];
+    for (int i = 0; i < CHUNK; i++) {
+        buf[i] = (char) rand();
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    for (long w = 0; fd >= 0 && w < size; w += CHUNK) {
+        if (write(fd, buf, size - w < CHUNK ? size - w : CHUNK) < 0) {
+            perror("write");
+            exit(1);
+        }
+    }
+    return fd;
+}
+
+static double run(int fd, const char *remote, long size, int streams, int upload, size_t range) {
+    struct bb_conn *list[MAX_STREAMS];
+    for (int i = 0; i < streams; i++) {
+        list[i] = &conns[i];
+    }
+    double t0 = now();
+    if (xfer_parallel(list, streams, remote, fd, size, upload, range, CHUNK) < 0) {
+        fprintf(stderr, "transfer of %s failed\n", remote);
+        exit(1);
+    }
+    return size / (now() - t0) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    char user[256], host[256], remote[4096];
+    if (argc < 3 || sscanf(argv[1], "%255[^@]@%255s", user, host) != 2) {
+        fprintf(stderr, "usage: %s user@host <remote dir> [largest size in MB]\n", argv[0]);
+        return 1;
+    }
+    long max_mb = argc > 3 ? atol(argv[3]) : 256;
+    snprintf(remote, sizeof(remote), "%s/bench-transfer.tmp", argv[2]);
+    char local[] = "/tmp/bench-transfer-XXXXXX";
+    close(mkstemp(local));
+    connect_all(user, host);
+
+    printf("%10s %8s %12s %12s\n", "size", "streams", "upload MB/s", "download MB/s");
+    long size = 0;
+    for (long mb = 1; mb <= max_mb; mb *= 4) {
+        size = mb << 20;
+        int fd = make_local(local, size);
+        for (int streams = 1; streams <= MAX_STREAMS; streams *= 2) {
+            // every stream gets at least one range
+            size_t range = size / streams / 4 > XFER_RANGE_MIN ? size / streams / 4 : XFER_RANGE_MIN;
+            double up = run(fd, remote, size, streams, 1, range);
+            double down = run(fd, remote, size, streams, 0, range);
+            printf("%8ldMB %8d %12.1f %12.1f\n", mb, streams, up, down);
+        }
+        close(fd);
+    }
+
+    // the adaptive choice, as bbfs makes it across successive opens
+    struct xfer_tuner tuner;
+    xfer_tuner_init(&tuner, MAX_STREAMS);
+    int fd = open(local, O_RDWR);
+    printf("\nadaptive download of %ldMB:\n%6s %8s %12s %12s\n", size >> 20, "round", "streams", "range", "MB/s");
+    for (int round = 0; round < TUNER_ROUNDS; round++) {
+        size_t range;
+        int streams = xfer_tuner_plan(&tuner, &range);
+        double t0 = now();
+        double rate = run(fd, remote, size, streams, 0, range);
+        xfer_tuner_update(&tuner, streams, size, now() - t0);
+        printf("%6d %8d %12zu %12.1f\n", round, streams, range, rate);
+    }
+    close(fd);
+    unlink(local);
+    sftp_unlink(conns[0].sftp, remote);
+    return 0;
+}
@@ -0,0 +1,315 @@
+// One workload of the benchmark matrix, run against a bbfs mount.
+//
+//   prepare  writes the files the workload reads straight into the backing
+//            directory, the one the ssh server exports, so setting up is not
+//            part of what is measured
+//   run      performs the workload under the mount point and prints one
+//            JSON line: operations, seconds, bytes moved and the latency
+//            percentiles of the individual operations
+//
+// Workloads, sizes multiplied by the scale:
+//   metadata  stat and read 500 small files in 20 directories, then create,
+//             write and unlink 100 more
+//   seqread   read a 64MB file front to back in 1MB reads
+//   seqwrite  write a 64MB file in 1MB writes, fsync and close
+//   randread  2000 4K reads at random offsets of a 64MB file
+//   rewrite   4 rounds of 16 random 4K writes into a 64MB file, then fsync
+//   tinyread  read one byte from the middle of a 1GB sparse file, 4 times
+//
+// Build: gcc -O2 bench-workload.c -o bench-workload
+// Run:   ./bench-workload prepare <workload> <backing dir> [scale]
+//        ./bench-workload run <workload> <mount dir> [scale]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MB (1L << 20)
+#define BLOCK 4096
+#define META_DIRS 20
+#define META_FILES 25
+#define META_SIZE 1024
+#define META_CREATE 100
+#define LARGE (64 * MB)
+#define RANDOM_READS 2000
+#define REWRITE_ROUNDS 4
+#define REWRITE_BLOCKS 16
+#define HUGE (1024 * MB)
+#define TINY_ROUNDS 4
+
+static char buf[MB];
+static double *lat;
+static long nlat, caplat;
+static long long bytes;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *path) {
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+static void done(double start) {
+    if (nlat == caplat) {
+        caplat = caplat ? 2 * caplat : 1024;
+        lat = realloc(lat, caplat * sizeof(*lat));
+    }
+    lat[nlat++] = now() - start;
+}
+
+static int cmp(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+    long i = (long) (p * nlat);
+    return nlat == 0 ? 0 : lat[i < nlat ? i : nlat - 1] * 1e6;
+}
+
+// Write size bytes of pattern to path, or make it sparse.
+static void make_file(const char *path, long size, int sparse) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fail("create", path);
+    }
+    if (sparse) {
+        if (ftruncate(fd, size) < 0) {
+            fail("truncate", path);
+        }
+    }
+    for (long w = 0; !sparse && w < size; w += MB) {
+        if (write(fd, buf, size - w < MB ? size - w : MB) < 0) {
+            fail("write", path);
+        }
+    }
+    close(fd);
+}
+
+static void prepare(const char *name, const char *dir, int scale) {
+    char path[4096];
+    if (strcmp(name, "metadata") == 0) {
+        for (int d = 0; d < META_DIRS * scale; d++) {
+            snprintf(path, sizeof(path), "%s/meta%d", dir, d);
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                fail("mkdir", path);
+            }
+            for (int f = 0; f < META_FILES; f++) {
+                snprintf(path, sizeof(path), "%s/meta%d/file%d", dir, d, f);
+                make_file(path, META_SIZE, 0);
+            }
+        }
+    } else if (strcmp(name, "seqread") == 0 || strcmp(name, "randread") == 0 || strcmp(name, "rewrite") == 0) {
+        snprintf(path, sizeof(path), "%s/%s.dat", dir, name);
+        make_file(path, LARGE * scale, 0);
+    } else if (strcmp(name, "tinyread") == 0) {
+        snprintf(path, sizeof(path), "%s/tinyread.dat", dir);
+        make_file(path, HUGE * scale, 1);
+    } else if (strcmp(name, "seqwrite") != 0) {
+        fprintf(stderr, "unknown workload %s\n", name);
+        exit(1);
+    }
+}
+
+static void metadata(const char *dir, int scale) {
+    char path[4096];
+    struct stat st;
+    for (int d = 0; d < META_DIRS * scale; d++) {
+        for (int f = 0; f < META_FILES; f++) {
+            snprintf(path, sizeof(path), "%s/meta%d/file%d", dir, d, f);
+            double t = now();
+            if (stat(path, &st) < 0) {
+                fail("stat", path);
+            }
+            done(t);
+            t = now();
+            int fd = open(path, O_RDONLY);
+            ssize_t n = fd < 0 ? -1 : read(fd, buf, META_SIZE);
+            if (n < 0) {
+                fail("read", path);
+            }
+            close(fd);
+            done(t);
+            bytes += n;
+        }
+    }
+    for (int f = 0; f < META_CREATE * scale; f++) {
+        snprintf(path, sizeof(path), "%s/meta%d/new%d", dir, f % (META_DIRS * scale), f);
+        double t = now();
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, buf, 100) < 0) {
+            fail("create", path);
+        }
+        close(fd);
+        done(t);
+        bytes += 100;
+    }
+    for (int f = 0; f < META_CREATE * scale; f++) {
+        snprintf(path, sizeof(path), "%s/meta%d/new%d", dir, f % (META_DIRS * scale), f);
+        double t = now();
+        if (unlink(path) < 0) {
+            fail("unlink", path);
+        }
+        done(t);
+    }
+}
+
+static int open_timed(const char *path, int flags) {
+    double t = now();
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
+        fail("open", path);
+    }
+    done(t);
+    return fd;
+}
+
+static void close_timed(int fd, const char *path) {
+    double t = now();
+    if (close(fd) < 0) {
+        fail("close", path);
+    }
+    done(t);
+}
+
+static void fsync_timed(int fd, const char *path) {
+    double t = now();
+    if (fsync(fd) < 0) {
+        fail("fsync", path);
+    }
+    done(t);
+}
+
+static void seqread(const char *path) {
+    int fd = open_timed(path, O_RDONLY);
+    for (;;) {
+        double t = now();
+        ssize_t n = read(fd, buf, MB);
+        if (n < 0) {
+            fail("read", path);
+        }
+        done(t);
+        if (n == 0) {
+            break;
+        }
+        bytes += n;
+    }
+    close_timed(fd, path);
+}
+
+static void seqwrite(const char *path, long size) {
+    int fd = open_timed(path, O_WRONLY | O_CREAT | O_TRUNC);
+    for (long w = 0; w < size; w += MB) {
+        double t = now();
+        if (write(fd, buf, MB) != MB) {
+            fail("write", path);
+        }
+        done(t);
+        bytes += MB;
+    }
+    fsync_timed(fd, path);
+    close_timed(fd, path);
+    unlink(path);
+}
+
+static void randread(const char *path, long size, int reads) {
+    int fd = open_timed(path, O_RDONLY);
+    for (int i = 0; i < reads; i++) {
+        off_t off = (off_t) (rand() % (size / BLOCK)) * BLOCK;
+        double t = now();
+        if (pread(fd, buf, BLOCK, off) != BLOCK) {
+            fail("read", path);
+        }
+        done(t);
+        bytes += BLOCK;
+    }
+    close_timed(fd, path);
+}
+
+static void rewrite(const char *path, long size, int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        int fd = open_timed(path, O_RDWR);
+        for (int i = 0; i < REWRITE_BLOCKS; i++) {
+            off_t off = (off_t) (rand() % (size / BLOCK)) * BLOCK;
+            double t = now();
+            if (pwrite(fd, buf, BLOCK, off) != BLOCK) {
+                fail("write", path);
+            }
+            done(t);
+            bytes += BLOCK;
+        }
+        fsync_timed(fd, path);
+        close_timed(fd, path);
+    }
+}
+
+static void tinyread(const char *path, long size) {
+    for (int r = 0; r < TINY_ROUNDS; r++) {
+        double t = now();
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || pread(fd, buf, 1, size / 2) != 1) {
+            fail("read", path);
+        }
+        close(fd);
+        done(t);
+        bytes += 1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || (strcmp(argv[1], "prepare") != 0 && strcmp(argv[1], "run") != 0)) {
+        fprintf(stderr, "usage: %s prepare|run <workload> <dir> [scale]\n", argv[0]);
+        return 1;
+    }
+    const char *name = argv[2], *dir = argv[3];
+    int scale = argc > 4 ? atoi(argv[4]) : 1;
+    if (scale < 1) {
+        scale = 1;
+    }
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = (char) (i * 31 + 7);
+    }
+    if (strcmp(argv[1], "prepare") == 0) {
+        prepare(name, dir, scale);
+        return 0;
+    }
+
+    // the same offsets on every run, so runs compare
+    srand(1);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.dat", dir, name);
+    double start = now();
+    if (strcmp(name, "metadata") == 0) {
+        metadata(dir, scale);
+    } else if (strcmp(name, "seqread") == 0) {
+        seqread(path);
+    } else if (strcmp(name, "seqwrite") == 0) {
+        seqwrite(path, LARGE * scale);
+    } else if (strcmp(name, "randread") == 0) {
+        randread(path, LARGE * scale, RANDOM_READS * scale);
+    } else if (strcmp(name, "rewrite") == 0) {
+        rewrite(path, LARGE * scale, REWRITE_ROUNDS * scale);
+    } else if (strcmp(name, "tinyread") == 0) {
+        tinyread(path, HUGE * scale);
+    } else {
+        fprintf(stderr, "unknown workload %s\n", name);
+        return 1;
+    }
+    double seconds = now() - start;
+
+    qsort(lat, nlat, sizeof(*lat), cmp);
+    printf("{\"workload\":\"%s\",\"scale\":%d,\"ops\":%ld,\"seconds\":%.6f,\"bytes\":%lld,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+           name, scale, nlat, seconds, bytes, percentile(0.50), percentile(0.99), percentile(1.0));
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,193 @@
+// Local stand-in for the remote end of the helper protocol.
+//
+// Starts bbfs-helper as a child over a pair of pipes instead of an ssh
+// channel and drives every request bbfs makes against a scratch directory
+// under /tmp: stat, readdir, ranged read and write, block hashes,
+// truncate and rename. Each result is checked against the local file
+// system, then each request type is timed in a loop, which is the cost
+// the helper adds on top of the network round trip.
+//
+// Build: gcc -O2 -pthread -I.. helper-standin.c ../helper.c -o helper-standin
+// Run:   ./helper-standin [path to bbfs-helper]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helper.h"
+
+#define ROUNDS 10000
+#define BLOCK 65536
+#define FILE_BLOCKS 16
+
+static int to_helper, from_helper;
+static int failures;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int pipe_send(void *ctx, const void *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(to_helper, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data = (const char *) data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int pipe_recv(void *ctx, void *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(from_helper, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data = (char *) data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void start(const char *command) {
+    int down[2], up[2];
+    if (pipe(down) < 0 || pipe(up) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(down[0], 0);
+        dup2(up[1], 1);
+        close(down[1]);
+        close(up[0]);
+        execlp(command, command, (char *) NULL);
+        perror(command);
+        _exit(127);
+    }
+    close(down[0]);
+    close(up[1]);
+    to_helper = down[1];
+    from_helper = up[0];
+}
+
+static void check(const char *what, int ok) {
+    printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+// 1 if digest is that of the len bytes at data
+static int digest_is(const unsigned char *digest, const unsigned char *data, size_t len) {
+    unsigned char expected[HELPER_DIGEST_SIZE];
+    helper_digest(data, len, expected);
+    return memcmp(digest, expected, HELPER_DIGEST_SIZE) == 0;
+}
+
+static int count_entry(void *arg, const char *name, const struct stat *statbuf) {
+    if (strcmp(name, "data") == 0 && S_ISREG(statbuf->st_mode) && statbuf->st_size == FILE_BLOCKS * BLOCK) {
+        (*(int *) arg)++;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *command = argc > 1 ? argv[1] : "./bbfs-helper";
+    char dir[] = "/tmp/helper-standin-XXXXXX", path[256], moved[256];
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/data", dir);
+    snprintf(moved, sizeof(moved), "%s/moved", dir);
+    static unsigned char data[FILE_BLOCKS * BLOCK], buf[FILE_BLOCKS * BLOCK];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char) rand();
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, data, sizeof(data)) != (ssize_t) sizeof(data)) {
+        perror(path);
+        return 1;
+    }
+
+    start(command);
+    static struct helper h;
+    h.send = pipe_send;
+    h.recv = pipe_recv;
+    if (helper_open(&h) < 0) {
+        fprintf(stderr, "%s does not answer\n", command);
+        return 1;
+    }
+
+    struct stat remote, local;
+    fstat(fd, &local);
+    check("stat", helper_stat(&h, path, &remote) == 0 && remote.st_size == local.st_size
+          && remote.st_mode == local.st_mode && remote.st_ino == local.st_ino);
+    check("stat of a missing path", helper_stat(&h, moved, &remote) == -ENOENT);
+    int found = 0;
+    check("readdir", helper_readdir(&h, dir, count_entry, &found) == 0 && found == 1);
+    check("read", helper_read(&h, path, buf, BLOCK, 3 * BLOCK) == BLOCK
+          && memcmp(buf, data + 3 * BLOCK, BLOCK) == 0);
+    check("read past the end", helper_read(&h, path, buf, BLOCK, sizeof(data)) == 0);
+
+    unsigned char hashes[FILE_BLOCKS * HELPER_DIGEST_SIZE];
+    int same = helper_hash_blocks(&h, path, 0, FILE_BLOCKS, BLOCK, hashes) == 0;
+    for (int b = 0; b < FILE_BLOCKS && same; b++) {
+        same = digest_is(hashes + b * HELPER_DIGEST_SIZE, data + b * BLOCK, BLOCK);
+    }
+    check("hash", same);
+    memset(data + 5 * BLOCK, 0xab, 100);
+    check("write", helper_write(&h, path, data + 5 * BLOCK, 100, 5 * BLOCK) == 100
+          && pread(fd, buf, 100, 5 * BLOCK) == 100 && memcmp(buf, data + 5 * BLOCK, 100) == 0);
+    check("hash finds the changed block", helper_hash_blocks(&h, path, 5, 1, BLOCK, hashes) == 0
+          && digest_is(hashes, data + 5 * BLOCK, BLOCK));
+    check("truncate", helper_truncate(&h, path, BLOCK + 1) == 0
+          && fstat(fd, &local) == 0 && local.st_size == BLOCK + 1);
+    check("hash of a short last block", helper_hash_blocks(&h, path, 1, 2, BLOCK, hashes) == 0
+          && digest_is(hashes, data + BLOCK, 1) && digest_is(hashes + HELPER_DIGEST_SIZE, data, 0));
+    check("rename", helper_rename(&h, path, moved) == 0 && access(moved, F_OK) == 0);
+    check("rename of a missing path", helper_rename(&h, path, moved) == -ENOENT);
+
+    printf("\n%-12s %12s\n", "request", "us/request");
+    double t0 = now();
+    for (int i = 0; i < ROUNDS; i++) {
+        helper_stat(&h, moved, &remote);
+    }
+    printf("%-12s %12.2f\n", "stat", (now() - t0) / ROUNDS * 1e6);
+    t0 = now();
+    for (int i = 0; i < ROUNDS; i++) {
+        helper_readdir(&h, dir, count_entry, &found);
+    }
+    printf("%-12s %12.2f\n", "readdir", (now() - t0) / ROUNDS * 1e6);
+    t0 = now();
+    for (int i = 0; i < ROUNDS; i++) {
+        helper_read(&h, moved, buf, BLOCK, 0);
+    }
+    printf("%-12s %12.2f\n", "read 64k", (now() - t0) / ROUNDS * 1e6);
+    t0 = now();
+    for (int i = 0; i < ROUNDS; i++) {
+        helper_write(&h, moved, data, BLOCK, 0);
+    }
+    printf("%-12s %12.2f\n", "write 64k", (now() - t0) / ROUNDS * 1e6);
+    t0 = now();
+    for (int i = 0; i < ROUNDS; i++) {
+        helper_hash_blocks(&h, moved, 0, 1, BLOCK, hashes);
+    }
+    printf("%-12s %12.2f\n", "hash 64k", (now() - t0) / ROUNDS * 1e6);
+
+    close(to_helper);
+    wait(NULL);
+    unlink(moved);
+    rmdir(dir);
+    close(fd);
+    printf("\n%d checks failed\n", failures);
+    return failures > 0;
+}
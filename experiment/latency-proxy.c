@@ -0,0 +1,229 @@
+// TCP proxy that adds a fixed round-trip time and a bandwidth cap.
+//
+// Listens on 127.0.0.1:<listen port> and forwards every connection to
+// host:port. Each direction of each connection delays its bytes by half the
+// RTT and paces them to the given rate, the way a long link with a narrow
+// bottleneck would, so bbfs can be measured against a local sshd as if the
+// remote were far away. A rate of 0 means no cap.
+//
+// Build: gcc -O2 -pthread latency-proxy.c -o latency-proxy
+// Run:   ./latency-proxy <listen port> <host:port> <rtt ms> <Mbit/s>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK 16384
+#define QUEUE_MIN (256 * 1024)
+
+static const char *target_host;
+static const char *target_port;
+static double delay; // one way, seconds
+static double rate; // bytes per second, 0 for no cap
+static size_t queue_max; // bytes a direction holds before the sender is pushed back
+
+// Bytes read from one side, waiting to be written to the other.
+struct chunk {
+    struct chunk *next;
+    double due; // earliest time the bytes may leave
+    size_t len;
+    char data[CHUNK];
+};
+
+// One direction of a proxied connection: a reader that queues what arrives
+// and a writer that releases it on time.
+struct pipe {
+    int from, to;
+    struct chunk *head, *tail;
+    size_t queued;
+    int eof;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t) {
+    double left = t - now();
+    if (left > 0) {
+        struct timespec ts = { (time_t) left, (long) ((left - (time_t) left) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void *pipe_reader(void *arg) {
+    struct pipe *p = arg;
+    for (;;) {
+        struct chunk *c = malloc(sizeof(*c));
+        ssize_t n = c == NULL ? -1 : read(p->from, c->data, CHUNK);
+        pthread_mutex_lock(&p->lock);
+        while (n > 0 && p->queued > queue_max) {
+            pthread_cond_wait(&p->space, &p->lock);
+        }
+        if (n <= 0) {
+            free(c);
+            p->eof = 1;
+            pthread_cond_signal(&p->ready);
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        c->len = n;
+        c->due = now() + delay;
+        c->next = NULL;
+        if (p->tail != NULL) {
+            p->tail->next = c;
+        } else {
+            p->head = c;
+        }
+        p->tail = c;
+        p->queued += n;
+        pthread_cond_signal(&p->ready);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static void *pipe_writer(void *arg) {
+    struct pipe *p = arg;
+    double free_at = 0; // when the simulated link has sent what it was given
+    int broken = 0;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->head == NULL && !p->eof) {
+            pthread_cond_wait(&p->ready, &p->lock);
+        }
+        struct chunk *c = p->head;
+        if (c == NULL) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        p->head = c->next;
+        if (p->head == NULL) {
+            p->tail = NULL;
+        }
+        p->queued -= c->len;
+        pthread_cond_signal(&p->space);
+        pthread_mutex_unlock(&p->lock);
+
+        // serialization at the bottleneck, then propagation
+        double start = free_at > c->due - delay ? free_at : c->due - delay;
+        free_at = start + (rate > 0 ? c->len / rate : 0);
+        sleep_until(free_at + delay);
+        size_t done = 0;
+        while (!broken && done < c->len) {
+            ssize_t n = write(p->to, c->data + done, c->len - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // stop the reader, and drop what it still queues
+                shutdown(p->from, SHUT_RD);
+                broken = 1;
+            } else {
+                done += n;
+            }
+        }
+        free(c);
+    }
+    shutdown(p->to, SHUT_WR);
+    return NULL;
+}
+
+static int connect_target(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(target_host, target_port, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void *serve(void *arg) {
+    int client = (int) (long) arg;
+    int server = connect_target();
+    if (server < 0) {
+        perror("connect");
+        close(client);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct pipe pipes[2] = { { .from = client, .to = server }, { .from = server, .to = client } };
+    pthread_t threads[4];
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_init(&pipes[i].lock, NULL);
+        pthread_cond_init(&pipes[i].ready, NULL);
+        pthread_cond_init(&pipes[i].space, NULL);
+        pthread_create(&threads[2 * i], NULL, pipe_reader, &pipes[i]);
+        pthread_create(&threads[2 * i + 1], NULL, pipe_writer, &pipes[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_destroy(&pipes[i].lock);
+        pthread_cond_destroy(&pipes[i].ready);
+        pthread_cond_destroy(&pipes[i].space);
+    }
+    close(client);
+    close(server);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    static char host[256], port[16];
+    if (argc != 5 || sscanf(argv[2], "%255[^:]:%15s", host, port) != 2) {
+        fprintf(stderr, "usage: %s <listen port> <host:port> <rtt ms> <Mbit/s>\n", argv[0]);
+        return 1;
+    }
+    target_host = host;
+    target_port = port;
+    delay = atof(argv[3]) / 2000;
+    rate = atof(argv[4]) * 1e6 / 8;
+    // what the link holds in flight, so a capped link pushes back like a
+    // real one instead of buffering without end
+    queue_max = rate > 0 && rate * 2 * delay > QUEUE_MIN ? (size_t) (rate * 2 * delay) : QUEUE_MIN;
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(argv[1])) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        perror("listen");
+        return 1;
+    }
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve, (void *) (long) client);
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,325 @@
+/*
+  File cache
+
+  Hash table from remote path to the local copy of the file, used by
+  cache_open and cache_close. Lookups cost one hash and a short chain walk
+  no matter how many files are cached. Released entries are also kept in
+  least recently used order, for eviction.
+*/
+
+#include "filecache.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/**
+ * Set the bits of blocks [first, last), growing the map as needed.
+ * Returns -1 if the map could not grow.
+ */
+int block_map_set(struct block_map *map, size_t first, size_t last) {
+  if (last > map->nblocks) {
+    size_t nblocks = map->nblocks ? map->nblocks : 64;
+    while (nblocks < last) {
+      nblocks *= 2;
+    }
+    unsigned char *bits = realloc(map->bits, nblocks / 8);
+    if (bits == NULL) {
+      return -1;
+    }
+    memset(bits + map->nblocks / 8, 0, (nblocks - map->nblocks) / 8);
+    map->bits = bits;
+    map->nblocks = nblocks;
+  }
+  for (size_t b = first; b < last; b++) {
+    map->bits[b / 8] |= 1 << (b % 8);
+  }
+  return 0;
+}
+
+int block_map_test(const struct block_map *map, size_t block) {
+  return block < map->nblocks && (map->bits[block / 8] & (1 << (block % 8)));
+}
+
+void block_map_unset(struct block_map *map, size_t block) {
+  if (block < map->nblocks) {
+    map->bits[block / 8] &= ~(1 << (block % 8));
+  }
+}
+
+size_t block_map_count(const struct block_map *map) {
+  size_t count = 0;
+  for (size_t b = 0; b < map->nblocks; b++) {
+    count += block_map_test(map, b) ? 1 : 0;
+  }
+  return count;
+}
+
+void block_map_clear(struct block_map *map) {
+  free(map->bits);
+  map->bits = NULL;
+  map->nblocks = 0;
+}
+
+static struct file_cache_local **file_cache_slot(struct file_cache *fc, const char *remotepath) {
+  struct file_cache_local **slot = &fc->buckets[bb_hash(remotepath) % CACHE_BUCKETS];
+  while (*slot != NULL && strcmp((*slot)->remotepath, remotepath) != 0) {
+    slot = &(*slot)->next;
+  }
+  return slot;
+}
+
+void file_cache_init(struct file_cache *fc, int max_cache) {
+  memset(fc->buckets, 0, sizeof(fc->buckets));
+  fc->lru_head = fc->lru_tail = NULL;
+  fc->num_cache = 0;
+  fc->max_cache = max_cache;
+  fc->bytes = 0;
+  fc->max_bytes = ULLONG_MAX;
+  fc->uploads = 0;
+  fc->uploads_avoided = 0;
+  fc->bytes_saved = 0;
+  fc->delta_uploads = 0;
+  fc->delta_bytes = 0;
+  fc->fetches = 0;
+  fc->fetch_bytes = 0;
+  fc->prefetch_issued = 0;
+  fc->prefetch_hits = 0;
+  fc->prefetch_wasted = 0;
+  fc->reused = 0;
+  fc->stale = 0;
+  fc->evictions = 0;
+  fc->flushes = 0;
+  fc->coalesced = 0;
+}
+
+struct file_cache_local *file_cache_find(struct file_cache *fc, const char *remotepath) {
+  return *file_cache_slot(fc, remotepath);
+}
+
+/**
+ * Add a mapping with an access count of 1. Returns NULL if out of memory;
+ * max_cache is left to the caller to enforce by eviction.
+ */
+struct file_cache_local *file_cache_insert(struct file_cache *fc, const char *remotepath, const char *localpath) {
+  struct file_cache_local *entry = malloc(sizeof(struct file_cache_local));
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->remotepath = strdup(remotepath);
+  entry->localpath = strdup(localpath);
+  if (entry->remotepath == NULL || entry->localpath == NULL) {
+    free(entry->remotepath);
+    free(entry->localpath);
+    free(entry);
+    return NULL;
+  }
+  entry->access = 1;
+  entry->loading = 0;
+  pthread_mutex_init(&entry->lock, NULL);
+  entry->dirty = 0;
+  entry->dirty_blocks.bits = NULL;
+  entry->dirty_blocks.nblocks = 0;
+  entry->dirty_all = 0;
+  entry->remote_size = 0;
+  entry->remote_mtime = 0;
+  entry->trunc_size = 0;
+  entry->lazy = 0;
+  entry->present.bits = NULL;
+  entry->present.nblocks = 0;
+  entry->fetch_limit = 0;
+  entry->fetch_fd = -1;
+  entry->remote_file = NULL;
+  entry->remote_conn = NULL;
+  entry->prefetched.bits = NULL;
+  entry->prefetched.nblocks = 0;
+  entry->ninflight = 0;
+  entry->disk_bytes = 0;
+  entry->flush = FLUSH_NONE;
+  entry->deleted = 0;
+  entry->flush_next = NULL;
+  entry->lru_prev = entry->lru_next = NULL;
+  struct file_cache_local **slot = &fc->buckets[bb_hash(remotepath) % CACHE_BUCKETS];
+  entry->next = *slot;
+  *slot = entry;
+  fc->num_cache++;
+  return entry;
+}
+
+void file_cache_remove(struct file_cache *fc, struct file_cache_local *entry) {
+  file_cache_unhash(fc, entry);
+  file_cache_lru_remove(fc, entry);
+  fc->bytes -= entry->disk_bytes;
+  block_map_clear(&entry->dirty_blocks);
+  block_map_clear(&entry->present);
+  block_map_clear(&entry->prefetched);
+  pthread_mutex_destroy(&entry->lock);
+  free(entry->remotepath);
+  free(entry->localpath);
+  free(entry);
+  fc->num_cache--;
+}
+
+/**
+ * Take entry out of the hash chains, if it is in them, so lookups no
+ * longer find it and a new entry can take its path. It stays allocated
+ * and counted until it is removed.
+ */
+void file_cache_unhash(struct file_cache *fc, struct file_cache_local *entry) {
+  struct file_cache_local **slot = &fc->buckets[bb_hash(entry->remotepath) % CACHE_BUCKETS];
+  while (*slot != NULL && *slot != entry) {
+    slot = &(*slot)->next;
+  }
+  if (*slot != NULL) {
+    *slot = entry->next;
+  }
+  entry->next = NULL;
+}
+
+/**
+ * File entry under another remote path and local copy, which must not be
+ * in the cache already. Returns -1 if out of memory, leaving entry as it
+ * was.
+ */
+int file_cache_rekey(struct file_cache *fc, struct file_cache_local *entry, const char *remotepath, const char *localpath) {
+  char *newremote = strdup(remotepath);
+  char *newlocal = strdup(localpath);
+  if (newremote == NULL || newlocal == NULL) {
+    free(newremote);
+    free(newlocal);
+    return -1;
+  }
+  file_cache_unhash(fc, entry);
+  free(entry->remotepath);
+  free(entry->localpath);
+  entry->remotepath = newremote;
+  entry->localpath = newlocal;
+  struct file_cache_local **slot = &fc->buckets[bb_hash(remotepath) % CACHE_BUCKETS];
+  entry->next = *slot;
+  *slot = entry;
+  return 0;
+}
+
+/**
+ * Make entry the most recently used of the released entries
+ */
+void file_cache_lru_push(struct file_cache *fc, struct file_cache_local *entry) {
+  file_cache_lru_remove(fc, entry);
+  entry->lru_prev = fc->lru_tail;
+  if (fc->lru_tail != NULL) {
+    fc->lru_tail->lru_next = entry;
+  } else {
+    fc->lru_head = entry;
+  }
+  fc->lru_tail = entry;
+}
+
+/**
+ * Take entry off the LRU list, if it is on it
+ */
+void file_cache_lru_remove(struct file_cache *fc, struct file_cache_local *entry) {
+  if (entry->lru_prev == NULL && fc->lru_head != entry) {
+    return;
+  }
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    fc->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    fc->lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+/*
+  Sidecar describing a local copy kept across releases and remounts:
+
+    bbfs-cache 2 <remote mtime> <remote size> <block size> <bitmap blocks>
+    <key>
+    <bitmap bytes>
+
+  The bitmap lists the blocks present in a lazily fetched copy and is
+  absent (blocks = -1) when the copy is complete. Its bits only mean
+  something for the block size they were written with.
+*/
+#define META_MAGIC "bbfs-cache 2"
+
+/**
+ * Record that the local copy of entry matches the remote file as of its
+ * last sync. Written to a temporary file and renamed into place, so a
+ * crash leaves either the old sidecar or the new one.
+ */
+int file_cache_save_meta(const struct file_cache_local *entry, const char *key, const char *metapath, size_t block_size) {
+  char tmppath[PATH_MAX];
+  if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", metapath) >= (int) sizeof(tmppath)) {
+    return -1;
+  }
+  FILE *f = fopen(tmppath, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  long long nblocks = entry->lazy ? (long long) entry->present.nblocks : -1;
+  fprintf(f, META_MAGIC " %lld %lld %zu %lld\n%s\n", (long long) entry->remote_mtime,
+          (long long) entry->remote_size, block_size, nblocks, key);
+  if (nblocks > 0) {
+    fwrite(entry->present.bits, 1, nblocks / 8, f);
+  }
+  if (ferror(f) | fclose(f)) {
+    unlink(tmppath);
+    return -1;
+  }
+  if (rename(tmppath, metapath) < 0) {
+    unlink(tmppath);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Read the sidecar at metapath and the key it was written for. Returns -1
+ * if it is missing or damaged, or describes a partial copy fetched in
+ * blocks of another size than block_size; 0 for a complete copy and 1 for
+ * a partial one, whose present blocks are then loaded into present.
+ */
+int file_cache_load_meta(const char *metapath, size_t block_size, char *key, size_t keysize, time_t *mtime, off_t *size,
+                         struct block_map *present) {
+  FILE *f = fopen(metapath, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  long long m, s, nblocks;
+  size_t saved_block;
+  if (fscanf(f, META_MAGIC " %lld %lld %zu %lld", &m, &s, &saved_block, &nblocks) != 4 || fgetc(f) != '\n'
+      || fgets(key, keysize, f) == NULL || key[strcspn(key, "\n")] != '\n') {
+    fclose(f);
+    return -1;
+  }
+  key[strcspn(key, "\n")] = '\0';
+  if (s < 0 || nblocks < -1 || (nblocks >= 0 && (nblocks % 8 != 0 || saved_block != block_size))) {
+    fclose(f);
+    return -1;
+  }
+  int rc = 0;
+  if (nblocks > 0) {
+    if (block_map_set(present, nblocks - 1, nblocks) < 0
+        || fread(present->bits, 1, nblocks / 8, f) != (size_t) nblocks / 8) {
+      block_map_clear(present);
+      rc = -1;
+    } else {
+      rc = 1;
+    }
+  } else if (nblocks == 0) {
+    rc = 1;
+  }
+  fclose(f);
+  *mtime = m;
+  *size = s;
+  return rc;
+}
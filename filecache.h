@@ -0,0 +1,104 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define CACHE_BUCKETS 4096
+#define PREFETCH_MAX 64
+
+// Where an entry is in the write-back queue
+#define FLUSH_NONE 0
+#define FLUSH_QUEUED 1
+#define FLUSH_RUNNING 2
+
+// Growable bitmap with one bit per fixed-size block of a file.
+struct block_map {
+  unsigned char *bits;
+  size_t nblocks;
+};
+
+int block_map_set(struct block_map *map, size_t first, size_t last);
+int block_map_test(const struct block_map *map, size_t block);
+void block_map_unset(struct block_map *map, size_t block);
+size_t block_map_count(const struct block_map *map);
+void block_map_clear(struct block_map *map);
+
+// A readahead block requested from the remote but not collected yet.
+struct prefetch_req {
+  size_t block;
+  uint32_t len;
+  uint32_t id;
+};
+
+struct file_cache_local {
+  char *remotepath;
+  char *localpath;
+  int access; // open handles, changed under the cache lock
+  int loading; // being fetched or revalidated by cache_open
+  pthread_mutex_t lock; // state below while the entry is open
+  int dirty; // local copy differs from the remote
+  struct block_map dirty_blocks; // blocks written since the last upload
+  int dirty_all; // block tracking was lost, the whole file must be sent
+  off_t remote_size; // size of the remote file at the last sync
+  time_t remote_mtime; // mtime of the remote file at the last sync
+  off_t trunc_size; // smallest size truncated to since the last sync
+  int lazy; // blocks are fetched from the remote on first access
+  struct block_map present; // blocks already fetched, lazy mode only
+  off_t fetch_limit; // bytes from here on are defined locally, never fetched
+  int fetch_fd; // read-write descriptor on the local copy, lazy mode only
+  void *remote_file; // sftp_file kept open for ranged reads, lazy mode only
+  void *remote_conn; // the connection remote_file belongs to
+  struct block_map prefetched; // blocks read ahead and not used yet
+  struct prefetch_req inflight[PREFETCH_MAX]; // readahead still on the wire
+  int ninflight;
+  unsigned long long disk_bytes; // space used by the local copy at its last release
+  int flush; // FLUSH_* state, changed under the cache lock
+  int deleted; // removed while open, discarded on the last release
+  struct file_cache_local *flush_next; // write-back queue
+  struct file_cache_local *next; // hash chain
+  struct file_cache_local *lru_prev, *lru_next; // released entries, oldest first
+};
+
+// File cache: remote path -> local copy. Entries are allocated one by one
+// and only linked into the hash chains, so a pointer to an entry stays
+// valid until that entry itself is removed. Entries no file handle refers
+// to are also on an LRU list, the candidates for eviction.
+struct file_cache {
+  struct file_cache_local *buckets[CACHE_BUCKETS];
+  struct file_cache_local *lru_head, *lru_tail;
+  int num_cache;
+  int max_cache; // entries kept before released ones are evicted
+  unsigned long long bytes; // disk_bytes summed over all entries
+  unsigned long long max_bytes; // local disk budget for released entries
+  unsigned long uploads; // releases that pushed a dirty file
+  unsigned long uploads_avoided; // releases of clean files
+  unsigned long long bytes_saved; // size of the clean files not pushed
+  unsigned long delta_uploads; // uploads that sent only dirty blocks
+  unsigned long long delta_bytes; // bytes sent by those uploads
+  unsigned long fetches; // ranged reads issued in lazy mode
+  unsigned long long fetch_bytes; // bytes received by those reads
+  unsigned long prefetch_issued; // blocks requested by readahead
+  unsigned long prefetch_hits; // of those, blocks later read
+  unsigned long long prefetch_wasted; // bytes read ahead and never read
+  unsigned long reused; // opens served by a persisted copy still current
+  unsigned long stale; // persisted copies found out of date on open
+  unsigned long evictions; // released entries dropped to stay within budget
+  unsigned long flushes; // uploads done by the write-back worker
+  unsigned long coalesced; // queued uploads merged into a later one by a reopen
+};
+
+void file_cache_init(struct file_cache *fc, int max_cache);
+struct file_cache_local *file_cache_find(struct file_cache *fc, const char *remotepath);
+struct file_cache_local *file_cache_insert(struct file_cache *fc, const char *remotepath, const char *localpath);
+void file_cache_remove(struct file_cache *fc, struct file_cache_local *entry);
+void file_cache_unhash(struct file_cache *fc, struct file_cache_local *entry);
+int file_cache_rekey(struct file_cache *fc, struct file_cache_local *entry, const char *remotepath, const char *localpath);
+void file_cache_lru_push(struct file_cache *fc, struct file_cache_local *entry);
+void file_cache_lru_remove(struct file_cache *fc, struct file_cache_local *entry);
+
+int file_cache_save_meta(const struct file_cache_local *entry, const char *key, const char *metapath, size_t block_size);
+int file_cache_load_meta(const char *metapath, size_t block_size, char *key, size_t keysize, time_t *mtime, off_t *size,
+                         struct block_map *present);
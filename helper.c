@@ -0,0 +1,410 @@
+/*
+  Remote helper protocol
+
+  bbfs-helper runs on the remote host and answers requests about its file
+  system directly, so a readdir comes back with every entry's attributes
+  in one reply, a partial overwrite is a single write request, and an
+  upload can first ask which blocks already match. This file holds the
+  framing both ends share and the client calls bbfs makes.
+
+  The client does one request at a time under the lock; the helper serves
+  them in order on a single channel.
+*/
+
+#include "helper.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int helper_grow(struct helper_buf *b, size_t len) {
+  if (b->bad) {
+    return -1;
+  }
+  if (b->cap - b->len >= len) {
+    return 0;
+  }
+  size_t cap = b->cap > 0 ? b->cap : 256;
+  while (cap - b->len < len) {
+    cap *= 2;
+  }
+  unsigned char *data = realloc(b->data, cap);
+  if (data == NULL) {
+    b->bad = 1;
+    return -1;
+  }
+  b->data = data;
+  b->cap = cap;
+  return 0;
+}
+
+void helper_put32(struct helper_buf *b, uint32_t v) {
+  if (helper_grow(b, 4) < 0) {
+    return;
+  }
+  unsigned char *q = b->data + b->len;
+  q[0] = v >> 24;
+  q[1] = v >> 16;
+  q[2] = v >> 8;
+  q[3] = v;
+  b->len += 4;
+}
+
+void helper_put64(struct helper_buf *b, uint64_t v) {
+  helper_put32(b, v >> 32);
+  helper_put32(b, v);
+}
+
+void helper_put_bytes(struct helper_buf *b, const void *data, size_t len) {
+  helper_put32(b, len);
+  if (helper_grow(b, len) < 0) {
+    return;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+void helper_put_string(struct helper_buf *b, const char *s) {
+  helper_put_bytes(b, s, strlen(s));
+}
+
+void helper_put_stat(struct helper_buf *b, const struct stat *statbuf) {
+  helper_put32(b, statbuf->st_mode);
+  helper_put32(b, statbuf->st_nlink);
+  helper_put32(b, statbuf->st_uid);
+  helper_put32(b, statbuf->st_gid);
+  helper_put64(b, statbuf->st_ino);
+  helper_put64(b, statbuf->st_size);
+  helper_put64(b, statbuf->st_atime);
+  helper_put64(b, statbuf->st_mtime);
+  helper_put64(b, statbuf->st_ctime);
+}
+
+uint32_t helper_get32(struct helper_buf *b) {
+  if (b->bad || b->len - b->pos < 4) {
+    b->bad = 1;
+    return 0;
+  }
+  const unsigned char *q = b->data + b->pos;
+  b->pos += 4;
+  return (uint32_t) q[0] << 24 | (uint32_t) q[1] << 16 | (uint32_t) q[2] << 8 | q[3];
+}
+
+uint64_t helper_get64(struct helper_buf *b) {
+  uint64_t hi = helper_get32(b);
+  return hi << 32 | helper_get32(b);
+}
+
+/**
+ * A length-prefixed run of bytes, left in place. NULL if it is cut short.
+ */
+const unsigned char *helper_get_bytes(struct helper_buf *b, uint32_t *len) {
+  *len = helper_get32(b);
+  if (b->bad || b->len - b->pos < *len) {
+    b->bad = 1;
+    return NULL;
+  }
+  const unsigned char *data = b->data + b->pos;
+  b->pos += *len;
+  return data;
+}
+
+/**
+ * Copy a string into s. Returns 0, or -1 if it is cut short or does not
+ * fit in size bytes with its NUL.
+ */
+int helper_get_string(struct helper_buf *b, char *s, size_t size) {
+  uint32_t len;
+  const unsigned char *data = helper_get_bytes(b, &len);
+  if (data == NULL || len >= size || memchr(data, '\0', len) != NULL) {
+    b->bad = 1;
+    return -1;
+  }
+  memcpy(s, data, len);
+  s[len] = '\0';
+  return 0;
+}
+
+void helper_get_stat(struct helper_buf *b, struct stat *statbuf) {
+  memset(statbuf, 0, sizeof(struct stat));
+  statbuf->st_mode = helper_get32(b);
+  statbuf->st_nlink = helper_get32(b);
+  statbuf->st_uid = helper_get32(b);
+  statbuf->st_gid = helper_get32(b);
+  statbuf->st_ino = helper_get64(b);
+  statbuf->st_size = helper_get64(b);
+  statbuf->st_atime = helper_get64(b);
+  statbuf->st_mtime = helper_get64(b);
+  statbuf->st_ctime = helper_get64(b);
+  statbuf->st_blocks = (statbuf->st_size + 511) / 512;
+}
+
+static const uint32_t helper_sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define HELPER_ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void helper_sha256_block(uint32_t state[8], const unsigned char *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = HELPER_ROR(w[i - 15], 7) ^ HELPER_ROR(w[i - 15], 18) ^ w[i - 15] >> 3;
+    uint32_t s1 = HELPER_ROR(w[i - 2], 17) ^ HELPER_ROR(w[i - 2], 19) ^ w[i - 2] >> 10;
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (HELPER_ROR(e, 6) ^ HELPER_ROR(e, 11) ^ HELPER_ROR(e, 25)) + ((e & f) ^ (~e & g))
+                  + helper_sha256_k[i] + w[i];
+    uint32_t t2 = (HELPER_ROR(a, 2) ^ HELPER_ROR(a, 13) ^ HELPER_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+ * SHA-256 of data, the block digest both ends compare. A collision would
+ * leave a changed block unsent, so the digest has to be a cryptographic one.
+ */
+void helper_digest(const unsigned char *data, size_t len, unsigned char digest[HELPER_DIGEST_SIZE]) {
+  uint32_t state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  size_t done = 0;
+  for (; len - done >= 64; done += 64) {
+    helper_sha256_block(state, data + done);
+  }
+  // the rest, a 1 bit, zeros and the length in bits fill one or two blocks
+  unsigned char tail[128] = {0};
+  size_t rest = len - done;
+  memcpy(tail, data + done, rest);
+  tail[rest] = 0x80;
+  size_t tail_len = rest < 56 ? 64 : 128;
+  uint64_t bits = (uint64_t) len * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_len - 1 - i] = (unsigned char) (bits >> (8 * i));
+  }
+  for (size_t i = 0; i < tail_len; i += 64) {
+    helper_sha256_block(state, tail + i);
+  }
+  for (int i = 0; i < 8; i++) {
+    digest[4 * i] = (unsigned char) (state[i] >> 24);
+    digest[4 * i + 1] = (unsigned char) (state[i] >> 16);
+    digest[4 * i + 2] = (unsigned char) (state[i] >> 8);
+    digest[4 * i + 3] = (unsigned char) state[i];
+  }
+}
+
+/**
+ * Send a request of op with the arguments in args and wait for its reply.
+ * On success the results are left in reply, which the caller frees.
+ * Returns the reply status, or -ENOTCONN once the helper is gone.
+ */
+static int helper_call(struct helper *h, unsigned char op, struct helper_buf *args, struct helper_buf *reply) {
+  memset(reply, 0, sizeof(struct helper_buf));
+  if (args->bad) {
+    free(args->data);
+    return -ENOMEM;
+  }
+  unsigned char head[12];
+  uint32_t len = 5 + args->len;
+  head[0] = len >> 24;
+  head[1] = len >> 16;
+  head[2] = len >> 8;
+  head[3] = len;
+  head[4] = op;
+  pthread_mutex_lock(&h->lock);
+  int retstat = -ENOTCONN;
+  uint32_t id = h->next_id++;
+  head[5] = id >> 24;
+  head[6] = id >> 16;
+  head[7] = id >> 8;
+  head[8] = id;
+  if (!h->broken && h->send(h->ctx, head, 9) == 0 && h->send(h->ctx, args->data, args->len) == 0
+      && h->recv(h->ctx, head, sizeof(head)) == 0) {
+    struct helper_buf in = {head, sizeof(head), sizeof(head), 0, 0};
+    len = helper_get32(&in);
+    uint32_t got = helper_get32(&in);
+    int32_t status = (int32_t) helper_get32(&in);
+    if (len >= 8 && len <= HELPER_FRAME_MAX && got == id
+        && helper_grow(reply, len - 8) == 0 && h->recv(h->ctx, reply->data, len - 8) == 0) {
+      reply->len = len - 8;
+      retstat = status;
+    }
+  }
+  if (retstat == -ENOTCONN) {
+    // a lost or garbled reply leaves the stream out of step for good
+    h->broken = 1;
+    free(reply->data);
+    reply->data = NULL;
+  }
+  h->requests++;
+  pthread_mutex_unlock(&h->lock);
+  free(args->data);
+  return retstat;
+}
+
+/**
+ * Check that the other end speaks this protocol. Returns 0, or -1 if it
+ * does not answer or answers with another version.
+ */
+int helper_open(struct helper *h) {
+  pthread_mutex_init(&h->lock, NULL);
+  h->next_id = 1;
+  h->broken = 0;
+  h->requests = 0;
+  struct helper_buf args = {0}, reply;
+  helper_put32(&args, HELPER_VERSION);
+  int retstat = helper_call(h, HELPER_HELLO, &args, &reply);
+  uint32_t version = helper_get32(&reply);
+  free(reply.data);
+  if (retstat < 0 || reply.bad || version != HELPER_VERSION) {
+    h->broken = 1;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Attributes of path, not following a final symlink
+ */
+int helper_stat(struct helper *h, const char *path, struct stat *statbuf) {
+  struct helper_buf args = {0}, reply;
+  helper_put_string(&args, path);
+  int retstat = helper_call(h, HELPER_STAT, &args, &reply);
+  if (retstat == 0) {
+    helper_get_stat(&reply, statbuf);
+    retstat = reply.bad ? -EIO : 0;
+  }
+  free(reply.data);
+  return retstat;
+}
+
+/**
+ * Call fill with the name and attributes of every entry of the directory
+ * at path, except . and .., until it returns nonzero
+ */
+int helper_readdir(struct helper *h, const char *path,
+                   int (*fill)(void *arg, const char *name, const struct stat *statbuf), void *arg) {
+  struct helper_buf args = {0}, reply;
+  helper_put_string(&args, path);
+  int retstat = helper_call(h, HELPER_READDIR, &args, &reply);
+  if (retstat == 0) {
+    uint32_t count = helper_get32(&reply);
+    for (uint32_t i = 0; i < count && !reply.bad; i++) {
+      char name[256];
+      struct stat statbuf;
+      helper_get_string(&reply, name, sizeof(name));
+      helper_get_stat(&reply, &statbuf);
+      if (!reply.bad && fill(arg, name, &statbuf) != 0) {
+        break;
+      }
+    }
+    retstat = reply.bad ? -EIO : 0;
+  }
+  free(reply.data);
+  return retstat;
+}
+
+/**
+ * Read up to size bytes of path at offset, at most HELPER_IO_MAX per
+ * request. Returns the bytes read, 0 at the end of the file.
+ */
+ssize_t helper_read(struct helper *h, const char *path, void *buf, size_t size, off_t offset) {
+  size = size < HELPER_IO_MAX ? size : HELPER_IO_MAX;
+  struct helper_buf args = {0}, reply;
+  helper_put_string(&args, path);
+  helper_put64(&args, offset);
+  helper_put32(&args, size);
+  ssize_t retstat = helper_call(h, HELPER_READ, &args, &reply);
+  if (retstat == 0) {
+    uint32_t len;
+    const unsigned char *data = helper_get_bytes(&reply, &len);
+    if (data == NULL || len > size) {
+      retstat = -EIO;
+    } else {
+      memcpy(buf, data, len);
+      retstat = len;
+    }
+  }
+  free(reply.data);
+  return retstat;
+}
+
+/**
+ * Write size bytes to the existing file at path at offset, at most
+ * HELPER_IO_MAX per request. Returns the bytes written.
+ */
+ssize_t helper_write(struct helper *h, const char *path, const void *buf, size_t size, off_t offset) {
+  size = size < HELPER_IO_MAX ? size : HELPER_IO_MAX;
+  struct helper_buf args = {0}, reply;
+  helper_put_string(&args, path);
+  helper_put64(&args, offset);
+  helper_put_bytes(&args, buf, size);
+  ssize_t retstat = helper_call(h, HELPER_WRITE, &args, &reply);
+  if (retstat == 0) {
+    retstat = helper_get32(&reply);
+    if (reply.bad || (size_t) retstat > size) {
+      retstat = -EIO;
+    }
+  }
+  free(reply.data);
+  return retstat;
+}
+
+/**
+ * Digests of count blocks of block bytes of path, starting with block
+ * first, HELPER_DIGEST_SIZE bytes each. Blocks past the end of the file
+ * hash what is left of them, which is nothing for those wholly beyond it.
+ */
+int helper_hash_blocks(struct helper *h, const char *path, uint64_t first, uint32_t count,
+                       uint32_t block, unsigned char *digests) {
+  struct helper_buf args = {0}, reply;
+  helper_put_string(&args, path);
+  helper_put64(&args, first);
+  helper_put32(&args, count);
+  helper_put32(&args, block);
+  int retstat = helper_call(h, HELPER_HASH, &args, &reply);
+  if (retstat == 0) {
+    uint32_t len;
+    const unsigned char *data = helper_get_bytes(&reply, &len);
+    if (data == NULL || len != (size_t) count * HELPER_DIGEST_SIZE) {
+      retstat = -EIO;
+    } else {
+      memcpy(digests, data, len);
+    }
+  }
+  free(reply.data);
+  return retstat;
+}
+
+int helper_truncate(struct helper *h, const char *path, off_t size) {
+  struct helper_buf args = {0}, reply;
+  helper_put_string(&args, path);
+  helper_put64(&args, size);
+  int retstat = helper_call(h, HELPER_TRUNCATE, &args, &reply);
+  free(reply.data);
+  return retstat;
+}
+
+int helper_rename(struct helper *h, const char *path, const char *newpath) {
+  struct helper_buf args = {0}, reply;
+  helper_put_string(&args, path);
+  helper_put_string(&args, newpath);
+  int retstat = helper_call(h, HELPER_RENAME, &args, &reply);
+  free(reply.data);
+  return retstat;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define HELPER_VERSION 2
+#define HELPER_FRAME_MAX (8 << 20)
+#define HELPER_IO_MAX (1 << 20)
+#define HELPER_HASH_BATCH 4096
+#define HELPER_DIGEST_SIZE 32
+#define HELPER_STAT_SIZE 56
+
+// Wire format. A request is a u32 length of what follows, a u8 op, a u32
+// id and the arguments; a reply is a u32 length, the u32 id, an i32 status
+// (0 or a negative errno) and the results. Integers are big-endian,
+// strings and byte runs a u32 length and the bytes, and a stat takes
+// HELPER_STAT_SIZE bytes.
+enum helper_op {
+  HELPER_HELLO, // version -> version
+  HELPER_STAT, // path -> stat, of a symlink itself
+  HELPER_READDIR, // path -> count, then name and stat per entry
+  HELPER_READ, // path, offset u64, size u32 -> bytes
+  HELPER_WRITE, // path, offset u64, bytes -> written u32
+  HELPER_HASH, // path, first block u64, count u32, block size u32 -> bytes, a SHA-256 digest each
+  HELPER_TRUNCATE, // path, size u64
+  HELPER_RENAME, // path, new path
+};
+
+// A message being built or taken apart
+struct helper_buf {
+  unsigned char *data;
+  size_t len, cap;
+  size_t pos; // read position
+  int bad; // a read ran past the end, or a write could not grow the buffer
+};
+
+void helper_put32(struct helper_buf *b, uint32_t v);
+void helper_put64(struct helper_buf *b, uint64_t v);
+void helper_put_bytes(struct helper_buf *b, const void *data, size_t len);
+void helper_put_string(struct helper_buf *b, const char *s);
+void helper_put_stat(struct helper_buf *b, const struct stat *statbuf);
+uint32_t helper_get32(struct helper_buf *b);
+uint64_t helper_get64(struct helper_buf *b);
+const unsigned char *helper_get_bytes(struct helper_buf *b, uint32_t *len);
+int helper_get_string(struct helper_buf *b, char *s, size_t size);
+void helper_get_stat(struct helper_buf *b, struct stat *statbuf);
+void helper_digest(const unsigned char *data, size_t len, unsigned char digest[HELPER_DIGEST_SIZE]);
+
+// The client end. send and recv move bytes over whatever carries the
+// protocol: an ssh channel to the helper on the remote, or pipes to one
+// started locally.
+struct helper {
+  int (*send)(void *ctx, const void *data, size_t len); // 0, or -1 on failure
+  int (*recv)(void *ctx, void *data, size_t len); // exactly len bytes, 0 or -1
+  void *ctx;
+  pthread_mutex_t lock;
+  uint32_t next_id;
+  int broken;
+  unsigned long requests;
+};
+
+int helper_open(struct helper *h);
+int helper_stat(struct helper *h, const char *path, struct stat *statbuf);
+int helper_readdir(struct helper *h, const char *path,
+                   int (*fill)(void *arg, const char *name, const struct stat *statbuf), void *arg);
+ssize_t helper_read(struct helper *h, const char *path, void *buf, size_t size, off_t offset);
+ssize_t helper_write(struct helper *h, const char *path, const void *buf, size_t size, off_t offset);
+int helper_hash_blocks(struct helper *h, const char *path, uint64_t first, uint32_t count,
+                       uint32_t block, unsigned char *digests);
+int helper_truncate(struct helper *h, const char *path, off_t size);
+int helper_rename(struct helper *h, const char *path, const char *newpath);
@@ -6,8 +6,53 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "log.h"
+#include "logbuf.h"
+
+/*
+  Unless -o log_text is given, log lines are not formatted where they are
+  logged. Each thread appends binary records (see logbuf.h) to a ring of
+  its own, without locks, and a writer thread moves them to the log file
+  every LOGBUF_FLUSH_MS. A thread that finds its ring full moves the
+  records itself. Lines of one thread stay together in the file; lines
+  of different threads are interleaved per flush. The ring of a thread
+  that exits is freed by the writer once it has been drained.
+*/
+
+// One thread's records. head is only advanced by the thread, tail only by
+// whoever holds log_drain_lock. Rings are pushed onto log_rings by their
+// threads and only taken off it under log_drain_lock.
+struct log_ring {
+  char data[LOGBUF_RING];
+  uint64_t head, tail;
+  int retired; // the thread exited, head does not move any more
+  struct log_ring *next;
+};
+
+// Formats already seen, so the argument types are parsed once per thread
+struct log_format {
+  const char *format;
+  int nargs;
+  unsigned char args[LOGBUF_ARGS_MAX];
+};
+
+#define LOG_FORMATS 64 // formats remembered per thread
+#define LOG_WRITTEN 8192 // formats the writer remembers having written
+
+static struct log_ring *log_rings;
+static __thread struct log_ring *log_ring;
+static __thread struct log_format log_formats[LOG_FORMATS];
+static __thread char log_scratch[LOGBUF_RECORD_MAX];
+
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key; // runs log_retire when a thread with a ring exits
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t log_thread;
+static int log_running, log_stopping, log_header;
+static const char *log_written[LOG_WRITTEN];
 
 FILE *log_open(char *logFile) {
   FILE *logfile;
@@ -23,31 +68,306 @@ FILE *log_open(char *logFile) {
   return logfile;
 }
 
-void log_command(const char *format, ...) {
+/**
+ * Copy len bytes between a ring and a flat buffer, wrapping at the end of
+ * the ring
+ */
+static void log_ring_copy(char *ring, uint64_t pos, char *flat, size_t len, int to_ring) {
+  size_t at = pos & (LOGBUF_RING - 1);
+  size_t first = LOGBUF_RING - at < len ? LOGBUF_RING - at : len;
+  if (to_ring) {
+    memcpy(ring + at, flat, first);
+    memcpy(ring, flat + first, len - first);
+  } else {
+    memcpy(flat, ring + at, first);
+    memcpy(flat + first, ring, len - first);
+  }
+}
+
+/**
+ * Write a format record to the log file, unless one was written before.
+ * Called with log_drain_lock held.
+ */
+static void log_write_format(const char *format) {
+  size_t slot = ((uintptr_t) format >> 3) % LOG_WRITTEN;
+  for (size_t probe = 0; probe < LOG_WRITTEN; probe++, slot = (slot + 1) % LOG_WRITTEN) {
+    if (log_written[slot] == format) {
+      return;
+    }
+    if (log_written[slot] == NULL) {
+      log_written[slot] = format;
+      break;
+    }
+  }
+  // with the table full, the format is written again each time
+  size_t len = strlen(format);
+  struct logbuf_record rec = {sizeof(rec) + len, LOGBUF_FORMAT, 0, 0, 0, (uintptr_t) format};
+  fwrite(&rec, sizeof(rec), 1, BB_DATA->logfile);
+  fwrite(format, 1, len, BB_DATA->logfile);
+}
+
+/**
+ * Take the drained ring r off log_rings and free it. link points at the
+ * pointer to r, as far as the drain got. Returns where the next ring
+ * hangs off. Called with log_drain_lock held.
+ */
+static struct log_ring **log_unlink(struct log_ring **link, struct log_ring *r) {
+  if (link == &log_rings) {
+    struct log_ring *expected = r;
+    if (__atomic_compare_exchange_n(&log_rings, &expected, r->next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      free(r);
+      return link;
+    }
+    // rings were pushed in front of it meanwhile, but none behind
+    link = &expected->next;
+    while (*link != r) {
+      link = &(*link)->next;
+    }
+  }
+  *link = r->next;
+  free(r);
+  return link;
+}
+
+/**
+ * Move the records of every ring to the log file, and free the rings of
+ * threads that exited. Called with log_drain_lock held.
+ */
+static void log_drain(void) {
+  static char rec[LOGBUF_RECORD_MAX];
+  if (!log_header) {
+    // records are written in batches, so the line buffering is dropped
+    setvbuf(BB_DATA->logfile, NULL, _IOFBF, 1 << 16);
+    fwrite(LOGBUF_MAGIC, 1, strlen(LOGBUF_MAGIC), BB_DATA->logfile);
+    log_header = 1;
+  }
+  struct log_ring **link = &log_rings, *r;
+  while ((r = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL) {
+    // read before head, so a retired ring is drained to its last record
+    int retired = __atomic_load_n(&r->retired, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    while (tail < head) {
+      struct logbuf_record *hdr = (struct logbuf_record *) rec;
+      log_ring_copy(r->data, tail, rec, sizeof(struct logbuf_record), 0);
+      log_ring_copy(r->data, tail, rec, hdr->len, 0);
+      log_write_format((const char *) (uintptr_t) hdr->key);
+      fwrite(rec, 1, hdr->len, BB_DATA->logfile);
+      tail += hdr->len;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    link = retired ? log_unlink(link, r) : &r->next;
+  }
+  fflush(BB_DATA->logfile);
+}
+
+/**
+ * The argument types of format, parsed on its first use by this thread
+ */
+static struct log_format *log_format_of(const char *format) {
+  struct log_format *f = &log_formats[((uintptr_t) format >> 3) % LOG_FORMATS];
+  if (f->format == format) {
+    return f;
+  }
+  f->format = format;
+  f->nargs = 0;
+  struct logbuf_spec spec;
+  for (const char *p = format; (p = logbuf_next_spec(p, &spec)) != NULL; ) {
+    for (int i = 0; i < spec.stars && f->nargs < LOGBUF_ARGS_MAX; i++) {
+      f->args[f->nargs++] = LOGBUF_ARG_INT;
+    }
+    if (spec.arg != LOGBUF_ARG_NONE && f->nargs < LOGBUF_ARGS_MAX) {
+      f->args[f->nargs++] = spec.arg;
+    }
+  }
+  return f;
+}
+
+/**
+ * The calling thread exits: its ring is left to the writer to drain and
+ * free
+ */
+static void log_retire(void *arg) {
+  struct log_ring *r = arg;
+  log_ring = NULL;
+  __atomic_store_n(&r->retired, 1, __ATOMIC_RELEASE);
+}
+
+static void log_key_create(void) {
+  pthread_key_create(&log_key, log_retire);
+}
+
+/**
+ * Append a record of format and its arguments to the calling thread's
+ * ring
+ */
+static void log_record(int command, const char *format, va_list ap) {
+  struct log_ring *r = log_ring;
+  if (r == NULL) {
+    r = calloc(1, sizeof(struct log_ring));
+    if (r == NULL) {
+      return;
+    }
+    pthread_once(&log_key_once, log_key_create);
+    r->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+    log_ring = r;
+    pthread_setspecific(log_key, r);
+  }
+
+  struct log_format *f = log_format_of(format);
+  struct logbuf_record *rec = (struct logbuf_record *) log_scratch;
+  char *q = log_scratch + sizeof(struct logbuf_record);
+  char *end = log_scratch + LOGBUF_RECORD_MAX;
+  for (int i = 0; i < f->nargs; i++) {
+    uint64_t v = 0;
+    double d;
+    switch (f->args[i]) {
+      case LOGBUF_ARG_INT: v = (int64_t) va_arg(ap, int); break;
+      case LOGBUF_ARG_LONG: v = (int64_t) va_arg(ap, long); break;
+      case LOGBUF_ARG_LLONG: v = (int64_t) va_arg(ap, long long); break;
+      case LOGBUF_ARG_INTMAX: v = (int64_t) va_arg(ap, intmax_t); break;
+      case LOGBUF_ARG_SIZE: v = (uint64_t) va_arg(ap, size_t); break;
+      case LOGBUF_ARG_PTRDIFF: v = (int64_t) va_arg(ap, ptrdiff_t); break;
+      case LOGBUF_ARG_PTR: v = (uintptr_t) va_arg(ap, void *); break;
+      case LOGBUF_ARG_DOUBLE:
+      case LOGBUF_ARG_LDOUBLE:
+        d = f->args[i] == LOGBUF_ARG_DOUBLE ? va_arg(ap, double) : (double) va_arg(ap, long double);
+        memcpy(&v, &d, sizeof(v));
+        break;
+      case LOGBUF_ARG_STR: {
+        const char *s = va_arg(ap, const char *);
+        s = s != NULL ? s : "(null)";
+        // room is kept for the numbers that may follow
+        size_t room = end - q - 4 - 8 * (f->nargs - i);
+        size_t len = strnlen(s, room);
+        uint32_t len32 = len;
+        memcpy(q, &len32, 4);
+        memcpy(q + 4, s, len);
+        q += 4 + len;
+        continue;
+      }
+    }
+    memcpy(q, &v, 8);
+    q += 8;
+  }
+  rec->len = q - log_scratch;
+  rec->type = LOGBUF_EVENT;
+  rec->command = command;
+  rec->pad = 0;
+  rec->time = 0;
+  rec->key = (uintptr_t) format;
+  if (command) {
+    struct timeval timestamp;
+    gettimeofday(&timestamp, NULL);
+    rec->time = (uint64_t) 1000000 * timestamp.tv_sec + timestamp.tv_usec;
+  }
+
+  uint64_t head = r->head;
+  if (LOGBUF_RING - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) < rec->len) {
+    // the writer is behind, or not running yet
+    pthread_mutex_lock(&log_drain_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_drain_lock);
+  }
+  log_ring_copy(r->data, head, log_scratch, rec->len, 1);
+  __atomic_store_n(&r->head, head + rec->len, __ATOMIC_RELEASE);
+}
+
+static void *log_writer(void *arg) {
+  pthread_mutex_lock(&log_drain_lock);
+  while (!log_stopping) {
+    log_drain();
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LOGBUF_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&log_wake, &log_drain_lock, &deadline);
+  }
+  log_drain();
+  pthread_mutex_unlock(&log_drain_lock);
+  return NULL;
+}
+
+/**
+ * Start the thread that writes out buffered records. Until it runs,
+ * records are written when a ring fills up or by log_flush.
+ */
+void log_start(void) {
+  if (BB_DATA->log_text || log_running) {
+    return;
+  }
+  if (pthread_create(&log_thread, NULL, log_writer, NULL) == 0) {
+    log_running = 1;
+  }
+}
+
+/**
+ * Write out everything buffered, stopping the writer thread if it runs
+ */
+void log_flush(void) {
+  if (BB_DATA->log_text) {
+    return;
+  }
+  if (log_running) {
+    pthread_mutex_lock(&log_drain_lock);
+    log_stopping = 1;
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_drain_lock);
+    pthread_join(log_thread, NULL);
+    log_running = 0;
+    log_stopping = 0;
+  }
+  pthread_mutex_lock(&log_drain_lock);
+  log_drain();
+  pthread_mutex_unlock(&log_drain_lock);
+}
+
+void log_write_command(const char *format, ...) {
   va_list ap;
   va_start(ap, format);
+  if (!BB_DATA->log_text) {
+    log_record(1, format, ap);
+    va_end(ap);
+    return;
+  }
   struct timeval timestamp;
   gettimeofday(&timestamp, NULL);
+  // one line even with the write-back worker logging at the same time
+  flockfile(BB_DATA->logfile);
   fprintf(BB_DATA->logfile, "%lu ", (unsigned long) 1000000 * timestamp.tv_sec + timestamp.tv_usec);
   vfprintf(BB_DATA->logfile, format, ap);
   fprintf(BB_DATA->logfile, "\n");
+  funlockfile(BB_DATA->logfile);
+  va_end(ap);
 }
 
-void log_msg(const char *format, ...) {
+void log_write_msg(const char *format, ...) {
   va_list ap;
   va_start(ap, format);
-
-  vfprintf(BB_DATA->logfile, format, ap);
+  if (BB_DATA->log_text) {
+    vfprintf(BB_DATA->logfile, format, ap);
+  } else {
+    log_record(0, format, ap);
+  }
+  va_end(ap);
 }
 
 int log_error(char *func) {
   int ret = -errno;
-  log_msg("    ERROR %s: %s\n", func, strerror(errno));
+  log_failure("    ERROR %s: %s\n", func, strerror(errno));
   return ret;
 }
 
 // fuse context
 void log_fuse_context(struct fuse_context *context) {
+  if (!log_enabled(BB_LOG_DEBUG)) {
+    return;
+  }
   log_msg("    context:\n");
 
   /** Pointer to the fuse object */
@@ -80,6 +400,9 @@ void log_fuse_context(struct fuse_context *context) {
 // struct fuse_conn_info contains information about the socket
 // connection being used.
 void log_conn(struct fuse_conn_info *conn) {
+  if (!log_enabled(BB_LOG_DEBUG)) {
+    return;
+  }
   log_msg("    conn:\n");
 
   /** Major version of the protocol (read-only) */
@@ -126,7 +449,7 @@ void log_conn(struct fuse_conn_info *conn) {
 // This dumps all the information in a struct fuse_file_info.  The struct
 // definition, and comments, come from /usr/include/fuse/fuse_common.h
 // Duplicated here for convenience.
-void log_fi (struct fuse_file_info *fi) {
+void log_write_fi(struct fuse_file_info *fi) {
   log_msg("    fi:\n");
 
   /** Open flags.  Available in open() and release() */
@@ -167,7 +490,7 @@ void log_fi (struct fuse_file_info *fi) {
 
 void log_retstat(char *func, int retstat) {
   int errsave = errno;
-  log_msg("    %s returned %d\n", func, retstat);
+  log_debug("    %s returned %d\n", func, retstat);
   errno = errsave;
 }
 
@@ -182,7 +505,7 @@ int log_syscall(char *func, int retstat, int min_ret) {
   return retstat;
 }
 
-void log_stat(struct stat *si) {
+void log_write_stat(struct stat *si) {
   log_msg("    si:\n");
 
   //  dev_t     st_dev;     /* ID of device containing file */
@@ -227,6 +550,9 @@ void log_stat(struct stat *si) {
 }
 
 void log_statvfs(struct statvfs *sv) {
+  if (!log_enabled(BB_LOG_DEBUG)) {
+    return;
+  }
   log_msg("    sv:\n");
 
   //  unsigned long  f_bsize;    /* file system block size */
@@ -265,6 +591,9 @@ void log_statvfs(struct statvfs *sv) {
 }
 
 void log_utime(struct utimbuf *buf) {
+  if (!log_enabled(BB_LOG_DEBUG)) {
+    return;
+  }
   log_msg("    buf:\n");
 
   //    time_t actime;
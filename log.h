@@ -2,18 +2,42 @@
 #define _LOG_H_
 #include <stdio.h>
 
+// Log levels, each including the ones before it
+#define BB_LOG_OFF 0
+#define BB_LOG_ERROR 1 // failures, and the fallbacks taken because of them
+#define BB_LOG_INFO 2 // one line per operation, cache and transfer decisions
+#define BB_LOG_DEBUG 3 // reads, writes, path resolution, return values, struct dumps
+
+// Messages above BB_LOG_MAX are compiled out. Below it, -o log_level
+// decides, before any argument is formatted or copied.
+#ifndef BB_LOG_MAX
+#define BB_LOG_MAX BB_LOG_DEBUG
+#endif
+#define log_enabled(level) ((level) <= BB_LOG_MAX && (level) <= BB_DATA->log_level)
+
+#define log_command_at(level, ...) do { if (log_enabled(level)) log_write_command(__VA_ARGS__); } while (0)
+#define log_msg_at(level, ...) do { if (log_enabled(level)) log_write_msg(__VA_ARGS__); } while (0)
+#define log_command(...) log_command_at(BB_LOG_INFO, __VA_ARGS__)
+#define log_msg(...) log_msg_at(BB_LOG_INFO, __VA_ARGS__)
+#define log_failure(...) log_msg_at(BB_LOG_ERROR, __VA_ARGS__)
+#define log_debug(...) log_msg_at(BB_LOG_DEBUG, __VA_ARGS__)
+#define log_fi(fi) do { if (log_enabled(BB_LOG_DEBUG)) log_write_fi(fi); } while (0)
+#define log_stat(si) do { if (log_enabled(BB_LOG_DEBUG)) log_write_stat(si); } while (0)
+
 // Log fields in structs.
 #define log_struct(st, field, format, typecast) log_msg("    " #field " = " #format "\n", typecast st->field)
 
 FILE *log_open(char *logFile);
-void log_msg(const char *format, ...);
-void log_command(const char *format, ...);
+void log_start(void);
+void log_flush(void);
+void log_write_msg(const char *format, ...);
+void log_write_command(const char *format, ...);
 void log_conn(struct fuse_conn_info *conn);
 int log_error(char *func);
-void log_fi(struct fuse_file_info *fi);
+void log_write_fi(struct fuse_file_info *fi);
 void log_fuse_context(struct fuse_context *context);
 void log_retstat(char *func, int retstat);
-void log_stat(struct stat *si);
+void log_write_stat(struct stat *si);
 void log_statvfs(struct statvfs *sv);
 int  log_syscall(char *func, int retstat, int min_ret);
 void log_utime(struct utimbuf *buf);
@@ -0,0 +1,81 @@
+/*
+  Binary log records
+
+  The log writes each call as its format string's address and the raw
+  argument values instead of formatted text, so logging costs a copy
+  into a ring rather than vfprintf and a write. bbfs-logdump formats the
+  records later with the same format strings. Both ends find the
+  arguments of a format with logbuf_next_spec.
+*/
+
+#include "logbuf.h"
+
+#include <string.h>
+
+/**
+ * Find the next conversion in the format at p. Returns the position after
+ * it, or NULL when there are no more; spec->start is then the end of the
+ * format, and the text before it is literal either way.
+ */
+const char *logbuf_next_spec(const char *p, struct logbuf_spec *spec) {
+  const char *q = strchr(p, '%');
+  if (q == NULL) {
+    spec->start = p + strlen(p);
+    spec->len = 0;
+    return NULL;
+  }
+  spec->start = q++;
+  spec->stars = 0;
+  spec->arg = LOGBUF_ARG_NONE;
+  while (*q != '\0' && strchr("-+ #0'", *q) != NULL) {
+    q++;
+  }
+  for (int part = 0; part < 2; part++) {
+    if (part == 1) {
+      if (*q != '.') {
+        break;
+      }
+      q++;
+    }
+    if (*q == '*') {
+      spec->stars++;
+      q++;
+    }
+    while (*q >= '0' && *q <= '9') {
+      q++;
+    }
+  }
+  enum logbuf_arg integer = LOGBUF_ARG_INT;
+  int ldouble = 0;
+  if (q[0] == 'h') {
+    q += q[1] == 'h' ? 2 : 1;
+  } else if (q[0] == 'l' && q[1] == 'l') {
+    integer = LOGBUF_ARG_LLONG;
+    q += 2;
+  } else if (*q == 'l' || *q == 'q' || *q == 'j' || *q == 'z' || *q == 't' || *q == 'L') {
+    integer = *q == 'l' ? LOGBUF_ARG_LONG : *q == 'q' ? LOGBUF_ARG_LLONG : *q == 'j' ? LOGBUF_ARG_INTMAX
+              : *q == 'z' ? LOGBUF_ARG_SIZE : *q == 't' ? LOGBUF_ARG_PTRDIFF : LOGBUF_ARG_INT;
+    ldouble = *q == 'L';
+    q++;
+  }
+  spec->conv = *q;
+  if (*q == '\0') {
+    // a lone % at the end is left as text
+    spec->stars = 0;
+  } else if (strchr("diouxXc", *q) != NULL) {
+    spec->arg = integer;
+  } else if (strchr("eEfFgGaA", *q) != NULL) {
+    spec->arg = ldouble ? LOGBUF_ARG_LDOUBLE : LOGBUF_ARG_DOUBLE;
+  } else if (*q == 's') {
+    spec->arg = LOGBUF_ARG_STR;
+  } else if (*q == 'p' || *q == 'n') {
+    spec->arg = LOGBUF_ARG_PTR;
+  } else {
+    spec->stars = 0;
+  }
+  if (*q != '\0') {
+    q++;
+  }
+  spec->len = q - spec->start;
+  return q;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOGBUF_MAGIC "BBFSLOG1"
+#define LOGBUF_RING (256 << 10) // bytes of records buffered per thread, a power of two
+#define LOGBUF_RECORD_MAX 16384 // longer strings are cut to fit
+#define LOGBUF_ARGS_MAX 16
+#define LOGBUF_FLUSH_MS 10
+
+enum logbuf_type {
+  LOGBUF_FORMAT = 1, // followed by the format string
+  LOGBUF_EVENT, // followed by the arguments
+};
+
+// A record, the same in the per-thread rings and in the log file (which
+// is read back on the host that wrote it, in its byte order). An event
+// stores each numeric argument in 8 bytes and each string as a u32
+// length and the bytes; it refers to its format by address, and the
+// format record for that address comes before the first event using it.
+struct logbuf_record {
+  uint32_t len; // of the whole record
+  uint8_t type;
+  uint8_t command; // from log_command: timestamped, ends in a newline
+  uint16_t pad;
+  uint64_t time; // microseconds since the epoch, for commands
+  uint64_t key; // address of the format string
+};
+
+enum logbuf_arg {
+  LOGBUF_ARG_NONE, // %% or an unknown conversion, printed as is
+  LOGBUF_ARG_INT,
+  LOGBUF_ARG_LONG,
+  LOGBUF_ARG_LLONG,
+  LOGBUF_ARG_INTMAX,
+  LOGBUF_ARG_SIZE,
+  LOGBUF_ARG_PTRDIFF,
+  LOGBUF_ARG_DOUBLE,
+  LOGBUF_ARG_LDOUBLE,
+  LOGBUF_ARG_PTR,
+  LOGBUF_ARG_STR,
+};
+
+// One printf conversion
+struct logbuf_spec {
+  const char *start; // the %, or the end of the format if there is none left
+  size_t len; // up to and including the conversion character
+  int stars; // int arguments for * width and precision, before the value
+  char conv;
+  enum logbuf_arg arg;
+};
+
+const char *logbuf_next_spec(const char *p, struct logbuf_spec *spec);
@@ -0,0 +1,411 @@
+/*
+  Metadata pipeline
+
+  libssh's sftp calls send a request and block for its reply, so every
+  stat holds a connection for a full round trip. This speaks SFTP version
+  3 directly on a channel of its own, where requests carry ids and the
+  server answers them in order of arrival: callers queue their requests
+  back to back and the replies are matched to them by id.
+
+  A libssh session must not be used from two threads at once, so the
+  channel is only touched under the lock. The waiter that reads replies
+  polls in short steps and steps aside whenever a sender wants the lock.
+*/
+
+#include "mdpipe.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MDPIPE_FXP_INIT 1
+#define MDPIPE_FXP_VERSION 2
+#define MDPIPE_FXP_LSTAT 7
+#define MDPIPE_FXP_STAT 17
+#define MDPIPE_FXP_READLINK 19
+#define MDPIPE_FXP_STATUS 101
+#define MDPIPE_FXP_NAME 104
+#define MDPIPE_FXP_ATTRS 105
+
+#define MDPIPE_ATTR_SIZE 0x1
+#define MDPIPE_ATTR_UIDGID 0x2
+#define MDPIPE_ATTR_PERMISSIONS 0x4
+#define MDPIPE_ATTR_ACMODTIME 0x8
+
+#define MDPIPE_CHUNK 65536
+
+static void put32(unsigned char *b, uint32_t v) {
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+}
+
+static uint32_t get32(const unsigned char *b) {
+  return (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 | (uint32_t) b[2] << 8 | b[3];
+}
+
+/**
+ * Negative errno for an SFTP status code
+ */
+static int mdpipe_errno(uint32_t code) {
+  switch (code) {
+    case 2: // NO_SUCH_FILE
+    case 10: // NO_SUCH_PATH
+      return -ENOENT;
+    case 3: // PERMISSION_DENIED
+    case 12: // WRITE_PROTECT
+      return -EACCES;
+    case 6: // NO_CONNECTION
+    case 7: // CONNECTION_LOST
+      return -ENOTCONN;
+    case 8: // OP_UNSUPPORTED
+      return -ENOSYS;
+    default:
+      return -EIO;
+  }
+}
+
+static int mdpipe_write(struct mdpipe *p, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    int n = ssh_channel_write(p->channel, data, len);
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int mdpipe_read_full(struct mdpipe *p, unsigned char *data, size_t len) {
+  while (len > 0) {
+    int n = ssh_channel_read(p->channel, data, len, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Complete every pending request with ENOTCONN, the channel is gone
+ */
+static void mdpipe_fail(struct mdpipe *p) {
+  p->broken = 1;
+  for (struct mdpipe_req *req = p->pending; req != NULL; req = req->next) {
+    req->status = -ENOTCONN;
+    req->done = 1;
+  }
+  p->pending = NULL;
+  p->inflight = 0;
+  pthread_cond_broadcast(&p->replied);
+}
+
+/**
+ * Fill statbuf from the ATTRS structure at q, 0 if it is cut short
+ */
+static int mdpipe_attrs(const unsigned char *q, const unsigned char *end, struct stat *statbuf) {
+  if (end - q < 4) {
+    return 0;
+  }
+  uint32_t flags = get32(q);
+  q += 4;
+  memset(statbuf, 0, sizeof(struct stat));
+  statbuf->st_nlink = 1;
+  if (flags & MDPIPE_ATTR_SIZE) {
+    if (end - q < 8) {
+      return 0;
+    }
+    statbuf->st_size = (off_t) ((uint64_t) get32(q) << 32 | get32(q + 4));
+    statbuf->st_blocks = (statbuf->st_size + 511) / 512;
+    q += 8;
+  }
+  if (flags & MDPIPE_ATTR_UIDGID) {
+    if (end - q < 8) {
+      return 0;
+    }
+    statbuf->st_uid = get32(q);
+    statbuf->st_gid = get32(q + 4);
+    q += 8;
+  }
+  if (flags & MDPIPE_ATTR_PERMISSIONS) {
+    if (end - q < 4) {
+      return 0;
+    }
+    statbuf->st_mode = get32(q);
+    q += 4;
+  }
+  if (flags & MDPIPE_ATTR_ACMODTIME) {
+    if (end - q < 8) {
+      return 0;
+    }
+    statbuf->st_atime = get32(q);
+    statbuf->st_mtime = statbuf->st_ctime = get32(q + 4);
+  }
+  return 1;
+}
+
+/**
+ * Hand the reply packet pkt (type and payload) to the request it answers
+ */
+static void mdpipe_dispatch(struct mdpipe *p, const unsigned char *pkt, uint32_t len) {
+  if (len < 5) {
+    return;
+  }
+  uint32_t id = get32(pkt + 1);
+  struct mdpipe_req **link = &p->pending;
+  while (*link != NULL && (*link)->id != id) {
+    link = &(*link)->next;
+  }
+  struct mdpipe_req *req = *link;
+  if (req == NULL) {
+    return;
+  }
+  *link = req->next;
+  const unsigned char *q = pkt + 5, *end = pkt + len;
+  req->status = -EIO;
+  if (pkt[0] == MDPIPE_FXP_STATUS && end - q >= 4) {
+    req->status = mdpipe_errno(get32(q));
+  } else if (pkt[0] == MDPIPE_FXP_ATTRS && req->statbuf != NULL && mdpipe_attrs(q, end, req->statbuf)) {
+    req->status = 0;
+  } else if (pkt[0] == MDPIPE_FXP_NAME && req->link != NULL && end - q >= 8 && get32(q) >= 1) {
+    // the first name is the link target
+    uint32_t n = get32(q + 4);
+    if ((size_t) (end - q - 8) >= n) {
+      n = n < req->linksize - 1 ? n : req->linksize - 1;
+      memcpy(req->link, q + 8, n);
+      req->link[n] = '\0';
+      req->status = 0;
+    }
+  }
+  req->done = 1;
+  p->inflight--;
+  pthread_cond_broadcast(&p->replied);
+}
+
+/**
+ * Read what has arrived within MDPIPE_POLL_MS and complete the requests
+ * it answers
+ */
+static void mdpipe_receive(struct mdpipe *p) {
+  if (p->cap - p->len < MDPIPE_CHUNK) {
+    char *buf = realloc(p->buf, p->cap + MDPIPE_CHUNK);
+    if (buf == NULL) {
+      mdpipe_fail(p);
+      return;
+    }
+    p->buf = buf;
+    p->cap += MDPIPE_CHUNK;
+  }
+  int n = ssh_channel_read_timeout(p->channel, p->buf + p->len, p->cap - p->len, 0, MDPIPE_POLL_MS);
+  if (n < 0 || (n == 0 && ssh_channel_is_eof(p->channel))) {
+    mdpipe_fail(p);
+    return;
+  }
+  p->len += n;
+  size_t off = 0;
+  while (p->len - off >= 4) {
+    uint32_t plen = get32((unsigned char *) p->buf + off);
+    if (p->len - off - 4 < plen) {
+      break;
+    }
+    mdpipe_dispatch(p, (unsigned char *) p->buf + off + 4, plen);
+    off += 4 + plen;
+  }
+  memmove(p->buf, p->buf + off, p->len - off);
+  p->len -= off;
+}
+
+/**
+ * Take the lock to send. Waiting senders are counted, so the reading
+ * waiter can make way for them.
+ */
+static void mdpipe_lock_send(struct mdpipe *p) {
+  __atomic_fetch_add(&p->queued, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&p->lock);
+  __atomic_fetch_sub(&p->queued, 1, __ATOMIC_ACQ_REL);
+}
+
+static void mdpipe_sent(struct mdpipe *p) {
+  if (__atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) == 0) {
+    pthread_cond_broadcast(&p->drained);
+  }
+}
+
+/**
+ * Send a request of type on path for req. Called with the lock held.
+ */
+static int mdpipe_start(struct mdpipe *p, unsigned char type, const char *path, struct mdpipe_req *req) {
+  if (p->broken) {
+    return -ENOTCONN;
+  }
+  size_t plen = strlen(path);
+  unsigned char *pkt = malloc(13 + plen);
+  if (pkt == NULL) {
+    return -ENOMEM;
+  }
+  req->id = p->next_id++;
+  req->done = 0;
+  put32(pkt, 9 + plen);
+  pkt[4] = type;
+  put32(pkt + 5, req->id);
+  put32(pkt + 9, plen);
+  memcpy(pkt + 13, path, plen);
+  req->next = p->pending;
+  p->pending = req;
+  p->inflight++;
+  p->requests++;
+  if ((unsigned long) p->inflight > p->max_inflight) {
+    p->max_inflight = p->inflight;
+  }
+  if (mdpipe_write(p, pkt, 13 + plen) < 0) {
+    mdpipe_fail(p);
+  }
+  free(pkt);
+  return 0;
+}
+
+/**
+ * Wait for the reply to req, reading replies for everyone while no other
+ * waiter does. Called with the lock held.
+ */
+static void mdpipe_wait(struct mdpipe *p, struct mdpipe_req *req) {
+  while (!req->done) {
+    if (p->reading) {
+      pthread_cond_wait(&p->replied, &p->lock);
+      continue;
+    }
+    p->reading = 1;
+    while (!req->done) {
+      mdpipe_receive(p);
+      while (!p->broken && __atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&p->drained, &p->lock);
+      }
+    }
+    p->reading = 0;
+    // someone else still waiting takes over the reading
+    pthread_cond_broadcast(&p->replied);
+  }
+}
+
+static int mdpipe_call(struct mdpipe *p, unsigned char type, const char *path, struct mdpipe_req *req) {
+  mdpipe_lock_send(p);
+  int retstat = mdpipe_start(p, type, path, req);
+  mdpipe_sent(p);
+  if (retstat == 0) {
+    mdpipe_wait(p, req);
+    retstat = req->status;
+  }
+  pthread_mutex_unlock(&p->lock);
+  return retstat;
+}
+
+/**
+ * Start an SFTP session on a new channel of session. Returns 0, or -1 if
+ * the server does not offer SFTP.
+ */
+int mdpipe_open(struct mdpipe *p, ssh_session session) {
+  memset(p, 0, sizeof(struct mdpipe));
+  p->channel = ssh_channel_new(session);
+  if (p->channel == NULL) {
+    return -1;
+  }
+  unsigned char pkt[9];
+  put32(pkt, 5);
+  pkt[4] = MDPIPE_FXP_INIT;
+  put32(pkt + 5, 3);
+  unsigned char head[5];
+  if (ssh_channel_open_session(p->channel) != SSH_OK
+      || ssh_channel_request_subsystem(p->channel, "sftp") != SSH_OK
+      || mdpipe_write(p, pkt, sizeof(pkt)) < 0
+      || mdpipe_read_full(p, head, sizeof(head)) < 0
+      || head[4] != MDPIPE_FXP_VERSION || get32(head) < 5) {
+    ssh_channel_free(p->channel);
+    p->channel = NULL;
+    return -1;
+  }
+  // the version and any extensions the server announces are not needed
+  for (uint32_t left = get32(head) - 1; left > 0; ) {
+    unsigned char skip[256];
+    uint32_t n = left < sizeof(skip) ? left : sizeof(skip);
+    if (mdpipe_read_full(p, skip, n) < 0) {
+      ssh_channel_free(p->channel);
+      p->channel = NULL;
+      return -1;
+    }
+    left -= n;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->replied, NULL);
+  pthread_cond_init(&p->drained, NULL);
+  p->next_id = 1;
+  return 0;
+}
+
+void mdpipe_close(struct mdpipe *p) {
+  if (p->channel == NULL) {
+    return;
+  }
+  ssh_channel_send_eof(p->channel);
+  ssh_channel_close(p->channel);
+  ssh_channel_free(p->channel);
+  p->channel = NULL;
+  free(p->buf);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->replied);
+  pthread_cond_destroy(&p->drained);
+}
+
+/**
+ * Attributes of path, not following a final symlink. Returns 0 or a
+ * negative errno, -ENOTCONN once the channel is gone.
+ */
+int mdpipe_lstat(struct mdpipe *p, const char *path, struct stat *statbuf) {
+  struct mdpipe_req req;
+  memset(&req, 0, sizeof(req));
+  req.statbuf = statbuf;
+  return mdpipe_call(p, MDPIPE_FXP_LSTAT, path, &req);
+}
+
+/**
+ * Target of the symlink at path
+ */
+int mdpipe_readlink(struct mdpipe *p, const char *path, char *link, size_t size) {
+  struct mdpipe_req req;
+  memset(&req, 0, sizeof(req));
+  req.link = link;
+  req.linksize = size;
+  return mdpipe_call(p, MDPIPE_FXP_READLINK, path, &req);
+}
+
+/**
+ * Attributes of n paths, following symlinks, all requested before the
+ * first reply is read. status[i] is 0 or a negative errno for paths[i].
+ */
+int mdpipe_stat_batch(struct mdpipe *p, const char **paths, int n, struct stat *statbufs, int *status) {
+  struct mdpipe_req *reqs = calloc(n, sizeof(struct mdpipe_req));
+  if (reqs == NULL) {
+    return -ENOMEM;
+  }
+  mdpipe_lock_send(p);
+  for (int i = 0; i < n; i++) {
+    reqs[i].statbuf = &statbufs[i];
+    status[i] = mdpipe_start(p, MDPIPE_FXP_STAT, paths[i], &reqs[i]);
+    if (status[i] < 0) {
+      reqs[i].done = 1;
+    }
+  }
+  mdpipe_sent(p);
+  for (int i = 0; i < n; i++) {
+    if (status[i] == 0) {
+      mdpipe_wait(p, &reqs[i]);
+      status[i] = reqs[i].status;
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  free(reqs);
+  return 0;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <libssh/libssh.h>
+
+#define MDPIPE_POLL_MS 1
+#define MDPIPE_BATCH 64
+
+// A metadata request waiting for its reply
+struct mdpipe_req {
+  uint32_t id;
+  int done;
+  int status; // 0 or a negative errno
+  struct stat *statbuf; // filled from an ATTRS reply
+  char *link; // filled from a NAME reply
+  size_t linksize;
+  struct mdpipe_req *next;
+};
+
+// An SFTP channel of its own for metadata, on which any number of
+// requests are in flight at once. Each caller sends its request and waits;
+// one of the waiters at a time reads replies for all of them and hands
+// each to its request by id, so a burst of lookups from many threads, or
+// a batch from one, costs about one round trip instead of one each.
+struct mdpipe {
+  ssh_channel channel;
+  pthread_mutex_t lock; // the channel and everything below
+  pthread_cond_t replied;
+  pthread_cond_t drained; // no sender is waiting for the lock
+  int reading; // a waiter is reading replies for everyone
+  int queued; // senders waiting for the lock, updated atomically
+  int broken;
+  uint32_t next_id;
+  struct mdpipe_req *pending;
+  int inflight;
+  char *buf; // received bytes not yet parsed into a packet
+  size_t len, cap;
+  unsigned long requests;
+  unsigned long max_inflight;
+};
+
+int mdpipe_open(struct mdpipe *p, ssh_session session);
+void mdpipe_close(struct mdpipe *p);
+int mdpipe_lstat(struct mdpipe *p, const char *path, struct stat *statbuf);
+int mdpipe_stat_batch(struct mdpipe *p, const char **paths, int n, struct stat *statbufs, int *status);
+int mdpipe_readlink(struct mdpipe *p, const char *path, char *link, size_t size);
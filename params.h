@@ -2,31 +2,139 @@
 
 #define FUSE_USE_VERSION 26
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <fuse.h>
 #include <getopt.h>
 #include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "attrcache.h"
+#include "connpool.h"
+#include "filecache.h"
+#include "helper.h"
+#include "mdpipe.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
+#include "transport.h"
+#include "xfer.h"
 
 #define BUF_SIZE 4096
 #define CACHE_SIZE 1024
-
-struct file_cache_local {
-  char *remotepath;
-  char *localpath;
-  int access;
-};
+#define CACHE_BYTES (1ULL << 30)
+#define XFER_CHUNK 65536
+#define BLOCK_SIZE 65536
+#define READAHEAD_INIT 2
+#define READAHEAD_MAX 32
+#define CACHE_KEY_MAX (PATH_MAX + BUF_SIZE)
+#define FLUSH_QUEUE_MAX 64
+#define REMOTE_GROUPS_MAX 64
 
 struct bb_state {
   FILE *logfile;
+  int log_text; // format log lines as they are logged, see log.c
+  int log_level; // most verbose level logged, see log.h
   char *rootdir;
-  ssh_session session; // ssh session
+  struct transport transport; // how rootdir is reached, see bb_remote
+  double latency; // local directory only: ms added to each call
+  double bandwidth; // local directory only: Mbit/s, 0 for no limit
+  unsigned int port; // ssh port, 0 for the default
+  char *identity; // extra private key file, NULL for none
+  struct conn_pool pool; // connections of the filesystem operations
+  struct bb_conn flush_conn; // used by the write-back worker
+  int pipeline; // metadata goes through pipe, on a connection of its own
+  struct bb_conn pipe_conn;
+  struct mdpipe pipe;
+  char *helper_cmd; // bbfs-helper on the remote, NULL to do without
+  struct bb_conn helper_conn;
+  ssh_channel helper_channel; // NULL when the helper did not start
+  struct helper helper;
+  long blksize; // remote filesystem block size, queried once at mount
+  // ids of the remote login, read once at mount for permission checks
+  // made without asking the remote; remote_ngroups is -1 if unknown
+  uid_t remote_uid;
+  gid_t remote_gids[REMOTE_GROUPS_MAX];
+  int remote_ngroups;
+  struct attr_cache attrs; // remote attributes by full path
+  unsigned int xfer_chunk; // bytes moved per scp read/write
+  int streams; // connections a large transfer may be split over, 0 never splits
+  long long parallel_min; // smallest file that is split
+  struct xfer_tuner xfer_down, xfer_up;
+  unsigned int block_size; // granularity of dirty and lazy fetch tracking
+  int lazy; // fetch file blocks on first access instead of at open
+  unsigned int readahead; // largest readahead window in blocks, 0 disables
+  char *cache_dir; // local copies and their sidecars, absolute path
+  int cache_tmp; // cache_dir was made for this mount and goes with it
+  char *cache_key; // user@host, prefixed to remote paths in cache names
   // caching system
-  struct file_cache_local cache[CACHE_SIZE];
-  int num_cache;
+  struct file_cache cache;
+  pthread_mutex_t lock; // file cache structure, LRU list and flush queue,
+                        // taken after an entry lock and a connection
+  // write-back of released dirty files, oldest first
+  struct file_cache_local *flush_head, *flush_tail;
+  unsigned int flush_len;
+  unsigned int flush_queue; // queue bound, 0 uploads on release instead
+  int flush_stop;
+  pthread_t flush_thread;
+  pthread_cond_t flush_work; // queue got an entry or stop was set
+  pthread_cond_t flush_space; // queue got shorter
+  pthread_cond_t idle; // an entry finished loading or uploading
+  // metadata of the whole remote tree, with -o snapshot
+  int snapshot;
+  struct snapshot snap;
+  long long snap_since; // remote time the last complete scan started
+  int snap_stop;
+  pthread_t snap_thread;
+  pthread_cond_t snap_wake; // stop was set
+  struct stats stats; // per-operation counters and latencies
+  unsigned long remote_calls; // transport calls made through bb_remote
+  unsigned long sftp_requests; // SFTP requests made by the ssh transport
+  char *trace_file; // -o trace, NULL for none
+  struct trace trace; // trace.file is NULL when not tracing
+};
+
+// An open file, stored in fi->fh
+struct bb_file {
+  int fd; // descriptor on the local copy
+  uint64_t handle; // numbers the open in traces
+  struct file_cache_local *entry;
+  // access pattern of this descriptor, for readahead
+  off_t last_offset;
+  off_t next_offset;
+  off_t stride;
+  unsigned int ra_window; // blocks read ahead, 0 while access looks random
+  char *text; // contents of STATS_FILE as of the open, NULL for remote files
+  size_t text_len;
+};
+
+// Set in main. Unlike the fuse context it is also valid in the threads
+// bbfs starts itself.
+extern struct bb_state *bb_global;
+#define BB_DATA bb_global
+
+// Call op of the transport, e.g. bb_remote(lstat, fpath, &st), and count it
+#define bb_remote(op, ...) \
+  (__atomic_fetch_add(&BB_DATA->remote_calls, 1, __ATOMIC_RELAXED), \
+   BB_DATA->transport.op(BB_DATA->transport.ctx, __VA_ARGS__))
+
+// The connection the calling thread holds, see bb_conn_get
+extern __thread struct bb_conn *bb_thread_conn;
+#define BB_CONN bb_thread_conn
+
+// A directory listing read from the remote, stored in fi->fh
+struct bb_dirent {
+  char *name;
+  mode_t mode;
+};
+
+struct bb_dir {
+  int count, capacity;
+  struct bb_dirent *entries;
 };
 
-#define BB_DATA ((struct bb_state *) fuse_get_context()->private_data)
+#define BB_FILE(fi) ((struct bb_file *) (uintptr_t) (fi)->fh)
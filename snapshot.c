@@ -0,0 +1,559 @@
+/*
+  Metadata snapshot
+
+  For trees that mostly stay put, -o snapshot lists the whole remote tree
+  once at mount and answers getattr, readdir, readlink and access from
+  memory. Changes made through the mount mark the nodes they touch stale,
+  and those are asked from the remote until a refresh has listed them
+  again. The refresh itself only lists what changed since the last one.
+*/
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define SNAP_NODES_MIN 1024
+#define SNAP_NAMES_MIN 65536
+
+// FNV-1a over the first len bytes, for path components that are not
+// NUL-terminated.
+static uint32_t snap_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t *snap_intern_slot(struct snapshot *s, const char *name, size_t len) {
+  uint32_t mask = s->interned_cap - 1;
+  for (uint32_t i = snap_hash(name, len) & mask;; i = (i + 1) & mask) {
+    uint32_t off = s->interned[i];
+    if (off == SNAP_NONE || (strncmp(s->names + off, name, len) == 0 && s->names[off + len] == '\0')) {
+      return &s->interned[i];
+    }
+  }
+}
+
+static uint32_t snap_name_find(struct snapshot *s, const char *name, size_t len) {
+  return s->interned_cap == 0 ? SNAP_NONE : *snap_intern_slot(s, name, len);
+}
+
+static int snap_intern_grow(struct snapshot *s) {
+  uint32_t *old = s->interned;
+  uint32_t oldcap = s->interned_cap;
+  uint32_t cap = oldcap ? oldcap * 2 : SNAP_NODES_MIN;
+  s->interned = malloc(cap * sizeof(uint32_t));
+  if (s->interned == NULL) {
+    s->interned = old;
+    return -1;
+  }
+  memset(s->interned, 0xff, cap * sizeof(uint32_t));
+  s->interned_cap = cap;
+  for (uint32_t i = 0; i < oldcap; i++) {
+    if (old[i] != SNAP_NONE) {
+      const char *name = s->names + old[i];
+      *snap_intern_slot(s, name, strlen(name)) = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+/**
+ * Offset of name in the names arena, storing it on first use
+ */
+static uint32_t snap_intern(struct snapshot *s, const char *name, size_t len) {
+  if (2 * (s->ninterned + 1) > s->interned_cap && snap_intern_grow(s) < 0) {
+    return SNAP_NONE;
+  }
+  uint32_t *slot = snap_intern_slot(s, name, len);
+  if (*slot != SNAP_NONE) {
+    return *slot;
+  }
+  if (s->names_len + len + 1 >= SNAP_NONE) {
+    return SNAP_NONE;
+  }
+  if (s->names_len + len + 1 > s->names_cap) {
+    size_t cap = s->names_cap ? s->names_cap : SNAP_NAMES_MIN;
+    while (cap < s->names_len + len + 1) {
+      cap *= 2;
+    }
+    char *names = realloc(s->names, cap);
+    if (names == NULL) {
+      return SNAP_NONE;
+    }
+    s->names = names;
+    s->names_cap = cap;
+  }
+  uint32_t off = s->names_len;
+  memcpy(s->names + off, name, len);
+  s->names[off + len] = '\0';
+  s->names_len += len + 1;
+  *slot = off;
+  s->ninterned++;
+  return off;
+}
+
+static uint32_t snap_bucket(struct snapshot *s, uint32_t parent, uint32_t name) {
+  uint32_t h = parent * 2654435761u + name;
+  h ^= h >> 15;
+  h *= 2246822519u;
+  h ^= h >> 13;
+  return h & (s->nbuckets - 1);
+}
+
+static uint32_t snap_child(struct snapshot *s, uint32_t parent, uint32_t name) {
+  if (s->nbuckets == 0) {
+    return SNAP_NONE;
+  }
+  for (uint32_t n = s->buckets[snap_bucket(s, parent, name)]; n != SNAP_NONE; n = s->nodes[n].hnext) {
+    if (s->nodes[n].parent == parent && s->nodes[n].name == name) {
+      return n;
+    }
+  }
+  return SNAP_NONE;
+}
+
+static void snap_bucket_insert(struct snapshot *s, uint32_t node) {
+  uint32_t *head = &s->buckets[snap_bucket(s, s->nodes[node].parent, s->nodes[node].name)];
+  s->nodes[node].hnext = *head;
+  *head = node;
+}
+
+static int snap_buckets_grow(struct snapshot *s) {
+  uint32_t n = s->nbuckets ? s->nbuckets * 2 : SNAP_NODES_MIN;
+  uint32_t *buckets = malloc(n * sizeof(uint32_t));
+  if (buckets == NULL) {
+    return -1;
+  }
+  memset(buckets, 0xff, n * sizeof(uint32_t));
+  free(s->buckets);
+  s->buckets = buckets;
+  s->nbuckets = n;
+  for (uint32_t i = 0; i < s->used; i++) {
+    if (s->nodes[i].name != SNAP_NONE && i != s->root) {
+      snap_bucket_insert(s, i);
+    }
+  }
+  return 0;
+}
+
+static uint32_t snap_node_new(struct snapshot *s) {
+  uint32_t n;
+  if (s->free != SNAP_NONE) {
+    n = s->free;
+    s->free = s->nodes[n].sibling;
+  } else {
+    if (s->used == s->capacity) {
+      uint32_t cap = s->capacity ? s->capacity * 2 : SNAP_NODES_MIN;
+      struct snap_node *nodes = realloc(s->nodes, cap * sizeof(struct snap_node));
+      if (nodes == NULL) {
+        return SNAP_NONE;
+      }
+      s->nodes = nodes;
+      s->capacity = cap;
+    }
+    n = s->used++;
+  }
+  s->count++;
+  return n;
+}
+
+/**
+ * Free node and everything below it. The caller unlinks it from its parent.
+ */
+static void snap_free(struct snapshot *s, uint32_t node) {
+  uint32_t next;
+  for (uint32_t c = s->nodes[node].child; c != SNAP_NONE; c = next) {
+    next = s->nodes[c].sibling;
+    snap_free(s, c);
+  }
+  if (node == s->root) {
+    s->root = SNAP_NONE;
+  } else {
+    uint32_t *link = &s->buckets[snap_bucket(s, s->nodes[node].parent, s->nodes[node].name)];
+    while (*link != node) {
+      link = &s->nodes[*link].hnext;
+    }
+    *link = s->nodes[node].hnext;
+  }
+  s->nodes[node].name = SNAP_NONE;
+  s->nodes[node].sibling = s->free;
+  s->free = node;
+  s->count--;
+}
+
+static void snap_detach(struct snapshot *s, uint32_t node) {
+  if (node != s->root) {
+    uint32_t *link = &s->nodes[s->nodes[node].parent].child;
+    while (*link != node) {
+      link = &s->nodes[*link].sibling;
+    }
+    *link = s->nodes[node].sibling;
+  }
+  snap_free(s, node);
+}
+
+/**
+ * Walk path from the root. Returns its node, or SNAP_NONE with the
+ * directory where the walk stopped in *dir.
+ */
+static uint32_t snap_find(struct snapshot *s, const char *path, uint32_t *dir) {
+  uint32_t cur = s->root;
+  *dir = SNAP_NONE;
+  while (cur != SNAP_NONE) {
+    while (*path == '/') {
+      path++;
+    }
+    if (*path == '\0') {
+      break;
+    }
+    size_t len = strcspn(path, "/");
+    uint32_t name = snap_name_find(s, path, len);
+    *dir = cur;
+    cur = name == SNAP_NONE ? SNAP_NONE : snap_child(s, cur, name);
+    path += len;
+  }
+  return cur;
+}
+
+/**
+ * Look path up for an answer: 0 with its node, a negative errno the
+ * remote would give, or 1 if it was changed since it was listed
+ */
+static int snap_resolve(struct snapshot *s, const char *path, uint32_t *node) {
+  uint32_t dir;
+  if (s->root == SNAP_NONE) {
+    return 1;
+  }
+  *node = snap_find(s, path, &dir);
+  if (*node != SNAP_NONE) {
+    return s->nodes[*node].stale ? 1 : 0;
+  }
+  if (s->nodes[dir].stale_list) {
+    return 1;
+  }
+  return S_ISDIR(s->nodes[dir].mode) ? -ENOENT : -ENOTDIR;
+}
+
+/**
+ * Write the path of node into buf
+ */
+static int snap_path(struct snapshot *s, uint32_t node, char *buf, size_t size) {
+  size_t pos = size - 1;
+  buf[pos] = '\0';
+  for (; node != s->root; node = s->nodes[node].parent) {
+    const char *name = s->names + s->nodes[node].name;
+    size_t len = strlen(name);
+    if (pos < len + 1) {
+      return -1;
+    }
+    pos -= len;
+    memcpy(buf + pos, name, len);
+    buf[--pos] = '/';
+  }
+  if (pos == size - 1) {
+    buf[--pos] = '/';
+  }
+  memmove(buf, buf + pos, size - pos);
+  return 0;
+}
+
+void snapshot_init(struct snapshot *s) {
+  memset(s, 0, sizeof(struct snapshot));
+  pthread_rwlock_init(&s->lock, NULL);
+  s->free = SNAP_NONE;
+  s->root = SNAP_NONE;
+  s->pass = 1;
+  s->ttl = SNAPSHOT_TTL;
+}
+
+void snapshot_destroy(struct snapshot *s) {
+  free(s->nodes);
+  free(s->buckets);
+  free(s->names);
+  free(s->interned);
+  pthread_rwlock_destroy(&s->lock);
+}
+
+/**
+ * Start a refresh. Nodes changed locally before this call are fresh again
+ * once the refresh reports them.
+ */
+uint32_t snapshot_begin_pass(struct snapshot *s) {
+  pthread_rwlock_wrlock(&s->lock);
+  uint32_t pass = ++s->pass;
+  pthread_rwlock_unlock(&s->lock);
+  return pass;
+}
+
+/**
+ * Add or update the node of path, whose parent must be there already.
+ * With keep_stale set a node changed locally stays stale, for a file with
+ * changes that have not reached the remote yet. Returns 1 if it was
+ * added, 0 if updated, -1 on failure.
+ */
+int snapshot_add(struct snapshot *s, const char *path, const struct stat *statbuf, const char *link, int keep_stale) {
+  pthread_rwlock_wrlock(&s->lock);
+  uint32_t dir;
+  uint32_t node = snap_find(s, path, &dir);
+  int created = 0;
+  if (node == SNAP_NONE) {
+    const char *slash = strrchr(path, '/');
+    const char *last = slash == NULL ? path : slash + 1;
+    // only the last component may be missing, or the root before the scan
+    uint32_t parent = SNAP_NONE;
+    int ok = s->root == SNAP_NONE && *last == '\0';
+    if (s->root != SNAP_NONE && *last != '\0' && last - path < PATH_MAX) {
+      char up[PATH_MAX];
+      memcpy(up, path, last - path);
+      up[last - path] = '\0';
+      parent = snap_find(s, up, &dir);
+      ok = parent != SNAP_NONE && S_ISDIR(s->nodes[parent].mode);
+    }
+    uint32_t name = snap_intern(s, last, strlen(last));
+    if (!ok || name == SNAP_NONE
+        || (s->count >= s->nbuckets && snap_buckets_grow(s) < 0)
+        || (node = snap_node_new(s)) == SNAP_NONE) {
+      pthread_rwlock_unlock(&s->lock);
+      return -1;
+    }
+    struct snap_node *n = &s->nodes[node];
+    n->name = name;
+    n->parent = parent;
+    n->child = SNAP_NONE;
+    n->stale = n->stale_list = 0;
+    if (parent == SNAP_NONE) {
+      n->sibling = n->hnext = SNAP_NONE;
+      s->root = node;
+    } else {
+      n->sibling = s->nodes[parent].child;
+      s->nodes[parent].child = node;
+      snap_bucket_insert(s, node);
+    }
+    created = 1;
+  }
+  if (!S_ISDIR(statbuf->st_mode)) {
+    uint32_t next;
+    for (uint32_t c = s->nodes[node].child; c != SNAP_NONE; c = next) {
+      next = s->nodes[c].sibling;
+      snap_free(s, c);
+    }
+    s->nodes[node].child = SNAP_NONE;
+  }
+  uint32_t target = link != NULL && S_ISLNK(statbuf->st_mode) ? snap_intern(s, link, strlen(link)) : SNAP_NONE;
+  struct snap_node *n = &s->nodes[node];
+  n->link = target;
+  n->mode = (uint16_t) statbuf->st_mode;
+  n->uid = statbuf->st_uid;
+  n->gid = statbuf->st_gid;
+  n->nlink = statbuf->st_nlink;
+  n->size = statbuf->st_size;
+  n->mtime = statbuf->st_mtime;
+  n->seen = s->pass;
+  if (n->stale != 0 && n->stale < s->pass && !keep_stale) {
+    n->stale = 0;
+  }
+  pthread_rwlock_unlock(&s->lock);
+  return created;
+}
+
+/**
+ * After path was listed again in this pass, drop the children the listing
+ * did not report
+ */
+void snapshot_sweep(struct snapshot *s, const char *path) {
+  pthread_rwlock_wrlock(&s->lock);
+  uint32_t dir;
+  uint32_t node = snap_find(s, path, &dir);
+  if (node != SNAP_NONE) {
+    uint32_t next;
+    for (uint32_t c = s->nodes[node].child; c != SNAP_NONE; c = next) {
+      next = s->nodes[c].sibling;
+      if (s->nodes[c].seen != s->pass) {
+        snap_detach(s, c);
+      }
+    }
+    if (s->nodes[node].stale_list != 0 && s->nodes[node].stale_list < s->pass) {
+      s->nodes[node].stale_list = 0;
+    }
+  }
+  pthread_rwlock_unlock(&s->lock);
+}
+
+/**
+ * Forget path and everything below it, when it was removed or renamed
+ * through the mount
+ */
+void snapshot_remove(struct snapshot *s, const char *path) {
+  pthread_rwlock_wrlock(&s->lock);
+  uint32_t dir;
+  uint32_t node = snap_find(s, path, &dir);
+  if (node != SNAP_NONE && node != s->root) {
+    snap_detach(s, node);
+  }
+  pthread_rwlock_unlock(&s->lock);
+}
+
+/**
+ * Mark the attributes of path as changed, and with parent set the
+ * listing of its directory too
+ */
+void snapshot_invalidate(struct snapshot *s, const char *path, int parent) {
+  pthread_rwlock_wrlock(&s->lock);
+  if (s->root != SNAP_NONE) {
+    uint32_t dir;
+    uint32_t node = snap_find(s, path, &dir);
+    if (node != SNAP_NONE) {
+      s->nodes[node].stale = s->pass;
+      dir = node == s->root ? SNAP_NONE : s->nodes[node].parent;
+    }
+    if (parent && dir != SNAP_NONE) {
+      s->nodes[dir].stale_list = s->pass;
+    }
+  }
+  pthread_rwlock_unlock(&s->lock);
+}
+
+static int snap_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Paths of the directories a refresh has to list again because something
+ * in them was changed through the mount. Returns their number, or -1.
+ */
+int snapshot_stale_dirs(struct snapshot *s, char ***paths) {
+  pthread_rwlock_rdlock(&s->lock);
+  uint32_t *dirs = malloc((s->count + 1) * sizeof(uint32_t));
+  int n = 0;
+  for (uint32_t i = 0; dirs != NULL && i < s->used; i++) {
+    struct snap_node *node = &s->nodes[i];
+    if (node->name == SNAP_NONE) {
+      continue;
+    }
+    if (node->stale_list || (node->stale && i == s->root)) {
+      dirs[n++] = i;
+    } else if (node->stale) {
+      dirs[n++] = node->parent;
+    }
+  }
+  qsort(dirs, n, sizeof(uint32_t), snap_cmp);
+  *paths = dirs == NULL ? NULL : malloc((n + 1) * sizeof(char *));
+  int count = 0;
+  char path[PATH_MAX];
+  for (int i = 0; *paths != NULL && i < n; i++) {
+    if ((i == 0 || dirs[i] != dirs[i - 1]) && snap_path(s, dirs[i], path, sizeof(path)) == 0
+        && ((*paths)[count] = strdup(path)) != NULL) {
+      count++;
+    }
+  }
+  pthread_rwlock_unlock(&s->lock);
+  free(dirs);
+  return *paths == NULL ? -1 : count;
+}
+
+/**
+ * 0 and the attributes of path, a negative errno, or 1 to ask the remote
+ */
+int snapshot_getattr(struct snapshot *s, const char *path, struct stat *statbuf) {
+  pthread_rwlock_rdlock(&s->lock);
+  uint32_t node;
+  int retstat = snap_resolve(s, path, &node);
+  if (retstat == 0) {
+    struct snap_node *n = &s->nodes[node];
+    memset(statbuf, 0, sizeof(struct stat));
+    statbuf->st_mode = n->mode;
+    statbuf->st_nlink = n->nlink;
+    statbuf->st_uid = n->uid;
+    statbuf->st_gid = n->gid;
+    statbuf->st_size = n->size;
+    statbuf->st_blocks = (n->size + 511) / 512;
+    statbuf->st_atime = n->mtime;
+    statbuf->st_mtime = n->mtime;
+    statbuf->st_ctime = n->mtime;
+  }
+  pthread_rwlock_unlock(&s->lock);
+  if (retstat == 1) {
+    bb_count(s->misses, 1);
+  } else {
+    bb_count(s->hits, 1);
+  }
+  return retstat;
+}
+
+/**
+ * 0 and the target of the link at path, a negative errno, or 1 to ask
+ * the remote
+ */
+int snapshot_readlink(struct snapshot *s, const char *path, char *link, size_t size) {
+  pthread_rwlock_rdlock(&s->lock);
+  uint32_t node;
+  int retstat = snap_resolve(s, path, &node);
+  if (retstat == 0) {
+    if (!S_ISLNK(s->nodes[node].mode) || s->nodes[node].link == SNAP_NONE) {
+      retstat = -EINVAL;
+    } else {
+      strncpy(link, s->names + s->nodes[node].link, size - 1);
+      link[size - 1] = '\0';
+    }
+  }
+  pthread_rwlock_unlock(&s->lock);
+  if (retstat == 1) {
+    bb_count(s->misses, 1);
+  } else {
+    bb_count(s->hits, 1);
+  }
+  return retstat;
+}
+
+/**
+ * Call fill for each name in the directory path, "." and ".." included.
+ * Returns 0, a negative errno, the first nonzero result of fill, or 1 to
+ * ask the remote.
+ */
+int snapshot_readdir(struct snapshot *s, const char *path,
+                     int (*fill)(void *arg, const char *name, mode_t mode), void *arg) {
+  pthread_rwlock_rdlock(&s->lock);
+  uint32_t node;
+  int retstat = snap_resolve(s, path, &node);
+  if (retstat == 0 && s->nodes[node].stale_list) {
+    retstat = 1;
+  } else if (retstat == 0 && !S_ISDIR(s->nodes[node].mode)) {
+    retstat = -ENOTDIR;
+  } else if (retstat == 0) {
+    retstat = fill(arg, ".", S_IFDIR);
+    if (retstat == 0) {
+      retstat = fill(arg, "..", S_IFDIR);
+    }
+    for (uint32_t c = s->nodes[node].child; retstat == 0 && c != SNAP_NONE; c = s->nodes[c].sibling) {
+      retstat = fill(arg, s->names + s->nodes[c].name, s->nodes[c].mode);
+    }
+  }
+  pthread_rwlock_unlock(&s->lock);
+  if (retstat == 1) {
+    bb_count(s->misses, 1);
+  } else {
+    bb_count(s->hits, 1);
+  }
+  return retstat;
+}
+
+/**
+ * Bytes held by the snapshot
+ */
+size_t snapshot_memory(struct snapshot *s) {
+  pthread_rwlock_rdlock(&s->lock);
+  size_t bytes = (size_t) s->capacity * sizeof(struct snap_node) + (size_t) s->nbuckets * sizeof(uint32_t)
+                 + s->names_cap + (size_t) s->interned_cap * sizeof(uint32_t);
+  pthread_rwlock_unlock(&s->lock);
+  return bytes;
+}
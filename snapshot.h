@@ -0,0 +1,63 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SNAP_NONE UINT32_MAX
+#define SNAPSHOT_TTL 30.0
+
+// One file or directory of the remote tree. Components are interned, so a
+// name shared by many paths (src, Makefile, .git) is stored once, and the
+// stat fields are packed to what getattr reports.
+struct snap_node {
+  uint32_t name; // offset of the interned component in names, SNAP_NONE if free
+  uint32_t link; // interned symlink target, SNAP_NONE otherwise
+  uint32_t parent, child, sibling; // tree links, SNAP_NONE at the ends
+  uint32_t hnext; // next node in the same (parent, name) bucket
+  uint32_t uid, gid, nlink;
+  uint32_t seen; // refresh pass that last reported the node
+  uint32_t stale; // pass in which its attributes changed locally, 0 if fresh
+  uint32_t stale_list; // same for the set of its children
+  uint16_t mode;
+  int64_t size;
+  int64_t mtime;
+};
+
+// The remote tree as of the last scan, indexed by mount-relative path
+// ("/" is the mount root). Lookups answer 1 instead of an errno when the
+// snapshot cannot tell, because the path or its directory was changed
+// through the mount since it was scanned; the caller then asks the remote.
+struct snapshot {
+  pthread_rwlock_t lock;
+  struct snap_node *nodes;
+  uint32_t count, used, capacity; // live nodes, slots ever used, allocated
+  uint32_t free; // free nodes, chained through sibling
+  uint32_t *buckets; // nodes by (parent, name), chained through hnext
+  uint32_t nbuckets;
+  char *names; // interned components and link targets, NUL-terminated
+  size_t names_len, names_cap;
+  uint32_t *interned; // open-addressed offsets into names
+  uint32_t ninterned, interned_cap;
+  uint32_t root; // SNAP_NONE until the first scan
+  uint32_t pass; // current refresh pass, starts at 1
+  double ttl; // seconds between refreshes, 0 never refreshes
+  unsigned long hits;
+  unsigned long misses;
+};
+
+void snapshot_init(struct snapshot *s);
+void snapshot_destroy(struct snapshot *s);
+uint32_t snapshot_begin_pass(struct snapshot *s);
+int snapshot_add(struct snapshot *s, const char *path, const struct stat *statbuf, const char *link, int keep_stale);
+void snapshot_sweep(struct snapshot *s, const char *path);
+void snapshot_remove(struct snapshot *s, const char *path);
+void snapshot_invalidate(struct snapshot *s, const char *path, int parent);
+int snapshot_stale_dirs(struct snapshot *s, char ***paths);
+int snapshot_getattr(struct snapshot *s, const char *path, struct stat *statbuf);
+int snapshot_readlink(struct snapshot *s, const char *path, char *link, size_t size);
+int snapshot_readdir(struct snapshot *s, const char *path,
+                     int (*fill)(void *arg, const char *name, mode_t mode), void *arg);
+size_t snapshot_memory(struct snapshot *s);
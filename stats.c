@@ -0,0 +1,129 @@
+/*
+  Operation statistics
+
+  Every FUSE operation is timed by a wrapper in bbfs.c and recorded here:
+  a call count, errors, bytes for reads and writes, and a latency
+  histogram. Recording is a handful of relaxed atomic adds, so it is
+  always on. The counters are shown in /.bbfs/stats under the mount and
+  logged at unmount.
+*/
+
+#include "stats.h"
+
+#include <string.h>
+#include <time.h>
+
+static const char *stats_names[STATS_OPS] = {
+  "getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir", "symlink", "rename",
+  "link", "chmod", "chown", "truncate", "utime", "open", "read", "write",
+  "statfs", "flush", "release", "fsync", "setxattr", "getxattr", "listxattr", "removexattr",
+  "opendir", "readdir", "releasedir", "fsyncdir", "access", "ftruncate", "fgetattr",
+};
+
+const char *stats_name(enum stats_op op) {
+  return stats_names[op];
+}
+
+/**
+ * The operation called name, or -1
+ */
+int stats_op_named(const char *name) {
+  for (int op = 0; op < STATS_OPS; op++) {
+    if (strcmp(stats_names[op], name) == 0) {
+      return op;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Monotonic time in nanoseconds
+ */
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int stats_bucket(uint64_t ns) {
+  if (ns < (1u << STATS_SUB_BITS)) {
+    return ns;
+  }
+  unsigned int top = 63 - __builtin_clzll(ns);
+  unsigned int shift = top - STATS_SUB_BITS;
+  return ((shift + 1) << STATS_SUB_BITS) + ((ns >> shift) & ((1u << STATS_SUB_BITS) - 1));
+}
+
+/**
+ * Largest latency that falls in bucket b
+ */
+static uint64_t stats_bucket_top(unsigned int b) {
+  if (b < (1u << STATS_SUB_BITS)) {
+    return b;
+  }
+  unsigned int shift = (b >> STATS_SUB_BITS) - 1;
+  uint64_t low = ((uint64_t) (1u << STATS_SUB_BITS) + (b & ((1u << STATS_SUB_BITS) - 1))) << shift;
+  return low + (((uint64_t) 1 << shift) - 1);
+}
+
+/**
+ * Count a call of op that started at start (from stats_now) and returned
+ * retstat. Returns its latency.
+ */
+uint64_t stats_record(struct stats *s, enum stats_op op, uint64_t start, int retstat) {
+  struct stats_counters *c = &s->ops[op];
+  uint64_t ns = stats_now() - start;
+  __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+  if (retstat < 0) {
+    __atomic_fetch_add(&c->errors, 1, __ATOMIC_RELAXED);
+  } else if (op == STATS_READ || op == STATS_WRITE) {
+    __atomic_fetch_add(&c->bytes, retstat, __ATOMIC_RELAXED);
+  }
+  unsigned long long max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&c->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return ns;
+}
+
+/**
+ * The latency below which fraction of the calls fall, to within a bucket
+ */
+uint64_t stats_percentile(const struct stats_counters *c, double fraction) {
+  unsigned long total = 0, seen = 0;
+  for (unsigned int b = 0; b < STATS_BUCKETS; b++) {
+    total += __atomic_load_n(&c->buckets[b], __ATOMIC_RELAXED);
+  }
+  unsigned long want = (unsigned long) (fraction * total + 0.5);
+  for (unsigned int b = 0; b < STATS_BUCKETS; b++) {
+    seen += __atomic_load_n(&c->buckets[b], __ATOMIC_RELAXED);
+    if (seen >= want && seen > 0) {
+      // the top of the last bucket may lie beyond the slowest call
+      uint64_t top = stats_bucket_top(b), max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+      return top < max ? top : max;
+    }
+  }
+  return 0;
+}
+
+/**
+ * One line per operation that was called, latencies in microseconds
+ */
+void stats_print(struct stats *s, FILE *f) {
+  fprintf(f, "%-12s %10s %8s %10s %10s %10s %10s %10s %14s\n",
+          "op", "calls", "errors", "mean_us", "p50_us", "p90_us", "p99_us", "max_us", "bytes");
+  for (int op = 0; op < STATS_OPS; op++) {
+    struct stats_counters *c = &s->ops[op];
+    unsigned long calls = __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+    if (calls == 0) {
+      continue;
+    }
+    fprintf(f, "%-12s %10lu %8lu %10.1f %10.1f %10.1f %10.1f %10.1f %14llu\n", stats_names[op], calls,
+            __atomic_load_n(&c->errors, __ATOMIC_RELAXED),
+            __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED) / 1e3 / calls,
+            stats_percentile(c, 0.5) / 1e3, stats_percentile(c, 0.9) / 1e3, stats_percentile(c, 0.99) / 1e3,
+            __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED) / 1e3,
+            __atomic_load_n(&c->bytes, __ATOMIC_RELAXED));
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_DIR "/.bbfs"
+#define STATS_FILE "/.bbfs/stats"
+
+// Latencies are kept in log-linear buckets: 2^STATS_SUB_BITS per power
+// of two, so a bucket is within 1/16 of the values it holds, and every
+// latency from 1ns up fits in a fixed table.
+#define STATS_SUB_BITS 4
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+enum stats_op {
+  STATS_GETATTR,
+  STATS_READLINK,
+  STATS_MKNOD,
+  STATS_MKDIR,
+  STATS_UNLINK,
+  STATS_RMDIR,
+  STATS_SYMLINK,
+  STATS_RENAME,
+  STATS_LINK,
+  STATS_CHMOD,
+  STATS_CHOWN,
+  STATS_TRUNCATE,
+  STATS_UTIME,
+  STATS_OPEN,
+  STATS_READ,
+  STATS_WRITE,
+  STATS_STATFS,
+  STATS_FLUSH,
+  STATS_RELEASE,
+  STATS_FSYNC,
+  STATS_SETXATTR,
+  STATS_GETXATTR,
+  STATS_LISTXATTR,
+  STATS_REMOVEXATTR,
+  STATS_OPENDIR,
+  STATS_READDIR,
+  STATS_RELEASEDIR,
+  STATS_FSYNCDIR,
+  STATS_ACCESS,
+  STATS_FTRUNCATE,
+  STATS_FGETATTR,
+  STATS_OPS
+};
+
+// Counters of one FUSE operation, updated with relaxed atomics
+struct stats_counters {
+  unsigned long calls;
+  unsigned long errors; // calls that returned a negative errno
+  unsigned long long bytes; // read or written
+  unsigned long long total_ns;
+  unsigned long long max_ns;
+  unsigned long buckets[STATS_BUCKETS];
+};
+
+struct stats {
+  struct stats_counters ops[STATS_OPS];
+};
+
+const char *stats_name(enum stats_op op);
+int stats_op_named(const char *name);
+uint64_t stats_now(void);
+uint64_t stats_record(struct stats *s, enum stats_op op, uint64_t start, int retstat);
+uint64_t stats_percentile(const struct stats_counters *c, double fraction);
+void stats_print(struct stats *s, FILE *f);
@@ -0,0 +1,134 @@
+/*
+  Operation traces
+
+  With -o trace=FILE every FUSE operation is written to FILE as one line
+  with what it was asked (path, offset, size, flags) and how long it took,
+  in the order the operations finish. bbfs-replay issues a trace again
+  against a mount, so caching and prefetch changes can be measured with
+  real access patterns. Lines are formatted by the calling thread and
+  appended to a fully buffered stream under a lock.
+*/
+
+#include "trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_BUFFER (1 << 20)
+
+/**
+ * Start a trace in the file at path. Returns 0, or -errno
+ */
+int trace_open(struct trace *t, const char *path) {
+  t->file = fopen(path, "w");
+  if (t->file == NULL) {
+    return -errno;
+  }
+  setvbuf(t->file, NULL, _IOFBF, TRACE_BUFFER);
+  fprintf(t->file, "%s: start_ns latency_ns op result handle offset size arg path [path2]\n", TRACE_MAGIC);
+  pthread_mutex_init(&t->lock, NULL);
+  t->start = stats_now();
+  return 0;
+}
+
+void trace_close(struct trace *t) {
+  if (t->file == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&t->lock);
+  fclose(t->file);
+  t->file = NULL;
+  pthread_mutex_unlock(&t->lock);
+}
+
+static char *trace_escape(char *out, char *end, const char *s) {
+  for (; *s != '\0' && out + 2 < end; s++) {
+    switch (*s) {
+    case '\t': *out++ = '\\'; *out++ = 't'; break;
+    case '\n': *out++ = '\\'; *out++ = 'n'; break;
+    case '\\': *out++ = '\\'; *out++ = '\\'; break;
+    default: *out++ = *s;
+    }
+  }
+  return out;
+}
+
+/**
+ * Append ev to the trace. ev->start_ns is a stats_now() time; it is
+ * written relative to the start of the trace.
+ */
+void trace_record(struct trace *t, const struct trace_event *ev) {
+  char line[TRACE_LINE_MAX];
+  char *end = line + sizeof(line) - 2;
+  int n = snprintf(line, sizeof(line), "%" PRIu64 "\t%" PRIu64 "\t%s\t%d\t%" PRIu64 "\t%" PRId64 "\t%" PRIu64 "\t%d\t",
+                   ev->start_ns - t->start, ev->latency_ns, stats_name(ev->op), ev->result,
+                   ev->handle, ev->offset, ev->size, ev->arg);
+  char *p = trace_escape(line + n, end, ev->path != NULL ? ev->path : "");
+  if (ev->path2 != NULL) {
+    *p++ = '\t';
+    p = trace_escape(p, end, ev->path2);
+  }
+  *p++ = '\n';
+
+  pthread_mutex_lock(&t->lock);
+  if (t->file != NULL) {
+    fwrite(line, 1, p - line, t->file);
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+static char *trace_unescape(char *s) {
+  char *out = s;
+  for (char *in = s; *in != '\0'; in++) {
+    if (*in == '\\' && in[1] != '\0') {
+      in++;
+      *out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = '\0';
+  return s;
+}
+
+/**
+ * Read a trace line into ev, whose paths then point into line. Returns 0,
+ * or -1 for comments and malformed lines.
+ */
+int trace_parse(char *line, struct trace_event *ev) {
+  char *fields[10];
+  int n = 0;
+  if (line[0] == '#') {
+    return -1;
+  }
+  line[strcspn(line, "\n")] = '\0';
+  for (char *p = line; n < 10; n++) {
+    fields[n] = p;
+    p = strchr(p, '\t');
+    if (p == NULL) {
+      n++;
+      break;
+    }
+    *p++ = '\0';
+  }
+  if (n < 9) {
+    return -1;
+  }
+  int op = stats_op_named(fields[2]);
+  if (op < 0) {
+    return -1;
+  }
+  ev->start_ns = strtoull(fields[0], NULL, 10);
+  ev->latency_ns = strtoull(fields[1], NULL, 10);
+  ev->op = op;
+  ev->result = atoi(fields[3]);
+  ev->handle = strtoull(fields[4], NULL, 10);
+  ev->offset = strtoll(fields[5], NULL, 10);
+  ev->size = strtoull(fields[6], NULL, 10);
+  ev->arg = atoi(fields[7]);
+  ev->path = trace_unescape(fields[8]);
+  ev->path2 = n > 9 ? trace_unescape(fields[9]) : NULL;
+  return 0;
+}
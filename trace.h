@@ -0,0 +1,42 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+#define TRACE_MAGIC "# bbfs trace 1"
+#define TRACE_LINE_MAX (2 * 4096 * 2 + 256) // two escaped paths and the numbers
+
+// One traced FUSE operation, a line of the trace file:
+//   start_ns latency_ns op result handle offset size arg path [path2]
+// separated by tabs. Times are from the mount, handle numbers the opens
+// (0 if the operation has no open file), arg is the open flags, mode,
+// access mask or datasync flag, and path2 the second path of rename,
+// link and symlink or the xattr name. Tabs, newlines and backslashes in
+// paths are escaped C style.
+struct trace_event {
+  uint64_t start_ns;
+  uint64_t latency_ns;
+  enum stats_op op;
+  int result;
+  uint64_t handle;
+  int64_t offset;
+  uint64_t size;
+  int arg;
+  const char *path;
+  const char *path2; // NULL if there is none
+};
+
+struct trace {
+  FILE *file; // NULL when not tracing
+  pthread_mutex_t lock;
+  uint64_t start; // stats_now() at mount
+  uint64_t handles; // last handle number given out
+};
+
+int trace_open(struct trace *t, const char *path);
+void trace_close(struct trace *t);
+void trace_record(struct trace *t, const struct trace_event *ev);
+int trace_parse(char *line, struct trace_event *ev);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <utime.h>
+
+// Where the files behind the mount live and how they are reached. bbfs
+// caches, tracks and schedules; a transport only moves metadata and bytes.
+// Paths are full remote paths, results 0 or a byte count, or a negative
+// errno. Every function gets ctx as its first argument.
+//
+// Calls are made holding a connection of the pool (see bb_conn_get), which
+// a transport without connections may ignore, except lstat, readlink,
+// readdir and access: these lookups are made without one, so a transport
+// that can answer them elsewhere does not tie one up.
+struct transport {
+  const char *name;
+  void *ctx;
+
+  int (*lstat)(void *ctx, const char *path, struct stat *statbuf);
+  int (*stat)(void *ctx, const char *path, struct stat *statbuf);
+  // fill is called for every entry except . and .., until it returns nonzero
+  int (*readdir)(void *ctx, const char *path,
+                 int (*fill)(void *arg, const char *name, const struct stat *statbuf), void *arg);
+  int (*readlink)(void *ctx, const char *path, char *link, size_t size); // NUL-terminated
+  int (*access)(void *ctx, const char *path, int mask);
+  int (*statvfs)(void *ctx, const char *path, struct statvfs *statv);
+
+  // Ranged reads and writes through a handle. A read returns 0 at the end
+  // of the file; both may move fewer bytes than asked.
+  int (*open)(void *ctx, const char *path, int flags, void **file);
+  ssize_t (*read)(void *ctx, void *file, void *buf, size_t size, off_t offset);
+  ssize_t (*write)(void *ctx, void *file, const void *buf, size_t size, off_t offset);
+  void (*close)(void *ctx, void *file);
+  // Readahead, NULL if not supported: read_begin asks for a range and
+  // returns a request id, read_end collects it, or returns -EAGAIN if it
+  // has not arrived and wait is not set.
+  int (*read_begin)(void *ctx, void *file, size_t size, off_t offset);
+  ssize_t (*read_end)(void *ctx, void *file, void *buf, size_t size, int id, int wait);
+
+  // Whole files. get writes the remote file, size bytes when last stat'ed,
+  // to fd and returns the bytes it got; put replaces the remote file with
+  // the size bytes of fd, which held old_size bytes at the last sync.
+  off_t (*get)(void *ctx, const char *path, int fd, off_t size);
+  int (*put)(void *ctx, const char *path, int fd, off_t size, off_t old_size);
+
+  int (*mknod)(void *ctx, const char *path, mode_t mode, dev_t dev);
+  int (*mkdir)(void *ctx, const char *path, mode_t mode);
+  int (*unlink)(void *ctx, const char *path);
+  int (*rmdir)(void *ctx, const char *path);
+  int (*symlink)(void *ctx, const char *target, const char *path);
+  int (*rename)(void *ctx, const char *path, const char *newpath);
+  int (*link)(void *ctx, const char *path, const char *newpath);
+  int (*chmod)(void *ctx, const char *path, mode_t mode);
+  int (*chown)(void *ctx, const char *path, uid_t uid, gid_t gid);
+  int (*truncate)(void *ctx, const char *path, off_t size);
+  int (*utime)(void *ctx, const char *path, struct utimbuf *ubuf); // NULL ubuf for now
+
+  // Extended attributes, NULL if not supported
+  int (*setxattr)(void *ctx, const char *path, const char *name, const char *value, size_t size, int flags);
+  int (*getxattr)(void *ctx, const char *path, const char *name, char *value, size_t size);
+  int (*listxattr)(void *ctx, const char *path, char *list, size_t size);
+  int (*removexattr)(void *ctx, const char *path, const char *name);
+};
+
+int transport_local_init(struct transport *t, double latency_ms, double mbit);
+void transport_local_destroy(struct transport *t);
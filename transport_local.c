@@ -0,0 +1,352 @@
+/*
+  Local directory transport
+
+  Serves a directory of this machine as the remote side, so the caching
+  layers can be measured without ssh, ciphers or a network in the way. A
+  simulated link can be put in front of it: every call waits one round
+  trip of latency_ms, and the bytes moved by reads, writes and whole-file
+  transfers are paced to mbit, shared by all callers as one link is.
+*/
+
+#include "transport.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define LOCAL_CHUNK 65536
+
+struct local {
+  double latency; // seconds per round trip, 0 for none
+  double rate; // bytes per second, 0 for no limit
+  pthread_mutex_t lock;
+  double link_free; // when the bytes already paced are through
+};
+
+struct local_file {
+  int fd;
+};
+
+static int local_result(int rc) {
+  return rc < 0 ? -errno : rc;
+}
+
+/**
+ * Wait until bytes have gone over the link, after those of the other
+ * callers, and then one round trip if round_trip is set
+ */
+static void local_delay(struct local *l, size_t bytes, int round_trip) {
+  if ((l->latency <= 0 || !round_trip) && (l->rate <= 0 || bytes == 0)) {
+    return;
+  }
+  double now = bb_now(), until = now;
+  if (l->rate > 0 && bytes > 0) {
+    pthread_mutex_lock(&l->lock);
+    until = (l->link_free > now ? l->link_free : now) + bytes / l->rate;
+    l->link_free = until;
+    pthread_mutex_unlock(&l->lock);
+  }
+  if (round_trip) {
+    until += l->latency;
+  }
+  struct timespec ts;
+  ts.tv_sec = (time_t) until;
+  ts.tv_nsec = (long) ((until - ts.tv_sec) * 1e9);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+static int local_lstat(void *ctx, const char *path, struct stat *statbuf) {
+  local_delay(ctx, 0, 1);
+  return local_result(lstat(path, statbuf));
+}
+
+static int local_stat(void *ctx, const char *path, struct stat *statbuf) {
+  local_delay(ctx, 0, 1);
+  return local_result(stat(path, statbuf));
+}
+
+static int local_readdir(void *ctx, const char *path,
+                         int (*fill)(void *arg, const char *name, const struct stat *statbuf), void *arg) {
+  local_delay(ctx, 0, 1);
+  DIR *dp = opendir(path);
+  if (dp == NULL) {
+    return -errno;
+  }
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    struct stat st;
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0
+        || fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      continue;
+    }
+    if (fill(arg, de->d_name, &st) != 0) {
+      break;
+    }
+  }
+  closedir(dp);
+  return 0;
+}
+
+static int local_readlink(void *ctx, const char *path, char *link, size_t size) {
+  local_delay(ctx, 0, 1);
+  ssize_t n = readlink(path, link, size - 1);
+  if (n < 0) {
+    return -errno;
+  }
+  link[n] = '\0';
+  return 0;
+}
+
+static int local_access(void *ctx, const char *path, int mask) {
+  local_delay(ctx, 0, 1);
+  return local_result(access(path, mask));
+}
+
+static int local_statvfs(void *ctx, const char *path, struct statvfs *statv) {
+  local_delay(ctx, 0, 1);
+  return local_result(statvfs(path, statv));
+}
+
+static int local_open(void *ctx, const char *path, int flags, void **file) {
+  local_delay(ctx, 0, 1);
+  struct local_file *f = malloc(sizeof(struct local_file));
+  if (f == NULL) {
+    return -ENOMEM;
+  }
+  f->fd = open(path, flags);
+  if (f->fd < 0) {
+    int retstat = -errno;
+    free(f);
+    return retstat;
+  }
+  *file = f;
+  return 0;
+}
+
+static ssize_t local_read(void *ctx, void *file, void *buf, size_t size, off_t offset) {
+  ssize_t n = pread(((struct local_file *) file)->fd, buf, size, offset);
+  if (n < 0) {
+    return -errno;
+  }
+  local_delay(ctx, n, 1);
+  return n;
+}
+
+static ssize_t local_write(void *ctx, void *file, const void *buf, size_t size, off_t offset) {
+  local_delay(ctx, size, 1);
+  ssize_t n = pwrite(((struct local_file *) file)->fd, buf, size, offset);
+  return n < 0 ? -errno : n;
+}
+
+static void local_close(void *ctx, void *file) {
+  local_delay(ctx, 0, 1);
+  close(((struct local_file *) file)->fd);
+  free(file);
+}
+
+/**
+ * Copy in to out from the start until in ends, or size bytes if size is
+ * not negative, pacing each chunk. Returns the bytes copied.
+ */
+static off_t local_copy(struct local *l, int in, int out, off_t size) {
+  char *buf = malloc(LOCAL_CHUNK);
+  if (buf == NULL) {
+    return -ENOMEM;
+  }
+  off_t done = 0;
+  while (size < 0 || done < size) {
+    size_t want = size >= 0 && size - done < LOCAL_CHUNK ? size - done : LOCAL_CHUNK;
+    ssize_t n = pread(in, buf, want, done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n < 0 || size >= 0) {
+        done = n < 0 ? -errno : -EIO;
+      }
+      break;
+    }
+    local_delay(l, n, 0);
+    for (ssize_t w = 0; w < n; ) {
+      ssize_t m = pwrite(out, buf + w, n - w, done + w);
+      if (m < 0 && errno != EINTR) {
+        free(buf);
+        return -errno;
+      }
+      w += m > 0 ? m : 0;
+    }
+    done += n;
+  }
+  free(buf);
+  return done;
+}
+
+static off_t local_get(void *ctx, const char *path, int fd, off_t size) {
+  local_delay(ctx, 0, 1);
+  int in = open(path, O_RDONLY);
+  if (in < 0) {
+    return -errno;
+  }
+  off_t got = local_copy(ctx, in, fd, -1);
+  close(in);
+  return got;
+}
+
+static int local_put(void *ctx, const char *path, int fd, off_t size, off_t old_size) {
+  local_delay(ctx, 0, 1);
+  int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (out < 0) {
+    return -errno;
+  }
+  off_t sent = local_copy(ctx, fd, out, size);
+  if (close(out) < 0 && sent >= 0) {
+    return -errno;
+  }
+  return sent < 0 ? (int) sent : 0;
+}
+
+static int local_mknod(void *ctx, const char *path, mode_t mode, dev_t dev) {
+  local_delay(ctx, 0, 1);
+  if (S_ISREG(mode)) {
+    int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, mode);
+    return fd < 0 ? -errno : local_result(close(fd));
+  }
+  if (S_ISFIFO(mode)) {
+    return local_result(mkfifo(path, mode));
+  }
+  return local_result(mknod(path, mode, dev));
+}
+
+static int local_mkdir(void *ctx, const char *path, mode_t mode) {
+  local_delay(ctx, 0, 1);
+  return local_result(mkdir(path, mode));
+}
+
+static int local_unlink(void *ctx, const char *path) {
+  local_delay(ctx, 0, 1);
+  return local_result(unlink(path));
+}
+
+static int local_rmdir(void *ctx, const char *path) {
+  local_delay(ctx, 0, 1);
+  return local_result(rmdir(path));
+}
+
+static int local_symlink(void *ctx, const char *target, const char *path) {
+  local_delay(ctx, 0, 1);
+  return local_result(symlink(target, path));
+}
+
+static int local_rename(void *ctx, const char *path, const char *newpath) {
+  local_delay(ctx, 0, 1);
+  return local_result(rename(path, newpath));
+}
+
+static int local_link(void *ctx, const char *path, const char *newpath) {
+  local_delay(ctx, 0, 1);
+  return local_result(link(path, newpath));
+}
+
+static int local_chmod(void *ctx, const char *path, mode_t mode) {
+  local_delay(ctx, 0, 1);
+  return local_result(chmod(path, mode));
+}
+
+static int local_chown(void *ctx, const char *path, uid_t uid, gid_t gid) {
+  local_delay(ctx, 0, 1);
+  return local_result(chown(path, uid, gid));
+}
+
+static int local_truncate(void *ctx, const char *path, off_t size) {
+  local_delay(ctx, 0, 1);
+  return local_result(truncate(path, size));
+}
+
+static int local_utime(void *ctx, const char *path, struct utimbuf *ubuf) {
+  local_delay(ctx, 0, 1);
+  return local_result(utime(path, ubuf));
+}
+
+static int local_setxattr(void *ctx, const char *path, const char *name, const char *value, size_t size, int flags) {
+  local_delay(ctx, size, 1);
+  return local_result(lsetxattr(path, name, value, size, flags));
+}
+
+static int local_getxattr(void *ctx, const char *path, const char *name, char *value, size_t size) {
+  local_delay(ctx, 0, 1);
+  return local_result(lgetxattr(path, name, value, size));
+}
+
+static int local_listxattr(void *ctx, const char *path, char *list, size_t size) {
+  local_delay(ctx, 0, 1);
+  return local_result(llistxattr(path, list, size));
+}
+
+static int local_removexattr(void *ctx, const char *path, const char *name) {
+  local_delay(ctx, 0, 1);
+  return local_result(lremovexattr(path, name));
+}
+
+/**
+ * Set t up to serve a local directory, behind a link with latency_ms of
+ * round-trip time and mbit of bandwidth (0 for none). Returns 0, or -1.
+ */
+int transport_local_init(struct transport *t, double latency_ms, double mbit) {
+  struct local *l = malloc(sizeof(struct local));
+  if (l == NULL) {
+    return -1;
+  }
+  l->latency = latency_ms > 0 ? latency_ms / 1e3 : 0;
+  l->rate = mbit > 0 ? mbit * 1e6 / 8 : 0;
+  pthread_mutex_init(&l->lock, NULL);
+  l->link_free = 0;
+
+  memset(t, 0, sizeof(struct transport));
+  t->name = "local";
+  t->ctx = l;
+  t->lstat = local_lstat;
+  t->stat = local_stat;
+  t->readdir = local_readdir;
+  t->readlink = local_readlink;
+  t->access = local_access;
+  t->statvfs = local_statvfs;
+  t->open = local_open;
+  t->read = local_read;
+  t->write = local_write;
+  t->close = local_close;
+  t->get = local_get;
+  t->put = local_put;
+  t->mknod = local_mknod;
+  t->mkdir = local_mkdir;
+  t->unlink = local_unlink;
+  t->rmdir = local_rmdir;
+  t->symlink = local_symlink;
+  t->rename = local_rename;
+  t->link = local_link;
+  t->chmod = local_chmod;
+  t->chown = local_chown;
+  t->truncate = local_truncate;
+  t->utime = local_utime;
+  t->setxattr = local_setxattr;
+  t->getxattr = local_getxattr;
+  t->listxattr = local_listxattr;
+  t->removexattr = local_removexattr;
+  return 0;
+}
+
+void transport_local_destroy(struct transport *t) {
+  struct local *l = t->ctx;
+  pthread_mutex_destroy(&l->lock);
+  free(l);
+  t->ctx = NULL;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// FNV-1a hash of a NUL-terminated string, used to index the path tables.
+static inline uint32_t bb_hash(const char *s) {
+  uint32_t h = 2166136261u;
+  for (; *s; s++) {
+    h ^= (unsigned char) *s;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Monotonic time in seconds, for expiring cache entries.
+static inline double bb_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 64-bit FNV-1a, for names that must not collide in practice.
+static inline uint64_t bb_hash64(const char *s) {
+  uint64_t h = 14695981039346656037ull;
+  for (; *s; s++) {
+    h ^= (unsigned char) *s;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// Add to a statistics counter that several threads may update.
+#define bb_count(counter, n) ((void) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED))
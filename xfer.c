@@ -0,0 +1,259 @@
+/*
+  Parallel transfer
+
+  One scp stream is bound by the SSH window and by one cipher thread, so
+  on long fat links a large file moves at a fraction of the bandwidth.
+  Here the file is cut into ranges that several connections take in turn,
+  each reading with a window of requests in flight, and the number of
+  connections and the range size follow the throughput observed.
+*/
+
+#include "xfer.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A transfer shared by its streams
+struct xfer_job {
+  pthread_mutex_t lock;
+  const char *remotepath;
+  int fd;
+  off_t size;
+  off_t next; // start of the first range no stream has taken
+  size_t range;
+  size_t chunk; // bytes per sftp request
+  int upload;
+  int failed;
+};
+
+struct xfer_stream {
+  struct xfer_job *job;
+  struct bb_conn *conn;
+  pthread_t thread;
+};
+
+void xfer_tuner_init(struct xfer_tuner *t, int max_streams) {
+  pthread_mutex_init(&t->lock, NULL);
+  t->max_streams = max_streams < 1 ? 1 : max_streams > XFER_STREAMS_MAX ? XFER_STREAMS_MAX : max_streams;
+  t->streams = t->max_streams < 2 ? t->max_streams : 2;
+  t->step = 1;
+  t->range = XFER_RANGE_INIT;
+  t->rate = 0;
+  t->transfers = 0;
+  t->bytes = 0;
+}
+
+/**
+ * Streams and range size for the next transfer
+ */
+int xfer_tuner_plan(struct xfer_tuner *t, size_t *range) {
+  pthread_mutex_lock(&t->lock);
+  int streams = t->streams;
+  *range = t->range;
+  pthread_mutex_unlock(&t->lock);
+  return streams;
+}
+
+/**
+ * Learn from a finished transfer. One that got fewer streams than planned,
+ * because connections were busy, only resizes the ranges.
+ */
+void xfer_tuner_update(struct xfer_tuner *t, int streams, off_t bytes, double secs) {
+  if (secs <= 0 || streams < 1) {
+    return;
+  }
+  double rate = bytes / secs;
+  pthread_mutex_lock(&t->lock);
+  t->transfers++;
+  t->bytes += bytes;
+  if (streams == t->streams) {
+    if (t->rate > 0 && rate < t->rate) {
+      t->step = -t->step;
+    }
+    t->rate = rate;
+    t->streams += t->step;
+    if (t->streams < 1 || t->streams > t->max_streams) {
+      t->step = -t->step;
+      t->streams += 2 * t->step;
+    }
+    if (t->streams < 1 || t->streams > t->max_streams) {
+      t->streams = 1; // max_streams is 1
+    }
+  }
+  double range = rate / streams * XFER_RANGE_SECS;
+  range = range < XFER_RANGE_MIN ? XFER_RANGE_MIN : range > XFER_RANGE_MAX ? XFER_RANGE_MAX : range;
+  t->range = (size_t) range & ~(size_t) (XFER_RANGE_MIN - 1);
+  pthread_mutex_unlock(&t->lock);
+}
+
+static int xfer_claim(struct xfer_job *job, off_t *start, off_t *end) {
+  pthread_mutex_lock(&job->lock);
+  int ok = !job->failed && job->next < job->size;
+  if (ok) {
+    *start = job->next;
+    *end = job->size - job->next < (off_t) job->range ? job->size : job->next + (off_t) job->range;
+    job->next = *end;
+  }
+  pthread_mutex_unlock(&job->lock);
+  return ok;
+}
+
+/**
+ * Read [start, end) into the local file with XFER_WINDOW requests in
+ * flight, buf holding one chunk per request. A reply may be shorter than
+ * asked, as OpenSSH caps reads at about 255 KiB; the rest of it is asked
+ * for again in the next free slot.
+ */
+static int xfer_get_range(sftp_file file, struct xfer_job *job, char *buf, off_t start, off_t end) {
+  int ids[XFER_WINDOW];
+  uint32_t lens[XFER_WINDOW];
+  off_t offsets[XFER_WINDOW];
+  int head = 0, n = 0;
+  off_t next = start, rest = 0;
+  uint32_t restlen = 0;
+  while (n > 0 || next < end || restlen > 0) {
+    while (n < XFER_WINDOW && (restlen > 0 || next < end)) {
+      int slot = (head + n) % XFER_WINDOW;
+      if (restlen > 0) {
+        offsets[slot] = rest;
+        lens[slot] = restlen;
+        restlen = 0;
+      } else {
+        offsets[slot] = next;
+        lens[slot] = end - next < (off_t) job->chunk ? end - next : job->chunk;
+        next += lens[slot];
+      }
+      if (sftp_seek64(file, offsets[slot]) < 0) {
+        return -1;
+      }
+      ids[slot] = sftp_async_read_begin(file, lens[slot]);
+      if (ids[slot] < 0) {
+        return -1;
+      }
+      n++;
+    }
+    char *data = buf + (size_t) head * job->chunk;
+    // nothing at all before the end of the range means the remote file
+    // shrank, the copy would be wrong
+    int nread = sftp_async_read(file, data, lens[head], ids[head]);
+    if (nread <= 0 || pwrite(job->fd, data, nread, offsets[head]) != nread) {
+      return -1;
+    }
+    if ((uint32_t) nread < lens[head]) {
+      rest = offsets[head] + nread;
+      restlen = lens[head] - nread;
+    }
+    head = (head + 1) % XFER_WINDOW;
+    n--;
+  }
+  return 0;
+}
+
+/**
+ * Write [start, end) of the local file to the remote
+ */
+static int xfer_put_range(sftp_file file, struct xfer_job *job, char *buf, off_t start, off_t end) {
+  if (sftp_seek64(file, start) < 0) {
+    return -1;
+  }
+  for (off_t w = start; w < end; ) {
+    size_t want = end - w < (off_t) job->chunk ? end - w : job->chunk;
+    ssize_t nread = pread(job->fd, buf, want, w);
+    if (nread <= 0) {
+      return -1;
+    }
+    for (ssize_t done = 0; done < nread; ) {
+      ssize_t nwritten = sftp_write(file, buf + done, nread - done);
+      if (nwritten <= 0) {
+        return -1;
+      }
+      done += nwritten;
+    }
+    w += nread;
+  }
+  return 0;
+}
+
+static void *xfer_stream(void *arg) {
+  struct xfer_stream *stream = arg;
+  struct xfer_job *job = stream->job;
+  sftp_file file = sftp_open(stream->conn->sftp, job->remotepath, job->upload ? O_WRONLY : O_RDONLY, 0);
+  char *buf = malloc(job->chunk * (job->upload ? 1 : XFER_WINDOW));
+  int failed = file == NULL || buf == NULL;
+  off_t start, end;
+  while (!failed && xfer_claim(job, &start, &end)) {
+    failed = (job->upload ? xfer_put_range(file, job, buf, start, end)
+                          : xfer_get_range(file, job, buf, start, end)) < 0;
+  }
+  if (failed) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+  }
+  if (file != NULL) {
+    sftp_close(file);
+  }
+  free(buf);
+  return NULL;
+}
+
+/**
+ * Copy size bytes between the local file fd and remotepath over the n
+ * connections in conns, the first of which the calling thread works on
+ * itself. Uploads leave the remote file exactly size bytes long. Returns
+ * 0, or -1 if any range failed.
+ */
+int xfer_parallel(struct bb_conn **conns, int n, const char *remotepath, int fd, off_t size,
+                  int upload, size_t range, size_t chunk) {
+  struct xfer_job job;
+  pthread_mutex_init(&job.lock, NULL);
+  job.remotepath = remotepath;
+  job.fd = fd;
+  job.size = size;
+  job.next = 0;
+  job.range = range;
+  job.chunk = chunk;
+  job.upload = upload;
+  job.failed = 0;
+  if (upload) {
+    // created once, before any stream writes into it; what the remote file
+    // had beyond size is cut only once every range is in place, so a failed
+    // upload does not leave it emptied
+    sftp_file file = sftp_open(conns[0]->sftp, remotepath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    if (file == NULL) {
+      pthread_mutex_destroy(&job.lock);
+      return -1;
+    }
+    sftp_close(file);
+  } else if (ftruncate(fd, size) < 0) {
+    pthread_mutex_destroy(&job.lock);
+    return -1;
+  }
+
+  // a stream that cannot be started leaves its ranges to the others
+  struct xfer_stream streams[XFER_STREAMS_MAX];
+  int started;
+  for (started = 0; started < n && started < XFER_STREAMS_MAX; started++) {
+    streams[started].job = &job;
+    streams[started].conn = conns[started];
+    if (started > 0 && pthread_create(&streams[started].thread, NULL, xfer_stream, &streams[started]) != 0) {
+      break;
+    }
+  }
+  xfer_stream(&streams[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(streams[i].thread, NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+  if (!job.failed && upload) {
+    struct sftp_attributes_struct attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.flags = SSH_FILEXFER_ATTR_SIZE;
+    attr.size = size;
+    job.failed = sftp_setstat(conns[0]->sftp, remotepath, &attr) != SSH_OK;
+  }
+  return job.failed ? -1 : 0;
+}
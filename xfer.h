@@ -0,0 +1,38 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "connpool.h"
+
+#define XFER_STREAMS 4
+#define XFER_STREAMS_MAX 16
+#define XFER_PARALLEL_MIN (8 << 20)
+#define XFER_RANGE_INIT (4 << 20)
+#define XFER_RANGE_MIN (1 << 20)
+#define XFER_RANGE_MAX (64 << 20)
+#define XFER_RANGE_SECS 0.5
+#define XFER_WINDOW 8
+
+// Chooses how many streams the next large transfer is split over and how
+// big the ranges they take turns on are. The stream count climbs while
+// throughput improves and turns around when it drops; a range is sized to
+// take each stream about XFER_RANGE_SECS at the rate last seen, so fast
+// links get few large ranges and slow ones finish without a long tail.
+struct xfer_tuner {
+  pthread_mutex_t lock;
+  int streams; // for the next transfer
+  int max_streams;
+  int step; // +1 or -1, where streams went last
+  size_t range;
+  double rate; // bytes per second of the last transfer at the planned streams
+  unsigned long transfers;
+  unsigned long long bytes;
+};
+
+void xfer_tuner_init(struct xfer_tuner *t, int max_streams);
+int xfer_tuner_plan(struct xfer_tuner *t, size_t *range);
+void xfer_tuner_update(struct xfer_tuner *t, int streams, off_t bytes, double secs);
+int xfer_parallel(struct bb_conn **conns, int n, const char *remotepath, int fd, off_t size,
+                  int upload, size_t range, size_t chunk);